@@ -80,6 +80,7 @@ uint32_t *root_pagedir;
 uint32_t *pagedir_table;
 struct PmapPagedir *pmappagedir_table;
 pmappagedir_list_t free_pmappagedir_list;
+uint32_t pmap_clear_write_generation;
 
 
 
@@ -73,6 +73,7 @@ extern uint32_t *root_pagedir;
 extern uint32_t *pagedir_table;
 extern struct PmapPagedir *pmappagedir_table;
 extern pmappagedir_list_t free_pmappagedir_list;
+extern uint32_t pmap_clear_write_generation;
 
 
 #endif
@@ -46,6 +46,7 @@ DLIST_TYPE(PmapVPTE, pmap_vpte_list_t, pmap_vpte_list_link_t);
 struct Pmap
 {
   uint32_t *l1_table; // Page table
+  uint32_t generation;  // Incremented when a mapping is removed or changed, see pmap_get_generation()
 };
 
 
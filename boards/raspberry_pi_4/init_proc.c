@@ -192,6 +192,45 @@ void init_processes(void)
 
   thread_start(timer_thread);
 
+  readahead_thread = do_create_thread(root_process, readahead_task, NULL, NULL,
+                               SCHED_RR, SCHED_PRIO_CACHE_HANDLER, 
+                               THREADF_KERNEL, false, 
+                               NULL, 0,
+                               NULL,
+                               0,
+                               &cpu_table[0],
+                               "readahead-kt");
+                               
+  klog_info("readahead thread created, tid:%d", get_thread_tid(readahead_thread));
+
+  thread_start(readahead_thread);
+
+  reclaim_thread = do_create_thread(root_process, reclaim_task, NULL, NULL,
+                               SCHED_RR, SCHED_PRIO_CACHE_HANDLER, 
+                               THREADF_KERNEL, false, 
+                               NULL, 0,
+                               NULL,
+                               0,
+                               &cpu_table[0],
+                               "reclaim-kt");
+                               
+  klog_info("reclaim thread created, tid:%d", get_thread_tid(reclaim_thread));
+
+  thread_start(reclaim_thread);
+
+  zero_page_thread = do_create_thread(root_process, zero_page_task, NULL, NULL,
+                               SCHED_OTHER, SCHED_PRIO_ZERO_PAGES, 
+                               THREADF_KERNEL, false, 
+                               NULL, 0,
+                               NULL,
+                               0,
+                               &cpu_table[0],
+                               "zero-kt");
+                               
+  klog_info("zero page thread created, tid:%d", get_thread_tid(zero_page_thread));
+
+  thread_start(zero_page_thread);
+
   cpu_table[0].idle_thread = do_create_thread(root_process, idle_task, NULL, NULL,
                                    SCHED_IDLE, 0, 
                                    THREADF_KERNEL, false, 
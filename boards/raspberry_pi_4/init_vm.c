@@ -64,6 +64,10 @@ void init_vm(void)
   root_pagedir = bootinfo->root_pagedir;
 
   DLIST_INIT(&free_page_queue);
+  DLIST_INIT(&cache_a1in_queue);
+  DLIST_INIT(&cache_am_queue);
+  DLIST_INIT(&zero_page_queue);
+  InitRendez(&zero_page_rendez);
 //  DLIST_INIT(&clean_page_queue);
 
 //  for (int t = 0; t < DIRTY_HASH; t++) {
@@ -166,7 +170,7 @@ void init_memory_map(void)
 
     page_table[t].bflags = 0;
 
-//    page_table[t].expiration_ticks = 0;
+    page_table[t].expiration_ticks = 0;
     
     page_table[t].reference_cnt = 0;
 
@@ -184,6 +188,7 @@ void init_memregion_list(void)
 
   for (int t = 0; t < max_memregion; t++) {
     memregion_table[t].type = MR_TYPE_UNALLOCATED;
+    memregion_table[t].vnode = NULL;
     DLIST_ADD_TAIL(&unused_memregion_list, &memregion_table[t], unused_link);
   }
 }
@@ -237,6 +242,8 @@ void init_free_page_list(vm_addr base, vm_addr ceiling)
       DLIST_ADD_TAIL(&free_page_queue, &page_table[pa / PAGE_SIZE], free_link);
   #endif
       page_table[pa / PAGE_SIZE].bflags = 0;
+      free_page_cnt++;
+      cache_page_cnt++;
     }
   }
 }
@@ -88,6 +88,8 @@ void Main(void)
   max_pipe = NR_PIPE;
   max_isr_handler = NR_ISR_HANDLER;
   max_futex = NR_FUTEX;
+  max_asyncio = NR_ASYNCIO;
+  max_cache_ghost = max_page / 2;
   
   init_bootstrap_allocator();
 
@@ -107,6 +109,8 @@ void Main(void)
   vnode_table       = bootstrap_alloc(max_vnode * sizeof(struct VNode));
   isr_handler_table = bootstrap_alloc(max_isr_handler * sizeof(struct ISRHandler));
   futex_table       = bootstrap_alloc(max_futex * sizeof(struct Futex));
+  asyncio_table     = bootstrap_alloc(max_asyncio * sizeof(struct AsyncIO));
+  cache_ghost_table = bootstrap_alloc(max_cache_ghost * sizeof(struct CacheGhost));
 	
 	
   klog_info("bootloader_base     : %08x", bootinfo->bootloader_base);
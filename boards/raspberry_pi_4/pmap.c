@@ -244,6 +244,7 @@ int pmap_remove(struct AddressSpace *as, vm_addr va)
   
   pmap_write_l2(pt, pte_idx, L2_TYPE_INV);
   hal_invalidate_tlb_va(va);
+  pmap->generation++;
 
   ptpage = pmap_va_to_page((vm_addr)pt);
   ptpage->reference_cnt--;
@@ -258,6 +259,67 @@ int pmap_remove(struct AddressSpace *as, vm_addr va)
 }
 
 
+/*
+ * Replace the page mapped at an address with another page.  The existing
+ * page table is reused so, unlike pmap_remove() followed by pmap_enter(),
+ * this never allocates memory and cannot sleep.
+ */
+int pmap_replace(struct AddressSpace *as, vm_addr va, vm_addr pa, int flags)
+{
+  struct Pmap *pmap;
+  uint32_t *pt, *phys_pt;
+  int pde_idx, pte_idx;
+  vm_addr current_paddr;
+  uint32_t pa_bits;
+  struct Page *page;
+  struct PmapVPTE *vpte;
+  struct PmapVPTE *vpte_base;
+
+  if (va == 0) {
+    return -EFAULT;
+  }
+
+  pmap = &as->pmap;
+  pde_idx = (va & L1_ADDR_BITS) >> L1_IDX_SHIFT;
+
+  if ((pmap->l1_table[pde_idx] & L1_TYPE_MASK) == L1_TYPE_INV) {
+    return -EINVAL;
+  }
+
+  phys_pt = (uint32_t *)(pmap->l1_table[pde_idx] & L1_C_ADDR_MASK);
+  pt = (uint32_t *)pmap_pa_to_va((vm_addr)phys_pt);
+
+  pte_idx = (va & L2_ADDR_BITS) >> L2_IDX_SHIFT;
+  current_paddr = pt[pte_idx] & L2_ADDR_MASK;
+
+  vpte_base = (struct PmapVPTE *)((uint8_t *)pt + VPTE_TABLE_OFFS);
+  vpte = vpte_base + pte_idx;
+
+  if ((pt[pte_idx] & L2_TYPE_MASK) == L2_TYPE_INV) {
+    return -EINVAL;
+  }
+
+  if ((vpte->flags & MAP_PHYS) == 0) {
+    page = pmap_pa_to_page(current_paddr);
+    DLIST_REM_ENTRY(&page->pmap_page.vpte_list, vpte, link);
+  }
+
+  if ((flags & MAP_PHYS) == 0) {
+    page = pmap_pa_to_page(pa);
+    DLIST_ADD_HEAD(&page->pmap_page.vpte_list, vpte, link);
+  }
+
+  vpte->flags = flags;
+  pa_bits = pmap_calc_pa_bits(flags);
+
+  pmap_write_l2(pt, pte_idx, pa | pa_bits);
+  hal_invalidate_tlb_va(va);
+  pmap->generation++;
+  
+  return 0;
+}
+
+
 /*
  * Change protections on a page
  */
@@ -302,6 +364,7 @@ int pmap_protect(struct AddressSpace *as, vm_addr va, int flags)
 
 	pmap_write_l2(pt, pte_idx, pa | pa_bits);
   hal_invalidate_tlb_va(va);
+  pmap->generation++;
   
   return 0;
 }
@@ -444,6 +507,61 @@ uint32_t *pmap_alloc_pagetable(void)
 }
 
 
+/* @brief   Remove write access from every mapping of a page
+ *
+ * @param   page, page to write protect
+ *
+ * Used when a file page mapped with MAP_SHARED is written back so that the
+ * next store to it faults and marks it dirty again.  Each mapping is found
+ * through the page's list of virtual PTEs, which are stored in the same
+ * pagetable page as the hardware PTEs they describe.
+ */
+void pmap_page_clear_write(struct Page *page)
+{
+  struct PmapVPTE *vpte;
+  struct PmapVPTE *vpte_base;
+  uint32_t *pt;
+  int pte_idx;
+  vm_addr pa;
+  
+  vpte = DLIST_HEAD(&page->pmap_page.vpte_list);
+  
+  while (vpte != NULL) {
+    if ((vpte->flags & (PROT_WRITE | MAP_COW)) == PROT_WRITE) {
+      pt = (uint32_t *)ALIGN_DOWN((vm_addr)vpte, PAGE_SIZE);
+      vpte_base = (struct PmapVPTE *)((uint8_t *)pt + VPTE_TABLE_OFFS);
+      pte_idx = vpte - vpte_base;
+      pa = pt[pte_idx] & L2_ADDR_MASK;
+      
+      vpte->flags &= ~PROT_WRITE;
+      pmap_write_l2(pt, pte_idx, pa | pmap_calc_pa_bits(vpte->flags));
+    }
+    
+    vpte = DLIST_NEXT(vpte, link);
+  }
+  
+  // The address spaces of the mappings are not known, see pmap_get_generation()
+  pmap_clear_write_generation++;
+  pmap_flush_tlbs();
+}
+
+
+/* @brief   Get the generation of an address space's mappings
+ *
+ * @param   as, address space
+ * @return  value that changes whenever a mapping of the address space is
+ *          removed or has its protection reduced
+ *
+ * Translations remembered by ipcopy() are only valid while this is unchanged.
+ * Write protecting a page by pmap_page_clear_write() changes the generation
+ * of every address space, as the page's mappings do not record theirs.
+ */
+uint32_t pmap_get_generation(struct AddressSpace *as)
+{
+  return as->pmap.generation + pmap_clear_write_generation;
+}
+
+
 /*
  *
  */
@@ -498,6 +616,7 @@ int pmap_create(struct AddressSpace *as)
   }
 
   as->pmap.l1_table = pd;
+  as->pmap.generation++;
 
   return 0;
 }
@@ -512,6 +631,7 @@ void pmap_destroy(struct AddressSpace *as)
   int index;
   
   pd = as->pmap.l1_table;
+  as->pmap.generation++;
 
   index = (pd - pagedir_table) / 4096; 
   
@@ -625,39 +745,39 @@ int pmap_pagetable_walk(struct AddressSpace *as, uint32_t access, void *vaddr, v
   vm_addr bvaddr;
   vm_addr bpaddr;
   uint32_t flags;
-  bool fault = false;
+  bool fault;
   uint32_t page_offset;
   
   bvaddr = ALIGN_DOWN((vm_addr)vaddr, PAGE_SIZE);
   page_offset = (vm_addr)vaddr % PAGE_SIZE;
   
-  if (pmap_extract(as, bvaddr, &bpaddr, &flags) == 0) {
-    if (access & PROT_WRITE) {
-      if (flags & PROT_WRITE) {
-        if (flags & MAP_COW) {
-          fault = true;
-        }
-      } else {      
-        klog_warn("pmap_pagetable_walk -EFAULT write on non-write page");
-        return -EFAULT;
-      }
+  // Fault until the page is present with the access needed.  Faults on file
+  // mappings may sleep and return before the mapping is changed, so check again.
+  while (1) {
+    if (pmap_extract(as, bvaddr, &bpaddr, &flags) != 0) {
+      // Not present, file mappings are faulted in lazily
+      fault = true;
+    } else if ((access & PROT_WRITE) == 0) {
+      fault = false;
+    } else if (flags & PROT_WRITE) {
+      fault = (flags & MAP_COW) ? true : false;
+    } else if ((flags & MAP_PHYS) == 0 && (pmap_pa_to_page(bpaddr)->bflags & B_MAPPED)) {
+      // Clean MAP_SHARED file page, write fault marks it dirty
+      fault = true;
+    } else {
+      klog_warn("pmap_pagetable_walk -EFAULT write on non-write page");
+      return -EFAULT;
     }
-  } else {
-    klog_warn("Cannot extract pte (note:we don't lazy alloc pages)");    
-    return -EFAULT;
-  }
     
-  if (fault) {
-    if (page_fault(bvaddr, access) != 0) {
-      klog_warn("pmap_pagetable_walk -EFAULT 2");
-      return -EFAULT;
+    if (fault == false) {
+      break;
     }
     
-    if (pmap_extract(as, (vm_addr)bvaddr, &bpaddr, &flags) != 0) {
-        klog_warn("pmap_pagetable_walk -EFAULT 3");
+    if (do_page_fault(as, bvaddr, access) != 0) {
+      klog_warn("pmap_pagetable_walk -EFAULT 2");
       return -EFAULT;
     }
-  }    
+  }
 
   *rkaddr = (void *)pmap_pa_to_va(bpaddr + page_offset);
   return 0;
@@ -0,0 +1,697 @@
+/*
+ * Copyright 2014  Marven Gilhespie
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * --
+ * Asynchronous I/O system calls.
+ *
+ * A process reserves a number of asyncio descriptors with sys_alloc_asyncio().
+ * Each sys_beginio(), sys_beginread() or sys_beginwrite() call copies the
+ * request into a descriptor, queues its message on the server's message port
+ * and returns an ioid without waiting for a reply.  Replies are placed on the
+ * process's asyncio reply port and are reaped with sys_waitio().  This allows
+ * a single thread to keep several requests in flight to one or more servers.
+ */
+
+#include <kernel/dbg.h>
+#include <kernel/filesystem.h>
+#include <kernel/globals.h>
+#include <kernel/msg.h>
+#include <kernel/proc.h>
+#include <kernel/types.h>
+#include <kernel/vm.h>
+#include <string.h>
+#include <sys/iorequest.h>
+
+KLOG_REGISTER(LOG_FS_MSG)
+
+
+// Static prototypes
+static struct AsyncIO *get_idle_asyncio(struct Process *proc);
+static void put_idle_asyncio(struct Process *proc, struct AsyncIO *aio);
+static struct AsyncIO *ioid_to_asyncio(struct Process *proc, int fd, int ioid);
+static struct AsyncIO *find_completed_asyncio(struct Process *proc, int fd, bool *outstanding);
+static int start_asyncio(struct Process *proc, struct AsyncIO *aio, int fd, struct VNode *vnode,
+                         int siov_cnt, int riov_cnt);
+static void abort_asyncio(struct Process *proc, struct AsyncIO *aio);
+static int reap_asyncio(struct Process *proc, struct AsyncIO *aio);
+
+
+/* @brief   Reserve asynchronous I/O descriptors for the current process
+ *
+ * @param   n, number of descriptors to reserve
+ * @return  number of descriptors reserved or negative errno on failure
+ *
+ * Each descriptor allows one request started with sys_beginio() to be in
+ * flight at a time. Descriptors are returned to the system with
+ * sys_free_asyncio() or when the process exits or execs.
+ */
+int sys_alloc_asyncio(int n)
+{
+  struct Process *current;
+  struct AsyncIO *aio;
+
+  klog_info("sys_alloc_asyncio(n:%d)", n);
+
+  current = get_current_process();
+
+  if (n < 1 || n > ASYNCIO_MAX_PER_PROC - current->asyncio_cnt) {
+    return -EINVAL;
+  }
+
+  if (n > free_asyncio_cnt) {
+    return -ENOMEM;
+  }
+
+  for (int t = 0; t < n; t++) {
+    aio = DLIST_HEAD(&free_asyncio_list);
+    DLIST_REM_HEAD(&free_asyncio_list, link);
+
+    aio->proc = current;
+    aio->state = AIO_STATE_IDLE;
+    DLIST_ADD_TAIL(&current->asyncio_free_list, aio, link);
+  }
+
+  free_asyncio_cnt -= n;
+  current->asyncio_cnt += n;
+  return n;
+}
+
+
+/* @brief   Release unused asynchronous I/O descriptors of the current process
+ *
+ * @param   n, maximum number of descriptors to release
+ * @return  number of descriptors released or negative errno on failure
+ *
+ * Only descriptors that are not in use by a started request are released.
+ */
+int sys_free_asyncio(int n)
+{
+  struct Process *current;
+  struct AsyncIO *aio;
+  int nfreed = 0;
+
+  klog_info("sys_free_asyncio(n:%d)", n);
+
+  if (n < 1) {
+    return -EINVAL;
+  }
+
+  current = get_current_process();
+
+  while (nfreed < n && (aio = DLIST_HEAD(&current->asyncio_free_list)) != NULL) {
+    DLIST_REM_HEAD(&current->asyncio_free_list, link);
+
+    aio->proc = NULL;
+    aio->state = AIO_STATE_FREE;
+    DLIST_ADD_TAIL(&free_asyncio_list, aio, link);
+    nfreed++;
+  }
+
+  free_asyncio_cnt += nfreed;
+  current->asyncio_cnt -= nfreed;
+  return nfreed;
+}
+
+
+/* @brief   Start an asynchronous CMD_SENDIO message to a server
+ *
+ * @param   fd, file descriptor of opened connection to server
+ * @param   subclass, subclass of the CMD_SENDIO command
+ * @param   siov_cnt, count of iov vectors of data to send to server
+ * @param   _siov, array of iov vectors of data to send to server
+ * @param   riov_cnt, count of iov vectors of buffers to receive data from server
+ * @param   _riov, array of iov vectors of buffers to receive data from server
+ * @return  ioid of the started request or negative errno on failure
+ *
+ * This is the asynchronous form of sys_sendio(). The buffers described by
+ * the IOVs must remain valid until the request is reaped with sys_waitio().
+ */
+int sys_beginio(int fd, int subclass, int siov_cnt, msgiov_t *_siov, int riov_cnt, msgiov_t *_riov)
+{
+  struct Process *current;
+  struct Filp *filp;
+  struct VNode *vnode;
+  struct AsyncIO *aio;
+  size_t sbuf_total_sz = 0;
+  size_t rbuf_total_sz = 0;
+
+  klog_info("sys_beginio(fd:%d)", fd);
+
+  if (siov_cnt < 1 || siov_cnt > IOV_MAX || riov_cnt < 0 || riov_cnt > IOV_MAX) {
+    return -EINVAL;
+  }
+
+  current = get_current_process();
+  filp = filp_get(current, fd);
+
+  if (filp == NULL) {
+    return -EBADF;
+  }
+
+  vnode = vnode_get_from_filp(filp);
+
+  if (vnode == NULL) {
+    return -EBADF;
+  }
+
+  if (check_access(vnode, filp, X_OK) != 0) {
+    return -EACCES;
+  }
+
+  if ((aio = get_idle_asyncio(current)) == NULL) {
+    return -EAGAIN;
+  }
+
+  if (copyin(aio->siov, _siov, sizeof(msgiov_t) * siov_cnt) != 0) {
+    put_idle_asyncio(current, aio);
+    return -EFAULT;
+  }
+
+  if (riov_cnt > 0) {
+    if (copyin(aio->riov, _riov, sizeof(msgiov_t) * riov_cnt) != 0) {
+      put_idle_asyncio(current, aio);
+      return -EFAULT;
+    }
+  }
+
+  for (int t = 0; t < siov_cnt; t++) {
+    sbuf_total_sz += aio->siov[t].size;
+  }
+
+  for (int t = 0; t < riov_cnt; t++) {
+    rbuf_total_sz += aio->riov[t].size;
+  }
+
+  memset(&aio->req, 0, sizeof aio->req);
+  aio->req.cmd = CMD_SENDIO;
+  aio->req.args.sendio.inode_nr = vnode->inode_nr;
+  aio->req.args.sendio.subclass = subclass;
+  aio->req.args.sendio.ssize = sbuf_total_sz;
+  aio->req.args.sendio.rsize = rbuf_total_sz;
+
+  return start_asyncio(current, aio, fd, vnode, siov_cnt, riov_cnt);
+}
+
+
+/* @brief   Start an asynchronous read from a block or character device
+ *
+ * @param   fd, file descriptor of the device
+ * @param   buf, buffer to read into
+ * @param   sz, number of bytes to read
+ * @param   _offset, pointer to the offset within the device to read from
+ * @return  ioid of the started request or negative errno on failure
+ *
+ * The file pointer's offset is neither used nor updated. The number of
+ * bytes read is returned by sys_waitio().
+ */
+int sys_beginread(int fd, void *buf, size_t sz, off64_t *_offset)
+{
+  struct Process *current;
+  struct Filp *filp;
+  struct VNode *vnode;
+  struct AsyncIO *aio;
+  off64_t offset;
+  int sc;
+
+  klog_info("sys_beginread(fd:%d, sz:%u)", fd, (uint32_t)sz);
+
+  if ((sc = bounds_check(buf, sz)) != 0) {
+    return sc;
+  }
+
+  if (copyin(&offset, _offset, sizeof offset) != 0) {
+    return -EFAULT;
+  }
+
+  current = get_current_process();
+  filp = filp_get(current, fd);
+
+  if (filp == NULL) {
+    return -EBADF;
+  }
+
+  vnode = vnode_get_from_filp(filp);
+
+  if (vnode == NULL) {
+    return -EBADF;
+  }
+
+  if (!S_ISBLK(vnode->mode) && !S_ISCHR(vnode->mode)) {
+    return -EINVAL;
+  }
+
+  if (check_access(vnode, filp, R_OK) != 0) {
+    return -EACCES;
+  }
+
+  if ((aio = get_idle_asyncio(current)) == NULL) {
+    return -EAGAIN;
+  }
+
+  aio->riov[0].addr = buf;
+  aio->riov[0].size = sz;
+
+  memset(&aio->req, 0, sizeof aio->req);
+  aio->req.cmd = CMD_READ;
+  aio->req.args.read.inode_nr = vnode->inode_nr;
+  aio->req.args.read.offset = offset;
+  aio->req.args.read.sz = sz;
+
+  return start_asyncio(current, aio, fd, vnode, 0, 1);
+}
+
+
+/* @brief   Start an asynchronous write to a block or character device
+ *
+ * @param   fd, file descriptor of the device
+ * @param   buf, buffer to write from
+ * @param   sz, number of bytes to write
+ * @param   _offset, pointer to the offset within the device to write to
+ * @return  ioid of the started request or negative errno on failure
+ *
+ * The file pointer's offset is neither used nor updated. The number of
+ * bytes written is returned by sys_waitio().
+ */
+int sys_beginwrite(int fd, void *buf, size_t sz, off64_t *_offset)
+{
+  struct Process *current;
+  struct Filp *filp;
+  struct VNode *vnode;
+  struct AsyncIO *aio;
+  off64_t offset;
+  int sc;
+
+  klog_info("sys_beginwrite(fd:%d, sz:%u)", fd, (uint32_t)sz);
+
+  if ((sc = bounds_check(buf, sz)) != 0) {
+    return sc;
+  }
+
+  if (copyin(&offset, _offset, sizeof offset) != 0) {
+    return -EFAULT;
+  }
+
+  current = get_current_process();
+  filp = filp_get(current, fd);
+
+  if (filp == NULL) {
+    return -EBADF;
+  }
+
+  vnode = vnode_get_from_filp(filp);
+
+  if (vnode == NULL) {
+    return -EBADF;
+  }
+
+  if (!S_ISBLK(vnode->mode) && !S_ISCHR(vnode->mode)) {
+    return -EINVAL;
+  }
+
+  if (check_access(vnode, filp, W_OK) != 0) {
+    return -EACCES;
+  }
+
+  if ((aio = get_idle_asyncio(current)) == NULL) {
+    return -EAGAIN;
+  }
+
+  aio->siov[0].addr = buf;
+  aio->siov[0].size = sz;
+
+  memset(&aio->req, 0, sizeof aio->req);
+  aio->req.cmd = CMD_WRITE;
+  aio->req.args.write.inode_nr = vnode->inode_nr;
+  aio->req.args.write.offset = offset;
+  aio->req.args.write.sz = sz;
+
+  return start_asyncio(current, aio, fd, vnode, 1, 0);
+}
+
+
+/* @brief   Wait for an asynchronous I/O request to complete
+ *
+ * @param   fd, file descriptor the request was started on
+ * @param   ioid, ioid of request to wait for, or IOID_ANY
+ * @param   flags, WAITIO_NOWAIT to return -EAGAIN instead of blocking
+ * @return  See below, or negative errno on failure
+ *
+ * If ioid is a request's ioid then this waits for it to complete, releases
+ * the request's descriptor for reuse and returns the server's reply status.
+ *
+ * If ioid is IOID_ANY then this waits for any request started on fd to
+ * complete and returns its ioid without reaping it. If fd is -1 then requests
+ * started on any file descriptor are considered. Returns -ENOENT if there are
+ * no requests that could complete.
+ */
+int sys_waitio(int fd, int ioid, int flags)
+{
+  struct Process *current;
+  struct AsyncIO *aio;
+  bool outstanding;
+  int sc;
+
+  klog_info("sys_waitio(fd:%d, ioid:%d)", fd, ioid);
+
+  current = get_current_process();
+
+  if (ioid == IOID_ANY) {
+    while ((aio = find_completed_asyncio(current, fd, &outstanding)) == NULL) {
+      if (outstanding == false) {
+        return -ENOENT;
+      }
+
+      if (flags & WAITIO_NOWAIT) {
+        return -EAGAIN;
+      }
+
+      if ((sc = TaskSleepInterruptible(&current->asyncio_port.rendez, NULL, INTRF_SIGNAL)) != 0) {
+        return sc;
+      }
+    }
+
+    return aio - asyncio_table;
+  }
+
+  if ((aio = ioid_to_asyncio(current, fd, ioid)) == NULL) {
+    return -EINVAL;
+  }
+
+  while (aio->msg.port != &current->asyncio_port) {
+    if (flags & WAITIO_NOWAIT) {
+      return -EAGAIN;
+    }
+
+    if ((sc = TaskSleepInterruptible(&current->asyncio_port.rendez, NULL, INTRF_SIGNAL)) != 0) {
+      return sc;
+    }
+
+    // Another thread may have reaped it while we slept
+    if (aio->state != AIO_STATE_BUSY || aio->proc != current) {
+      return -EINVAL;
+    }
+  }
+
+  return reap_asyncio(current, aio);
+}
+
+
+/* @brief   Abort an asynchronous I/O request
+ *
+ * @param   fd, file descriptor the request was started on
+ * @param   ioid, ioid of request to abort
+ * @param   flags, reserved, must be 0
+ * @return  0 on success, negative errno on failure
+ *
+ * A request that the server has not yet received is completed immediately
+ * with -EINTR. A request the server is processing is sent again with
+ * CMD_ABORT. In either case the request must still be reaped with sys_waitio().
+ */
+int sys_abortio(int fd, int ioid, int flags)
+{
+  struct Process *current;
+  struct AsyncIO *aio;
+
+  klog_info("sys_abortio(fd:%d, ioid:%d)", fd, ioid);
+
+  if (flags != 0) {
+    return -EINVAL;
+  }
+
+  current = get_current_process();
+
+  if ((aio = ioid_to_asyncio(current, fd, ioid)) == NULL) {
+    return -EINVAL;
+  }
+
+  abort_asyncio(current, aio);
+  return 0;
+}
+
+
+/* @brief   Initialize the asynchronous I/O state of a new process
+ *
+ * @param   proc, process to initialize
+ */
+void init_asyncio(struct Process *proc)
+{
+  init_msgport(&proc->asyncio_port, INVALID_PID, -1);
+  DLIST_INIT(&proc->asyncio_free_list);
+  DLIST_INIT(&proc->asyncio_busy_list);
+  proc->asyncio_cnt = 0;
+}
+
+
+/* @brief   Abort outstanding asynchronous I/O and release all descriptors
+ *
+ * @param   proc, process that is exiting or performing an exec
+ *
+ * Requests that a server has received still reference the process's buffers
+ * and address space, so this waits for the server to reply to them.
+ */
+void fini_asyncio(struct Process *proc)
+{
+  struct AsyncIO *aio;
+
+  aio = DLIST_HEAD(&proc->asyncio_busy_list);
+
+  while (aio != NULL) {
+    abort_asyncio(proc, aio);
+    aio = DLIST_NEXT(aio, link);
+  }
+
+  while ((aio = DLIST_HEAD(&proc->asyncio_busy_list)) != NULL) {
+    while (aio->msg.port != &proc->asyncio_port) {
+      TaskSleep(&proc->asyncio_port.rendez);
+    }
+
+    reap_asyncio(proc, aio);
+  }
+
+  while ((aio = DLIST_HEAD(&proc->asyncio_free_list)) != NULL) {
+    DLIST_REM_HEAD(&proc->asyncio_free_list, link);
+    aio->proc = NULL;
+    aio->state = AIO_STATE_FREE;
+    DLIST_ADD_TAIL(&free_asyncio_list, aio, link);
+    free_asyncio_cnt++;
+  }
+
+  proc->asyncio_cnt = 0;
+}
+
+
+/* @brief   Get the message of an asynchronous I/O request from its msgid
+ *
+ * @param   msgid, msgid of message, max_pid or greater
+ * @return  Pointer to the message or NULL if msgid is not in use
+ */
+struct Msg *asyncio_msgid_to_msg(msgid_t msgid)
+{
+  struct AsyncIO *aio;
+  int ioid;
+
+  ioid = msgid - max_pid;
+
+  if (ioid < 0 || ioid >= max_asyncio) {
+    return NULL;
+  }
+
+  aio = &asyncio_table[ioid];
+
+  if (aio->state != AIO_STATE_BUSY) {
+    return NULL;
+  }
+
+  return &aio->msg;
+}
+
+
+/* @brief   Take an unused descriptor from the process's reserved descriptors
+ */
+static struct AsyncIO *get_idle_asyncio(struct Process *proc)
+{
+  struct AsyncIO *aio;
+
+  aio = DLIST_HEAD(&proc->asyncio_free_list);
+
+  if (aio != NULL) {
+    DLIST_REM_HEAD(&proc->asyncio_free_list, link);
+  }
+
+  return aio;
+}
+
+
+/* @brief   Return a descriptor to the process's reserved descriptors
+ */
+static void put_idle_asyncio(struct Process *proc, struct AsyncIO *aio)
+{
+  aio->state = AIO_STATE_IDLE;
+  aio->vnode = NULL;
+  aio->msgport = NULL;
+  DLIST_ADD_HEAD(&proc->asyncio_free_list, aio, link);
+}
+
+
+/* @brief   Initialize a descriptor's message and send it to the server
+ *
+ * @return  ioid of started request or negative errno on failure
+ */
+static int start_asyncio(struct Process *proc, struct AsyncIO *aio, int fd, struct VNode *vnode,
+                         int siov_cnt, int riov_cnt)
+{
+  struct Msg *msg;
+  int ioid;
+  int sc;
+
+  ioid = aio - asyncio_table;
+  msg = &aio->msg;
+
+  msg->msgid = max_pid + ioid;
+  msg->reply_port = &proc->asyncio_port;
+  msg->siov_cnt = siov_cnt;
+  msg->siov = (siov_cnt > 0) ? aio->siov : NULL;
+  msg->riov_cnt = riov_cnt;
+  msg->riov = (riov_cnt > 0) ? aio->riov : NULL;
+  msg->reply_status = 0;
+  msg->ipc = IPCOPY;
+  msg->src_as = &proc->as;
+  msg->req = &aio->req;
+  msg->reply = NULL;
+  msg->priority = -1;
+  msg->lent_tid = INVALID_PID;
+  init_msg_cursors(msg);
+
+  aio->fd = fd;
+  aio->vnode = vnode;
+  aio->msgport = &vnode->superblock->msgport;
+  aio->state = AIO_STATE_BUSY;
+
+  if ((sc = kputmsg(aio->msgport, msg)) != 0) {
+    put_idle_asyncio(proc, aio);
+    return sc;
+  }
+
+  vnode_ref(vnode);
+  DLIST_ADD_TAIL(&proc->asyncio_busy_list, aio, link);
+  return ioid;
+}
+
+
+/* @brief   Abort an in-flight request
+ *
+ * See sys_abortio() for details
+ */
+static void abort_asyncio(struct Process *proc, struct AsyncIO *aio)
+{
+  struct Msg *msg = &aio->msg;
+
+  if (msg->port == &proc->asyncio_port) {
+    // Already replied
+    return;
+  }
+
+  if (kmsgpending(aio->msgport, msg)) {
+    kremovemsg(aio->msgport, msg);
+    msg->reply_status = -EINTR;
+    kreplymsg(msg);
+    return;
+  }
+
+  if (aio->req.cmd != CMD_ABORT) {
+    // The server has received the request, send it again as CMD_ABORT.
+    // The server must still reply to the original msgid.
+    aio->req.cmd = CMD_ABORT;
+
+    if (kresendmsg(aio->msgport, msg) != 0) {
+      msg->reply_status = -ECONNABORTED;
+      kreplymsg(msg);
+    }
+  }
+}
+
+
+/* @brief   Release a completed request's descriptor and return its reply status
+ */
+static int reap_asyncio(struct Process *proc, struct AsyncIO *aio)
+{
+  int status;
+
+  kassert(aio->msg.port == &proc->asyncio_port);
+
+  status = aio->msg.reply_status;
+
+  kremovemsg(&proc->asyncio_port, &aio->msg);
+  aio->msg.port = NULL;
+
+  DLIST_REM_ENTRY(&proc->asyncio_busy_list, aio, link);
+  vnode_put(aio->vnode);
+  put_idle_asyncio(proc, aio);
+
+  return status;
+}
+
+
+/* @brief   Get a started request from its ioid
+ *
+ * @return  Pointer to request's descriptor or NULL if ioid is not a started
+ *          request of the process on the file descriptor fd.
+ */
+static struct AsyncIO *ioid_to_asyncio(struct Process *proc, int fd, int ioid)
+{
+  struct AsyncIO *aio;
+
+  if (ioid < 0 || ioid >= max_asyncio) {
+    return NULL;
+  }
+
+  aio = &asyncio_table[ioid];
+
+  if (aio->proc != proc || aio->state != AIO_STATE_BUSY || aio->fd != fd) {
+    return NULL;
+  }
+
+  return aio;
+}
+
+
+/* @brief   Find a completed request that has not yet been reaped
+ *
+ * @param   proc, process to search
+ * @param   fd, file descriptor requests were started on or -1 for any
+ * @param   outstanding, set to true if any matching request has been started
+ * @return  Pointer to completed request's descriptor or NULL if none
+ */
+static struct AsyncIO *find_completed_asyncio(struct Process *proc, int fd, bool *outstanding)
+{
+  struct AsyncIO *aio;
+
+  *outstanding = false;
+  aio = DLIST_HEAD(&proc->asyncio_busy_list);
+
+  while (aio != NULL) {
+    if (fd == -1 || aio->fd == fd) {
+      *outstanding = true;
+
+      if (aio->msg.port == &proc->asyncio_port) {
+        return aio;
+      }
+    }
+
+    aio = DLIST_NEXT(aio, link);
+  }
+
+  return NULL;
+}
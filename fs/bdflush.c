@@ -30,21 +30,24 @@ KLOG_REGISTER(LOG_FS_CACHE)
 
 /* @brief   Create a kernel task to periodically flush a filesystem's dirty blocks
  * 
+ * @param   sb, superblock of the filesystem
+ * @return  0 on success, negative errno on failure
+ *
+ * Until the task is created, writes to the filesystem's files are written
+ * through to the filesystem handler immediately.
  */
 int init_superblock_bdflush(struct SuperBlock *sb)
 {
   klog_info("init_superblock_bdflush");
 
-#if 0
   sb->bdflush_thread = create_kernel_thread(bdflush_task, sb, 
                                         SCHED_RR, SCHED_PRIO_CACHE_HANDLER, 
-                                        THREADF_KERNEL, NULL, "bdflush-kt");
+                                        THREADF_KERNEL, &cpu_table[0], "bdflush-kt");
   
   if (sb->bdflush_thread == NULL) {
     klog_info("bd_flush initialization failed");
     return -ENOMEM;
   }
-#endif
   
   return 0;
 }
@@ -63,7 +66,6 @@ void fini_superblock_bdflush(struct SuperBlock *sb, int how)
   
   sb->flags |= SBF_ABORT;
 
-#if 1  
   TaskWakeup(&sb->bdflush_rendez);
 
   if (sb->bdflush_thread != NULL) {
@@ -71,42 +73,81 @@ void fini_superblock_bdflush(struct SuperBlock *sb, int how)
   }
   
   sb->bdflush_thread = NULL;
-#endif
 }
 
 
 /* @brief   Per-Superblock kernel task for flushing async and delayed writes to disk
  *
  * @param   arg, pointer to the superblock
+ *
+ * Every DIRTY_FLUSH_INTERVAL_TICKS the dirty blocks whose delay has expired
+ * are written to the filesystem handler.  If the filesystem has been switched
+ * to write-through all dirty blocks are written.  Blocks still dirty when the
+ * filesystem is aborted cannot be written and are discarded.
  */
 void bdflush_task(void *arg)
 {
 	struct SuperBlock *sb;
+  struct Page *page;
   struct VNode *vnode;
   struct timespec timeout;
+  uint64_t now;
   
 	sb = (struct SuperBlock *)arg;
 
   while((sb->flags & SBF_ABORT) == 0) {
-    timeout.tv_sec = 4;
-    timeout.tv_nsec = 0;    
+    timeout.tv_sec = DIRTY_FLUSH_INTERVAL_TICKS / JIFFIES_PER_SECOND;
+    timeout.tv_nsec = (DIRTY_FLUSH_INTERVAL_TICKS % JIFFIES_PER_SECOND) * NANOSECONDS_PER_JIFFY;    
 
     TaskSleepInterruptible(&sb->bdflush_rendez, &timeout, INTRF_NONE);
 
-    klog_info("bdflush_task() sb->lock SHARED");
+    if (sb->flags & SBF_ABORT) {
+      break;
+    }
 
-    vnode = DLIST_HEAD(&sb->vnode_list);
+    if (sb->flags & SBF_WRITETHRU) {
+      now = UINT64_MAX;
+    } else {
+      now = get_hardclock();
+    }
     
-    while (vnode != NULL) {
-      // FIXME: Do we need to increment reference count of vnode?
-
-      bsyncv(vnode);
+    bdflush_superblock(sb, now);
+  }
 
-      vnode = DLIST_NEXT(vnode, vnode_link);
+  while ((vnode = DLIST_HEAD(&sb->dirty_vnode_list)) != NULL) {
+    page = DLIST_HEAD(&vnode->dirty_page_list);
+    
+    if (page->bflags & B_BUSY) {
+      TaskSleep(&page->rendez);
+      continue;
     }
-
-    klog_info("bdflush_task() sb->lock RELEASE");
+    
+    page->bflags |= B_BUSY;
+    bdiscard(page);
   }
 }
 
 
+/* @brief   Write the dirty blocks of a filesystem that are due to be written
+ *
+ * @param   sb, superblock of the filesystem
+ * @param   now, time in ticks, blocks that expire after this are not written,
+ *          UINT64_MAX to write all dirty blocks
+ * @return  0 on success, negative errno if any block could not be written
+ *
+ * Contiguous dirty blocks of each file are written in clusters.
+ */
+int bdflush_superblock(struct SuperBlock *sb, uint64_t now)
+{
+  page_list_t dirty_list;
+
+  DLIST_INIT(&dirty_list);
+    
+  if (getblk_dirty_list(sb, now, &dirty_list) == 0) {
+    return 0;
+  }
+  
+  klog_info("bdflush_superblock(sb:%08x) dirty_page_cnt:%d", (uint32_t)sb, dirty_page_cnt);
+
+  return bwrite_dirty_list(&dirty_list);
+}
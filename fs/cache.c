@@ -28,6 +28,54 @@
 
 KLOG_REGISTER(LOG_FS_CACHE)
 
+
+// Static prototypes
+static int bdelwrite(struct Page *page, uint64_t delay);
+static void bwrite_error(struct Page *page, bool delayed);
+static void evict_blk(struct Page *page);
+static void enter_cache_ghost(struct VNode *vnode, off64_t file_offset);
+static bool remove_cache_ghost(struct VNode *vnode, off64_t file_offset);
+static void remove_cache_ghosts(struct VNode *vnode, off64_t start, off64_t end);
+static void free_cache_ghost(struct CacheGhost *ghost);
+static struct Page *find_cached_blk(void);
+static int wait_for_available_blk(uint64_t deadline);
+static struct Page *do_getblk(struct VNode *vnode, uint64_t file_offset, bool zero);
+static void assign_blk(struct Page *page, struct VNode *vnode, uint64_t file_offset, bool zero);
+static struct Page *getblk_absent(struct VNode *vnode, off64_t file_offset);
+
+
+/* @brief   Initialize the file cache's replacement policy
+ *
+ * The cache uses the 2Q replacement policy of Johnson and Shasha.  Blocks
+ * that are read into the cache are placed on the a1in queue.  Blocks evicted
+ * from a1in before being used again leave a ghost entry recording their
+ * identity.  A1in is a FIFO, a block that is used again while on a1in keeps
+ * its place.  A block that misses in the cache but has a ghost entry has been
+ * used more than once in a short period and is placed on the am queue, which
+ * is managed as an LRU list.  A large sequential read therefore only cycles
+ * through a1in and cannot evict the frequently used blocks on am.
+ */
+void init_cache(void)
+{
+  DLIST_INIT(&cache_ghost_queue);
+  
+  for (int t = 0; t < PAGE_LOOKUP_HASH_SZ; t++) {
+    DLIST_INIT(&cache_ghost_hash[t]);
+  }
+  
+  for (int t = 0; t < max_cache_ghost; t++) {
+    cache_ghost_table[t].superblock = NULL;
+    cache_ghost_table[t].inode_nr = 0;
+    cache_ghost_table[t].file_offset = 0;
+    DLIST_ADD_TAIL(&cache_ghost_queue, &cache_ghost_table[t], lru_link);
+  }
+  
+  cache_ghost_cnt = 0;
+  
+  memset(&cache_stats, 0, sizeof cache_stats);
+}
+
+
 /* @Brief   Get a cached block
  *
  * @param   vnode, file to get cached block of
@@ -43,14 +91,49 @@ KLOG_REGISTER(LOG_FS_CACHE)
  * getblk, bread, bwrite, bawrite and brelse operations (though they applied to
  * the block level in the book).
  *
- * TODO: Add timeout for getting a block
+ * If no page is available the caller waits up to RECLAIM_ALLOC_TIMEOUT_TICKS
+ * for the reclaim task to free one.
+ *
+ * A block that is not valid is returned zero filled.
  */
 struct Page *getblk(struct VNode *vnode, uint64_t file_offset)
+{
+  return do_getblk(vnode, file_offset, true);
+}
+
+
+/* @brief   Get a cached block that the caller will overwrite completely
+ *
+ * @param   vnode, file to get cached block of
+ * @param   file_offset, offset within file (aligned to page size)
+ * @return  Page on success, NULL if it cannot find or allocate a Page
+ *
+ * Same as getblk() except that a block that is not valid is neither read nor
+ * cleared, its contents are undefined.  The caller must fill the entire page
+ * before setting B_VALID, or release it with bdiscard().
+ */
+struct Page *getblk_overwrite(struct VNode *vnode, uint64_t file_offset)
+{
+  return do_getblk(vnode, file_offset, false);
+}
+
+
+/* @brief   Find or allocate a cached block, see getblk()
+ *
+ * @param   vnode, file to get cached block of
+ * @param   file_offset, offset within file (aligned to page size)
+ * @param   zero, true to zero fill the block if it is not valid
+ * @return  Page on success, NULL if it cannot find or allocate a Page
+ */
+static struct Page *do_getblk(struct VNode *vnode, uint64_t file_offset, bool zero)
 {
   struct Page *page;
+  uint64_t deadline;
 
   klog_info("getblk(vnode:%08x, offs:%08x)", (uint32_t)vnode, (uint32_t)file_offset);
 
+  deadline = get_hardclock() + RECLAIM_ALLOC_TIMEOUT_TICKS;
+
   while (1) {
     if (vnode->superblock->flags & SBF_ABORT) {
       return NULL;
@@ -62,85 +145,182 @@ struct Page *getblk(struct VNode *vnode, uint64_t file_offset)
         continue;
       }
 
+      if ((page->bflags & (B_DIRTY | B_MAPPED | B_VALID | B_AM)) == B_VALID) {
+        // A hit on a1in leaves the block in place, so that a1in is a FIFO
+        page->bflags |= B_QUEUED;
+      } else if ((page->bflags & (B_DIRTY | B_MAPPED)) == 0) {
+        remove_from_free_page_queue(page);
+      }
+
       page->bflags |= B_BUSY;
       
-      remove_from_free_page_queue(page);
-
-      if ((page->bflags & B_VALID) == 0) {
+      if (zero == true && (page->bflags & B_VALID) == 0) {
         memset(page->vaddr, 0, PAGE_SIZE);
       }
 
+      cache_stats.hits++;
+      
+      if (page->bflags & B_AM) {
+        cache_stats.am_hits++;
+      } else {
+        cache_stats.a1in_hits++;
+      }
+      
       return page;
 
     } else {
-      if ((page = find_available_blk()) == NULL) {
+      if ((page = find_available_blk(false)) == NULL) {
         klog_info("find_available_blk, none found, sleeping");
-        TaskSleep(&page_list_rendez);
+        
+        if (wait_for_available_blk(deadline) != 0) {
+          return NULL;
+        }
+        
         continue;
       }
 
-      kassert((page->bflags & B_BUSY) == 0);
+      assign_blk(page, vnode, file_offset, zero);
+      cache_stats.misses++;
 
-      page->bflags |= B_BUSY;
+      klog_info("getblk() recycled/alloced page:%08x, paddr:%08x", (uint32_t)page, (uint32_t)page->physical_addr);
+    
+      return page;
+    }
+  }
+}
 
-      remove_from_free_page_queue(page);
-      
-      if (page->bflags & B_VALID) {
-        remove_from_lookup_page_hash(page);
-        remove_from_vnode_page_list(page);
 
-        page->bflags &= ~B_VALID;
-      }
+/* @brief   Take an available page and make it a busy block of a file
+ *
+ * @param   page, page from find_available_blk()
+ * @param   vnode, file the block belongs to
+ * @param   file_offset, offset within file (aligned to page size)
+ * @param   zero, true to zero fill the block
+ */
+static void assign_blk(struct Page *page, struct VNode *vnode, uint64_t file_offset, bool zero)
+{
+  kassert((page->bflags & B_BUSY) == 0);
 
-      page->vnode = vnode;      
-      page->file_offset = file_offset;
-      
-      add_to_lookup_page_hash(page);
-      add_to_vnode_page_list(page);
+  remove_from_free_page_queue(page);
+  page->bflags |= B_BUSY;
+  evict_blk(page);
+  check_free_page_low();
 
-      memset(page->vaddr, 0, PAGE_SIZE);
+  page->vnode = vnode;      
+  page->file_offset = file_offset;
+  
+  if (remove_cache_ghost(vnode, file_offset)) {
+    page->bflags |= B_AM;
+    cache_stats.ghost_hits++;
+  }
+  
+  add_to_lookup_page_hash(page);
+  add_to_vnode_page_list(page);
 
-      klog_info("getblk() recycled/alloced page:%08x, paddr:%08x", (uint32_t)page, (uint32_t)page->physical_addr);
-    
-      return page;
-    }
+  if (zero == true && (page->bflags & B_ERASED) == 0) {
+    memset(page->vaddr, 0, PAGE_SIZE);
   }
+  
+  page->bflags &= ~B_ERASED;
 }
 
 
-/*
- * TODO: Add a timeout of 10 seconds, or maybe pass in an absolute timeout.
+/* @brief   Get a busy block of a file only if it is not already cached
+ *
+ * @param   vnode, file to get the block of
+ * @param   file_offset, offset within file (aligned to page size)
+ * @return  Page with undefined contents, NULL if the block is cached or
+ *          no page is available
+ *
+ * Never sleeps, so it can be used to add neighbouring blocks to a read
+ * while other blocks of the file are held busy.
+ */
+static struct Page *getblk_absent(struct VNode *vnode, off64_t file_offset)
+{
+  struct Page *page;
+  
+  if (find_blk(vnode, file_offset) != NULL) {
+    return NULL;
+  }
+  
+  if ((page = find_available_blk(false)) == NULL) {
+    return NULL;
+  }
+  
+  assign_blk(page, vnode, file_offset, false);
+  return page;
+}
+
+
+/* @brief   Get the size of the cache blocks a file is read in
+ *
+ * @param   vnode, file to get the cache block size of
+ * @return  PAGE_SIZE, CACHE_BLOCK_SIZE_MEDIUM or CACHE_BLOCK_SIZE_LARGE
+ *
+ * Larger files are read in larger cache blocks, so that reading them takes
+ * fewer CMD_READ messages, while small files keep page-sized blocks.  The
+ * size is derived from the current file size, so the pages of a file that
+ * grows may have been read with different block sizes.
+ */
+size_t get_cache_block_size(struct VNode *vnode)
+{
+  if (vnode->superblock->flags & SBF_SMALLBLOCKS) {
+    return PAGE_SIZE;
+  }
+  
+  if (vnode->size >= CACHE_BLOCK_LARGE_FILE_SZ) {
+    return CACHE_BLOCK_SIZE_LARGE;
+  }
+  
+  if (vnode->size >= CACHE_BLOCK_MEDIUM_FILE_SZ) {
+    return CACHE_BLOCK_SIZE_MEDIUM;
+  }
+  
+  return PAGE_SIZE;
+}
+
+
+/* @brief   Get a page for anonymous memory
+ *
+ * @return  Page on success, NULL if none became available within
+ *          RECLAIM_ALLOC_TIMEOUT_TICKS
+ *
+ * Cached blocks are only evicted while the file cache holds more than
+ * cache_min_pages.
  */
 struct Page *getblk_anon(void)
 {
   struct Page *page;
-    
+  uint64_t deadline;
+  
+  deadline = get_hardclock() + RECLAIM_ALLOC_TIMEOUT_TICKS;
+  
   while(1) {
-    if ((page = find_available_blk()) == NULL) {
+    if ((page = find_available_blk(true)) == NULL) {
       klog_info("getblk_anon() - sleeping");
-      TaskSleep(&page_list_rendez);
+      
+      if (wait_for_available_blk(deadline) != 0) {
+        return NULL;
+      }
+      
       continue;
     }
 
     kassert((page->bflags & B_BUSY) == 0);
 
-    page->bflags |= B_BUSY;
-
     remove_from_free_page_queue(page);
-
-    // Buf is valid
-    if (page->bflags & B_VALID) {
-      remove_from_lookup_page_hash(page);
-      remove_from_vnode_page_list(page);
-
-      page->bflags &= ~B_VALID;
-    }
+    page->bflags |= B_BUSY;
+    evict_blk(page);
+    check_free_page_low();
+    check_zero_page_low();
     
-    page->vnode = NULL;
-
-    page->file_offset = 0;
+    anon_page_cnt++;
         
-    memset(page->vaddr, 0, PAGE_SIZE);
+    if ((page->bflags & B_ERASED) == 0) {
+      memset(page->vaddr, 0, PAGE_SIZE);
+    }
+    
+    page->bflags &= ~B_ERASED;
 
     klog_info("getblk_anon() page:%08x, paddr:%08x", (uint32_t)page, (uint32_t) page->physical_addr);
 
@@ -150,12 +330,15 @@ struct Page *getblk_anon(void)
 }
 
 
-/*
+/* @brief   Free a page of anonymous memory
  *
- * TODO: Should we have a background task clearing anon pages
+ * @param   page, page allocated with getblk_anon()
+ *
+ * The page is cleared later by the zero page task, see vm/zeropage.c.
  */
 void putblk_anon(struct Page *page)
 {
+  anon_page_cnt--;
   add_to_free_page_queue_tail(page);
 
   page->bflags &= ~B_BUSY;
@@ -164,6 +347,222 @@ void putblk_anon(struct Page *page)
 }
 
 
+/* @brief   Wait for a page to be released or reclaimed
+ *
+ * @param   deadline, time in ticks after which to give up
+ * @return  0 when woken, -ENOMEM if the deadline has passed
+ */
+static int wait_for_available_blk(uint64_t deadline)
+{
+  struct timespec timeout;
+  uint64_t now;
+  uint64_t ticks;
+  
+  now = get_hardclock();
+  
+  if (now >= deadline) {
+    klog_error("no page available");
+    cache_stats.alloc_failures++;
+    return -ENOMEM;
+  }
+  
+  cache_stats.alloc_stalls++;
+  TaskWakeup(&reclaim_rendez);
+  
+  ticks = deadline - now;
+  timeout.tv_sec = ticks / JIFFIES_PER_SECOND;
+  timeout.tv_nsec = (ticks % JIFFIES_PER_SECOND) * NANOSECONDS_PER_JIFFY;
+  
+  TaskSleepInterruptible(&page_list_rendez, &timeout, INTRF_NONE);
+  return 0;
+}
+
+
+/* @brief   Evict clean cached blocks onto the free page queue
+ *
+ * @param   cnt, number of blocks to evict
+ * @return  number of blocks evicted
+ *
+ * Called by the reclaim task.  Blocks are not evicted once the file cache
+ * is down to cache_min_pages.
+ */
+int reclaim_cached_blks(int cnt)
+{
+  struct Page *page;
+  int t;
+  
+  for (t = 0; t < cnt; t++) {
+    if (cache_page_cnt - free_page_cnt - anon_page_cnt <= cache_min_pages) {
+      break;
+    }
+    
+    if ((page = find_cached_blk()) == NULL) {
+      break;
+    }
+    
+    remove_from_free_page_queue(page);
+    page->bflags |= B_BUSY;
+    evict_blk(page);
+    
+    page->bflags &= ~B_BUSY;
+    add_to_free_page_queue_tail(page);
+  }
+  
+  if (t > 0) {
+    cache_stats.reclaimed += t;
+    TaskWakeupAll(&page_list_rendez);
+  }
+  
+  return t;
+}
+
+
+/* @brief   Remove a block from the cache before its page is reused
+ *
+ * @param   page, busy page taken from find_available_blk()
+ *
+ * If the block was only used once since it was read a ghost entry is kept
+ * so that a later miss on the same block promotes it to the am queue.
+ */
+static void evict_blk(struct Page *page)
+{
+  if (page->vnode != NULL) {
+    if (page->bflags & B_VALID) {
+      if (page->bflags & B_AM) {
+        cache_stats.am_evictions++;
+      } else {
+        cache_stats.a1in_evictions++;
+        enter_cache_ghost(page->vnode, page->file_offset);
+      }
+    }
+    
+    remove_from_lookup_page_hash(page);
+    remove_from_vnode_page_list(page);
+  }
+  
+  page->bflags &= ~(B_VALID | B_AM);
+  page->vnode = NULL;
+  page->file_offset = 0;
+}
+
+
+/* @brief   Record the identity of a block evicted from the a1in queue
+ *
+ * @param   vnode, file the block belonged to
+ * @param   file_offset, offset of the block within the file
+ *
+ * The oldest ghost entry is reused.
+ */
+static void enter_cache_ghost(struct VNode *vnode, off64_t file_offset)
+{
+  struct CacheGhost *ghost;
+  int h;
+  
+  if ((ghost = DLIST_TAIL(&cache_ghost_queue)) == NULL) {
+    return;
+  }
+  
+  DLIST_REM_TAIL(&cache_ghost_queue, lru_link);
+  
+  if (ghost->superblock != NULL) {
+    h = calc_page_lookup_hash(ghost->inode_nr, ghost->file_offset);
+    DLIST_REM_ENTRY(&cache_ghost_hash[h], ghost, hash_link);
+  } else {
+    cache_ghost_cnt++;
+  }
+  
+  ghost->superblock = vnode->superblock;
+  ghost->inode_nr = vnode->inode_nr;
+  ghost->file_offset = file_offset;
+  
+  h = calc_page_lookup_hash(vnode->inode_nr, file_offset);
+  DLIST_ADD_HEAD(&cache_ghost_hash[h], ghost, hash_link);
+  DLIST_ADD_HEAD(&cache_ghost_queue, ghost, lru_link);
+}
+
+
+/* @brief   Remove the ghost entry of a block if it has one
+ *
+ * @param   vnode, file the block belongs to
+ * @param   file_offset, offset of the block within the file
+ * @return  true if the block had a ghost entry
+ */
+static bool remove_cache_ghost(struct VNode *vnode, off64_t file_offset)
+{
+  struct CacheGhost *ghost;
+  int h;
+  
+  h = calc_page_lookup_hash(vnode->inode_nr, file_offset);
+  ghost = DLIST_HEAD(&cache_ghost_hash[h]);
+  
+  while (ghost != NULL) {
+    if (ghost->superblock == vnode->superblock && ghost->inode_nr == vnode->inode_nr
+        && ghost->file_offset == file_offset) {
+      free_cache_ghost(ghost);
+      return true;
+    }
+    
+    ghost = DLIST_NEXT(ghost, hash_link);
+  }
+  
+  return false;
+}
+
+
+/* @brief   Remove the ghost entries of a range of a file's blocks
+ *
+ * @param   vnode, file the blocks belong to
+ * @param   start, offset of the first block within the file
+ * @param   end, offset after the last block
+ *
+ * Called when a file's blocks are invalidated or truncated so that a block
+ * later read with different contents is not promoted to am.  Small ranges
+ * look up each block, larger ranges scan the ghost table.
+ */
+static void remove_cache_ghosts(struct VNode *vnode, off64_t start, off64_t end)
+{
+  struct CacheGhost *ghost;
+  off64_t file_offset;
+  
+  if (cache_ghost_cnt == 0 || start >= end) {
+    return;
+  }
+  
+  if ((end - start) / PAGE_SIZE < max_cache_ghost) {
+    for (file_offset = ALIGN_DOWN(start, PAGE_SIZE); file_offset < end; file_offset += PAGE_SIZE) {
+      remove_cache_ghost(vnode, file_offset);
+    }
+  } else {
+    for (int t = 0; t < max_cache_ghost; t++) {
+      ghost = &cache_ghost_table[t];
+      
+      if (ghost->superblock == vnode->superblock && ghost->inode_nr == vnode->inode_nr
+          && ghost->file_offset >= start && ghost->file_offset < end) {
+        free_cache_ghost(ghost);
+      }
+    }
+  }
+}
+
+
+/* @brief   Return a ghost entry to the unused end of the ghost queue
+ *
+ * @param   ghost, ghost entry in use
+ */
+static void free_cache_ghost(struct CacheGhost *ghost)
+{
+  int h;
+  
+  h = calc_page_lookup_hash(ghost->inode_nr, ghost->file_offset);
+  DLIST_REM_ENTRY(&cache_ghost_hash[h], ghost, hash_link);
+  DLIST_REM_ENTRY(&cache_ghost_queue, ghost, lru_link);
+  
+  ghost->superblock = NULL;
+  DLIST_ADD_TAIL(&cache_ghost_queue, ghost, lru_link);
+  cache_ghost_cnt--;
+}
+
+
 /* @brief   Find a specific file's block in the cache
  *
  * @param   vnode, file to find block of
@@ -192,41 +591,113 @@ struct Page *find_blk(struct VNode *vnode, uint64_t file_offset)
 
 /* @brief   Find any block that doesn't need to be written to disk
  *
+ * @param   anon, true if the page is for anonymous memory, false for the file cache
  * @return  Page on success, null if not present
  *
-  // Do we need to remove pages that are busy in getblk, or do we
-  // Need to skip over busy pages in the search?
+ * Pages without valid contents are used first, except that once the file
+ * cache holds cache_max_pages it recycles its own blocks.  Anonymous memory
+ * may only take cached blocks while the cache holds more than cache_min_pages.
  *
+ * Anonymous memory takes zero filled pages first, the file cache only uses
+ * them once other free pages have run out.
  *
- * Remove from appropriate LRU list,  if valid it is still on the hash lookup 
-+ */
-struct Page *find_available_blk(void)
+ * The page is left on its queue, if valid it is still on the hash lookup.
+ */
+struct Page *find_available_blk(bool anon)
 {
   struct Page *page;
+  int cached_cnt;
 
+  cached_cnt = cache_page_cnt - free_page_cnt - anon_page_cnt;
+  
+  if (anon == false && cached_cnt >= cache_max_pages) {
+    if ((page = find_cached_blk()) != NULL) {
+      return page;
+    }
+  }
+  
+  if (anon == true && (page = DLIST_TAIL(&zero_page_queue)) != NULL) {
+    return page;
+  }
+  
   if ((page = DLIST_TAIL(&free_page_queue)) != NULL) {
     return page;
   }
 
-  return NULL;
+  if (anon == false && (page = DLIST_TAIL(&zero_page_queue)) != NULL) {
+    return page;
+  }
+  
+  if (anon == true && cached_cnt <= cache_min_pages) {
+    return NULL;
+  }
+  
+  return find_cached_blk();
+}
+
+
+/* @brief   Choose the cached block to evict next
+ *
+ * @return  Page on success, null if no clean blocks are cached
+ *
+ * The oldest block on the a1in queue is chosen while a1in holds more than
+ * CACHE_A1IN_PERCENT of the cache, else the least recently used block on
+ * the am queue.  Blocks on a1in that are in use are skipped, see B_QUEUED.
+ */
+static struct Page *find_cached_blk(void)
+{
+  struct Page *page = NULL;
+
+  if (cache_a1in_cnt > (cache_page_cnt * CACHE_A1IN_PERCENT) / 100
+      || DLIST_EMPTY(&cache_am_queue)) {
+    page = DLIST_TAIL(&cache_a1in_queue);
+
+    while (page != NULL && (page->bflags & B_BUSY)) {
+      page = DLIST_PREV(page, free_link);
+    }
+  }
+  
+  if (page == NULL) {
+    page = DLIST_TAIL(&cache_am_queue);
+  }
+  
+  return page;
 }
 
 
 /* @brief   Add a page to the free page queue
  *
+ * Valid blocks are added to the head of the a1in or am queue.  Pages without
+ * valid contents are added to the tail of the free page queue to be reused
+ * first, or of the zero page queue if they are zero filled.
  */
 void add_to_free_page_queue(struct Page *page)
 {
-  DLIST_ADD_HEAD(&free_page_queue, page, free_link);
-  free_page_cnt++;
+  if ((page->bflags & B_VALID) == 0) {
+    if (page->bflags & B_ERASED) {
+      DLIST_ADD_TAIL(&zero_page_queue, page, free_link);
+      zero_page_cnt++;
+    } else {
+      DLIST_ADD_TAIL(&free_page_queue, page, free_link);
+    }
+    free_page_cnt++;
+  } else if (page->bflags & B_AM) {
+    DLIST_ADD_HEAD(&cache_am_queue, page, free_link);
+    cache_am_cnt++;
+  } else {
+    DLIST_ADD_HEAD(&cache_a1in_queue, page, free_link);
+    cache_a1in_cnt++;
+  }
 }
 
 
 /* @brief   Add a page to the free page queue tail
  *
+ * The contents of the page are no longer known to be zero.
  */
 void add_to_free_page_queue_tail(struct Page *page)
 {
+  page->bflags &= ~B_ERASED;
   DLIST_ADD_TAIL(&free_page_queue, page, free_link);
   free_page_cnt++;
 }
@@ -234,11 +705,27 @@ void add_to_free_page_queue_tail(struct Page *page)
 
 /* @brief   Remove a page from a page queue
  *
+ * The queue a page is on is determined by its B_VALID, B_AM and B_ERASED
+ * flags, these must not be changed while the page is on a queue.  This
+ * includes a busy block that getblk() left on the a1in queue with B_QUEUED.
  */
 void remove_from_free_page_queue(struct Page *page)
 {
-  DLIST_REM_ENTRY(&free_page_queue, page, free_link);
-  free_page_cnt--;
+  if ((page->bflags & B_VALID) == 0) {
+    if (page->bflags & B_ERASED) {
+      DLIST_REM_ENTRY(&zero_page_queue, page, free_link);
+      zero_page_cnt--;
+    } else {
+      DLIST_REM_ENTRY(&free_page_queue, page, free_link);
+    }
+    free_page_cnt--;
+  } else if (page->bflags & B_AM) {
+    DLIST_REM_ENTRY(&cache_am_queue, page, free_link);
+    cache_am_cnt--;
+  } else {
+    DLIST_REM_ENTRY(&cache_a1in_queue, page, free_link);
+    cache_a1in_cnt--;
+  }
 }
 
 
@@ -262,18 +749,18 @@ void remove_from_lookup_page_hash(struct Page *page)
 }
 
 
-/*
+/* @brief   Add a page to its vnode's tree of cached pages
  *
  */ 
 void add_to_vnode_page_list(struct Page *page)
 {
   kassert(page->vnode != NULL);
   
-  DLIST_ADD_HEAD(&page->vnode->page_list, page, vnode_link);
+  pagetree_insert(page->vnode, page);
 }
 
 
-/*
+/* @brief   Remove a page from its vnode's tree of cached pages
  *
  */ 
 void remove_from_vnode_page_list(struct Page *page)
@@ -281,7 +768,131 @@ void remove_from_vnode_page_list(struct Page *page)
   kassert(page->vnode != NULL);
   kassert(page->vnode->superblock != NULL);
 
-  DLIST_REM_ENTRY(&page->vnode->page_list, page, vnode_link);
+  pagetree_remove(page->vnode, page);
+}
+
+
+/* @brief   Add a delayed-write page to its vnode's dirty list
+ *
+ * The dirty list is kept sorted by file offset so that contiguous pages can
+ * be written as a cluster.  Pages are usually dirtied in ascending order so the
+ * search for the insertion point starts from the tail.
+ *
+ * If this is the vnode's first dirty page the vnode is also added to the
+ * superblock's list of dirty vnodes that the bdflush task scans.
+ */ 
+void add_to_vnode_dirty_page_list(struct Page *page)
+{
+  struct VNode *vnode;
+  struct Page *prev;
+  
+  vnode = page->vnode;
+  kassert(vnode != NULL);
+  
+  if (DLIST_EMPTY(&vnode->dirty_page_list)) {
+    DLIST_ADD_TAIL(&vnode->superblock->dirty_vnode_list, vnode, dirty_link);
+  }
+  
+  prev = DLIST_TAIL(&vnode->dirty_page_list);
+  
+  while (prev != NULL && prev->file_offset > page->file_offset) {
+    prev = DLIST_PREV(prev, dirty_link);
+  }
+  
+  if (prev == NULL) {
+    DLIST_ADD_HEAD(&vnode->dirty_page_list, page, dirty_link);
+  } else {
+    DLIST_INSERT_AFTER(&vnode->dirty_page_list, prev, page, dirty_link);
+  }
+  
+  dirty_page_cnt++;
+}
+
+
+/* @brief   Remove a page from its vnode's dirty list
+ *
+ */ 
+void remove_from_vnode_dirty_page_list(struct Page *page)
+{
+  struct VNode *vnode;
+  
+  vnode = page->vnode;
+  kassert(vnode != NULL);
+
+  DLIST_REM_ENTRY(&vnode->dirty_page_list, page, dirty_link);
+  dirty_page_cnt--;
+  
+  if (DLIST_EMPTY(&vnode->dirty_page_list)) {
+    DLIST_REM_ENTRY(&vnode->superblock->dirty_vnode_list, vnode, dirty_link);
+  }
+}
+
+
+/* @brief   Collect the dirty blocks of a filesystem that are due to be written
+ *
+ * @param   sb, superblock of the filesystem
+ * @param   now, current time in ticks, see getblk_dirty_vnode_list()
+ * @param   dirty_list, list to append the blocks to, linked by tmp_link
+ * @return  number of blocks added to dirty_list
+ */
+int getblk_dirty_list(struct SuperBlock *sb, uint64_t now, page_list_t *dirty_list)
+{
+  struct VNode *vnode;
+  int cnt = 0;
+  
+  vnode = DLIST_HEAD(&sb->dirty_vnode_list);
+  
+  while (vnode != NULL) {
+    cnt += getblk_dirty_vnode_list(vnode, now, dirty_list);
+    vnode = DLIST_NEXT(vnode, dirty_link);
+  }
+  
+  return cnt;
+}
+
+
+/* @brief   Collect the dirty blocks of a file if any are due to be written
+ *
+ * @param   vnode, file to collect the dirty blocks of
+ * @param   now, current time in ticks, UINT64_MAX to collect all dirty blocks
+ * @param   dirty_list, list to append the blocks to, linked by tmp_link
+ * @return  number of blocks added to dirty_list
+ *
+ * Once any dirty block of a file has expired all of the file's dirty blocks
+ * are collected, so that they can be written in clusters by bwrite_dirty_list()
+ * rather than a block at a time.  The blocks are appended in file offset order.
+ *
+ * Each block collected is marked busy and remains on its vnode's dirty list
+ * until it is written.  Blocks that are already busy are left for a later pass.
+ */
+int getblk_dirty_vnode_list(struct VNode *vnode, uint64_t now, page_list_t *dirty_list)
+{
+  struct Page *page;
+  int cnt = 0;
+
+  page = DLIST_HEAD(&vnode->dirty_page_list);
+  
+  while (page != NULL && page->expiration_ticks > now) {
+    page = DLIST_NEXT(page, dirty_link);
+  }
+  
+  if (page == NULL) {
+    return 0;
+  }
+  
+  page = DLIST_HEAD(&vnode->dirty_page_list);
+  
+  while (page != NULL) {
+    if ((page->bflags & B_BUSY) == 0) {
+      page->bflags |= B_BUSY;
+      DLIST_ADD_TAIL(dirty_list, page, tmp_link);
+      cnt++;
+    }
+    
+    page = DLIST_NEXT(page, dirty_link);
+  }
+  
+  return cnt;
 }
 
 
@@ -311,14 +922,15 @@ int calc_page_lookup_hash(ino_t inode_nr, off64_t file_offset)
  * then a new block is allocated in the cache and if needed it's contents
  * read from disk.
  *
- * In the current implementation the cache's block size is 4 Kb.
- * A block read will be of this size. If the block is at the end of the
- * file the remaining bytes after the end will be zero.
+ * Blocks are 4 Kb pages, but on a miss the neighbouring pages of the file's
+ * cache block that are not cached are read with the same message, see
+ * breadv().  If the block is at the end of the file the remaining bytes
+ * after the end will be zero.
  */
 struct Page *bread(struct VNode *vnode, off64_t file_offset)
 {
   struct Page *page;
-  ssize_t xfered;
+  int sc;
 
   klog_info("bread(vnode:%08x, offs:%08x", (uint32_t)vnode, (uint32_t)file_offset);
 
@@ -332,43 +944,315 @@ struct Page *bread(struct VNode *vnode, off64_t file_offset)
   if (page->bflags & B_VALID) {
     return page;
   }
-    
-  xfered = vfs_read(vnode, KUCOPY, page->vaddr, PAGE_SIZE, &file_offset);
-
-  kassert(xfered <= PAGE_SIZE);
   
-	if (xfered <= 0) {
-	  klog_error("bread failed, xfered = %d", (int)xfered);
+  sc = breadv(vnode, &page, 1);
+  
+	if ((page->bflags & B_VALID) == 0) {
+	  klog_error("bread failed, sc = %d", sc);
 		page->bflags |= B_ERROR;
     brelse(page);
     return NULL;
   }
 
-	if (xfered < PAGE_SIZE) {
-		memset(page->vaddr + xfered, 0, PAGE_SIZE - xfered);
+  return page;
+}
+
+
+/* @brief   Read a cluster of contiguous blocks of a file
+ *
+ * @param   vnode, vnode of file to read
+ * @param   file_offset, page-aligned offset of the first block
+ * @param   page_cnt, number of blocks to read, up to BREADN_MAX_PAGES
+ * @param   page, array to store the busy pages of the cluster in
+ * @return  number of blocks read, which may be fewer than requested,
+ *          or negative errno on failure
+ *
+ * All blocks of the cluster are reserved with getblk() before any are read,
+ * so that the blocks missing from the cache can be read with a single
+ * CMD_READ message rather than one message per block. Each page returned
+ * must be released with brelse().
+ */
+int breadn(struct VNode *vnode, off64_t file_offset, int page_cnt, struct Page **page)
+{
+  int t;
+  int sc;
+  
+  klog_info("breadn(vnode:%08x, offs:%08x, cnt:%d", (uint32_t)vnode, (uint32_t)file_offset, page_cnt);
+
+  if (page_cnt > BREADN_MAX_PAGES) {
+    page_cnt = BREADN_MAX_PAGES;
+  }
+  
+  for (t = 0; t < page_cnt; t++) {
+    if ((page[t] = getblk(vnode, file_offset + t * PAGE_SIZE)) == NULL) {
+      break;
+    }
+  }
+  
+  page_cnt = t;
+  
+  if (page_cnt == 0) {
+    klog_info("breadn failed, getblk failed");
+    return -EIO;
+  }
+  
+  sc = breadv(vnode, page, page_cnt);
+  
+  for (t = 0; t < page_cnt; t++) {
+    if ((page[t]->bflags & B_VALID) == 0) {
+      break;
+    }
+  }
+
+  if (t < page_cnt) {
+    klog_error("breadn failed, sc = %d", sc);
+    
+    for (int u = t; u < page_cnt; u++) {
+      if ((page[u]->bflags & B_VALID) == 0) {
+        page[u]->bflags |= B_ERROR;
+      }
+      
+      brelse(page[u]);
+    }
+  }
+  
+  return (t > 0) ? t : -EIO;
+}
+
+
+/* @brief   Read the blocks of a cluster that are not yet valid
+ *
+ * @param   vnode, vnode of file to read
+ * @param   page, busy pages of contiguous blocks of the file, from getblk()
+ * @param   page_cnt, number of pages, up to BREADN_MAX_PAGES
+ * @return  0 on success, negative errno if a read failed
+ *
+ * Each run of blocks that are not valid is read with a single message.
+ * The run is extended to the boundaries of the file's cache block size, see
+ * get_cache_block_size(), with neighbouring blocks that are not cached, up
+ * to BREADN_MAX_PAGES blocks in all.  These extra blocks are released once
+ * read.
+ *
+ * Blocks that were read are marked valid, any part of a block beyond the
+ * end of the file is zeroed.  Blocks that could not be read are left
+ * invalid for the caller to release.
+ */
+int breadv(struct VNode *vnode, struct Page **page, int page_cnt)
+{
+  msgiov_t riov[BREADN_MAX_PAGES];
+  struct Page *run[2 * BREADN_MAX_PAGES];
+  struct Page *extra;
+  size_t block_size;
+  off64_t block_start;
+  off64_t block_end;
+  off64_t file_end;
+  off64_t offset;
+  ssize_t xfered;
+  size_t page_xfered;
+  int first;
+  int cnt;
+  int start;
+  int end;
+  int sc = 0;
+  
+  kassert(page_cnt <= BREADN_MAX_PAGES);
+  
+  block_size = get_cache_block_size(vnode);
+  file_end = ALIGN_UP(vnode->size, PAGE_SIZE);
+  first = 0;
+  
+  while (first < page_cnt) {
+    if (page[first]->bflags & B_VALID) {
+      first++;
+      continue;
+    }
+    
+    // The run is built in the middle of run[] so it can be extended both ways
+    start = BREADN_MAX_PAGES;
+    end = start;
+    
+    for (cnt = 0; first + cnt < page_cnt; cnt++) {
+      if (page[first + cnt]->bflags & B_VALID) {
+        break;
+      }
+      
+      run[end++] = page[first + cnt];
+    }
+    
+    block_start = ALIGN_DOWN(run[start]->file_offset, block_size);
+    block_end = ALIGN_UP(run[end - 1]->file_offset + PAGE_SIZE, block_size);
+    
+    if (block_end > file_end) {
+      block_end = file_end;
+    }
+    
+    while (end - start < BREADN_MAX_PAGES
+           && run[start]->file_offset - PAGE_SIZE >= block_start) {
+      if ((extra = getblk_absent(vnode, run[start]->file_offset - PAGE_SIZE)) == NULL) {
+        break;
+      }
+      
+      run[--start] = extra;
+    }
+
+    while (end - start < BREADN_MAX_PAGES
+           && run[end - 1]->file_offset + PAGE_SIZE < block_end) {
+      if ((extra = getblk_absent(vnode, run[end - 1]->file_offset + PAGE_SIZE)) == NULL) {
+        break;
+      }
+      
+      run[end++] = extra;
+    }
+    
+    for (int t = start; t < end; t++) {
+      riov[t - start].addr = run[t]->vaddr;
+      riov[t - start].size = PAGE_SIZE;
+    }
+    
+    offset = run[start]->file_offset;
+    xfered = vfs_readv(vnode, KUCOPY, riov, end - start, (end - start) * PAGE_SIZE, &offset);
+    
+    if (xfered < 0) {
+      sc = xfered;
+      xfered = 0;
+    }
+    
+    for (int t = start; t < end; t++) {
+      if (xfered <= (ssize_t)((t - start) * PAGE_SIZE)) {
+        break;
+      }
+      
+      page_xfered = xfered - (t - start) * PAGE_SIZE;
+      
+      if (page_xfered < PAGE_SIZE) {
+        memset(run[t]->vaddr + page_xfered, 0, PAGE_SIZE - page_xfered);
+      }
+      
+      run[t]->bflags |= B_VALID;
+    }
+    
+    // Release the blocks that were added to the caller's run
+    for (int t = start; t < end; t++) {
+      if (t >= BREADN_MAX_PAGES && t < BREADN_MAX_PAGES + cnt) {
+        continue;
+      }
+      
+      if ((run[t]->bflags & B_VALID) == 0) {
+        run[t]->bflags |= B_ERROR;
+      }
+      
+      brelse(run[t]);
+    }
+    
+    first += cnt;
+  }
+  
+  return sc;
+}
+
+
+/* @brief   Get a block without reading it from the filesystem handler
+ *
+ * @param   vnode, file to get the block of
+ * @param   file_offset, page-aligned offset within the file
+ * @return  Page on success, NULL if it cannot be allocated
+ *
+ * Used for blocks that hold no file data outside of the range the caller is
+ * about to write, such as blocks beyond the end of the file.  If the block is
+ * not already cached getblk() returns it zero filled, so it is not cleared
+ * again here.
+ */
+struct Page *bread_zero(struct VNode *vnode, off64_t file_offset)
+{
+  struct Page *page;
+
+  page = getblk(vnode, file_offset);
+
+  if (page == NULL) {
+    return NULL;
+  }
+  
+  page->bflags |= B_VALID;
+  return page;
+}
+
+
+/* @brief   Get a block of a file to map into a user address space
+ *
+ * @param   vnode, file to map the block of
+ * @param   file_offset, page-aligned offset within the file
+ * @return  Page on success, NULL if it could not be read
+ *
+ * The block is read as with bread() and returned not busy.  While it has
+ * mappings it is marked B_MAPPED and kept off the page queues so that it
+ * cannot be evicted, its reference_cnt is the number of mappings.  Each
+ * mapping is released with free_page(), see bunmap().
+ */
+struct Page *bmap(struct VNode *vnode, off64_t file_offset)
+{
+  struct Page *page;
+
+  if ((page = bread(vnode, file_offset)) == NULL) {
+    return NULL;
+  }
+
+  if ((page->bflags & B_MAPPED) == 0) {
+    page->bflags |= B_MAPPED;
+    page->reference_cnt = 0;
   }
 
-  page->bflags |= B_VALID;
-
+  page->reference_cnt++;
+  brelse(page);
   return page;
 }
 
 
-/*
- * TODO: getblk, can it return NULL ?
+/* @brief   Release a block once its last user mapping has been removed
+ *
+ * @param   page, block previously returned by bmap()
  *
- * TODO: optimization, if not present, can we set a flag so it gets from clean pool ?
+ * A busy block is returned to the page queues by the brelse() of its owner.
+ * A block that was discarded while mapped, such as by truncation of the file,
+ * no longer belongs to the file and becomes a free page.
  */
-struct Page *bread_zero(struct VNode *vnode, off64_t file_offset)
+void bunmap(struct Page *page)
 {
-  struct Page *page;
+  page->bflags &= ~B_MAPPED;
+  page->reference_cnt = 0;
 
-  page = getblk(vnode, file_offset);
+  if (page->bflags & B_BUSY) {
+    return;
+  }
 
-  memset(page->vaddr, 0, PAGE_SIZE);
+  if (page->vnode == NULL) {
+    page->bflags = 0;
+    add_to_free_page_queue_tail(page);
+  } else if ((page->bflags & B_DIRTY) == 0) {
+    add_to_free_page_queue(page);
+  }
 
-  page->bflags |= B_VALID;
-  return page;
+  TaskWakeupAll(&page_list_rendez);
+}
+
+
+/* @brief   Mark a block mapped with MAP_SHARED as modified
+ *
+ * @param   page, mapped block that is not busy
+ *
+ * Called on a write fault to a shared mapping before write access is granted.
+ * The block is written back by bdflush or bsyncv() along with delayed-writes.
+ * Writing a mapped block removes write access from its mappings so that the
+ * next store faults and marks it dirty again, see pmap_page_clear_write().
+ */
+void bmap_dirty(struct Page *page)
+{
+  if (page->bflags & B_DIRTY) {
+    return;
+  }
+
+  page->bflags |= B_DIRTY;
+  page->expiration_ticks = get_hardclock() + DIRTY_WRITE_DELAY_TICKS;
+  add_to_vnode_dirty_page_list(page);
 }
 
 
@@ -377,6 +1261,9 @@ struct Page *bread_zero(struct VNode *vnode, off64_t file_offset)
  * @param   page, buffer to write
  * @return  0 on success, negative errno on failure
  *
+ * If the block was a delayed-write it is no longer dirty once written.
+ * If the write fails, see bwrite_error().
+ *
  * TODO: in file.c read_from_file() can we grab a bunch of pages for larger writes from the cache?
  * Then do a single message to write all data at once?
  */
@@ -386,9 +1273,20 @@ int bwrite(struct Page *page)
   struct VNode *vnode;
   off64_t file_offset;
   off_t nbytes_to_write;
+  bool delayed;
     
   vnode = page->vnode;
   file_offset = page->file_offset;
+  delayed = (page->bflags & B_DIRTY) ? true : false;
+
+  if (delayed) {
+    remove_from_vnode_dirty_page_list(page);
+    page->bflags &= ~B_DIRTY;
+  }
+
+  if (page->bflags & B_MAPPED) {
+    pmap_page_clear_write(page);
+  }
 
   if ((vnode->size - page->file_offset) < PAGE_SIZE) {
     nbytes_to_write = vnode->size % PAGE_SIZE;
@@ -399,8 +1297,7 @@ int bwrite(struct Page *page)
   xfered = vfs_write(vnode, KUCOPY, page->vaddr, nbytes_to_write, &file_offset);
 
   if (xfered != nbytes_to_write) {
-    page->bflags |= B_ERROR;
-    brelse(page);
+    bwrite_error(page, delayed);
     return -1;
   }
 
@@ -409,6 +1306,246 @@ int bwrite(struct Page *page)
 }
 
 
+/* @brief   Write a cluster of contiguous blocks to disk and release them
+ * 
+ * @param   vnode, file the blocks belong to
+ * @param   page, busy pages of contiguous blocks of the file
+ * @param   page_cnt, number of pages, up to BWRITEV_MAX_PAGES
+ * @return  0 on success, negative errno on failure
+ *
+ * The cluster is sent to the filesystem handler as a single CMD_WRITE message
+ * with an iov entry per block, allowing the handler to allocate and write
+ * larger extents.  The last block is trimmed to the end of the file, blocks
+ * wholly beyond the end of the file are released without being written.
+ * Blocks that could not be written are handled as with bwrite().
+ */
+int bwritev(struct VNode *vnode, struct Page **page, int page_cnt)
+{
+  msgiov_t siov[BWRITEV_MAX_PAGES];
+  bool delayed[BWRITEV_MAX_PAGES];
+  off64_t offset;
+  ssize_t xfered;
+  size_t nbytes;
+  int iov_cnt;
+  int sc = 0;
+  
+  kassert(page_cnt <= BWRITEV_MAX_PAGES);
+
+  nbytes = 0;
+  
+  for (iov_cnt = 0; iov_cnt < page_cnt; iov_cnt++) {
+    delayed[iov_cnt] = (page[iov_cnt]->bflags & B_DIRTY) ? true : false;
+    
+    if (delayed[iov_cnt]) {
+      remove_from_vnode_dirty_page_list(page[iov_cnt]);
+      page[iov_cnt]->bflags &= ~B_DIRTY;
+    }
+
+    if (page[iov_cnt]->bflags & B_MAPPED) {
+      pmap_page_clear_write(page[iov_cnt]);
+    }
+  }
+  
+  for (iov_cnt = 0; iov_cnt < page_cnt; iov_cnt++) {
+    if (page[iov_cnt]->file_offset >= vnode->size) {
+      break;
+    }
+    
+    siov[iov_cnt].addr = page[iov_cnt]->vaddr;
+    
+    if ((vnode->size - page[iov_cnt]->file_offset) < PAGE_SIZE) {
+      siov[iov_cnt].size = vnode->size - page[iov_cnt]->file_offset;
+    } else {
+      siov[iov_cnt].size = PAGE_SIZE;
+    }
+    
+    nbytes += siov[iov_cnt].size;
+  }
+  
+  xfered = 0;
+  
+  if (iov_cnt > 0) {
+    offset = page[0]->file_offset;
+    xfered = vfs_writev(vnode, KUCOPY, siov, iov_cnt, nbytes, &offset);
+  
+    if (xfered != (ssize_t)nbytes) {
+      klog_error("bwritev failed, xfered = %d", (int)xfered);
+      sc = -EIO;
+    }
+  }
+  
+  for (int t = 0; t < page_cnt; t++) {
+    if (t < iov_cnt && xfered < (ssize_t)(t * PAGE_SIZE + siov[t].size)) {
+      bwrite_error(page[t], delayed[t]);
+    } else {
+      brelse(page[t]);
+    }
+  }
+  
+  return sc;
+}
+
+
+/* @brief   Release a block that could not be written
+ *
+ * @param   page, busy block that failed to be written
+ * @param   delayed, true if the block was a delayed-write
+ *
+ * The writer of a delayed-write block has already been told it succeeded, so
+ * the block is kept dirty for bdflush to retry and the error is recorded on the
+ * vnode to be returned by the next fsync().  Other blocks are discarded, the
+ * error is returned to the writer.
+ */
+static void bwrite_error(struct Page *page, bool delayed)
+{
+  if (delayed) {
+    page->vnode->write_error = -EIO;
+    page->bflags |= B_DIRTY;
+    page->expiration_ticks = get_hardclock() + DIRTY_WRITE_DELAY_TICKS;
+    add_to_vnode_dirty_page_list(page);
+  } else {
+    page->bflags |= B_ERROR;
+  }
+  
+  brelse(page);
+}
+
+
+/* @brief   Write a list of dirty blocks in clusters
+ *
+ * @param   dirty_list, busy blocks linked by tmp_link, see getblk_dirty_list()
+ * @return  0 on success, negative errno if any block could not be written
+ *
+ * Runs of blocks on the list that belong to the same file and have contiguous
+ * file offsets are written with a single bwritev() of up to BWRITEV_MAX_PAGES.
+ */
+int bwrite_dirty_list(page_list_t *dirty_list)
+{
+  struct Page *page[BWRITEV_MAX_PAGES];
+  struct Page *next;
+  int cnt;
+  int sc = 0;
+  
+  while ((next = DLIST_HEAD(dirty_list)) != NULL) {
+    cnt = 0;
+    
+    do {
+      DLIST_REM_HEAD(dirty_list, tmp_link);
+      page[cnt++] = next;
+      next = DLIST_HEAD(dirty_list);
+    } while (next != NULL && cnt < BWRITEV_MAX_PAGES
+             && next->vnode == page[0]->vnode
+             && next->file_offset == page[cnt - 1]->file_offset + PAGE_SIZE);
+    
+    if (bwritev(page[0]->vnode, page, cnt) != 0) {
+      sc = -EIO;
+    }
+  }
+  
+  return sc;
+}
+
+
+/* @brief   Release a block, writing it to disk after a delay
+ * 
+ * @param   page, buffer to write
+ * @return  0 on success, negative errno on failure
+ *
+ * The block is written by the filesystem's bdflush task once it has been
+ * dirty for DIRTY_WRITE_DELAY_TICKS.  Small writes to the same block within
+ * that time, such as appends to a log file, are combined into a single write
+ * to the filesystem handler.
+ */
+int bdwrite(struct Page *page)
+{
+  return bdelwrite(page, DIRTY_WRITE_DELAY_TICKS);
+}
+
+
+/* @brief   Release a block, starting a write to disk without waiting for it
+ * 
+ * @param   page, buffer to write
+ * @return  0 on success, negative errno on failure
+ *
+ * The write is started by the bdflush task within ASYNC_WRITE_DELAY_TICKS.
+ */
+int bawrite(struct Page *page)
+{
+  return bdelwrite(page, ASYNC_WRITE_DELAY_TICKS);
+}
+
+
+/* @brief   Mark a busy block as dirty and release it
+ *
+ * @param   page, buffer to write
+ * @param   delay, ticks until the bdflush task should write the block
+ * @return  0 on success, negative errno on failure
+ *
+ * A block that is already dirty keeps the earlier of its expiration times so
+ * that repeated writes cannot postpone it forever.  Dirty blocks are not on the
+ * free page queue, so the block is written immediately if the cache is short
+ * of clean pages or the filesystem has no bdflush task.
+ */
+static int bdelwrite(struct Page *page, uint64_t delay)
+{
+  struct SuperBlock *sb;
+  uint64_t expiration_ticks;
+  
+  sb = page->vnode->superblock;
+  
+  if (sb->bdflush_thread == NULL || (sb->flags & SBF_WRITETHRU)) {
+    return bwrite(page);
+  }
+  
+  if (free_page_cnt + cache_a1in_cnt + cache_am_cnt < DIRTY_MIN_FREE_PAGES) {
+    TaskWakeup(&sb->bdflush_rendez);
+    return bwrite(page);
+  }
+  
+  expiration_ticks = get_hardclock() + delay;
+  
+  if ((page->bflags & B_DIRTY) == 0) {
+    page->bflags |= B_DIRTY;
+    page->expiration_ticks = expiration_ticks;
+    add_to_vnode_dirty_page_list(page);
+  } else if (expiration_ticks < page->expiration_ticks) {
+    page->expiration_ticks = expiration_ticks;
+  }
+  
+  brelse(page);
+  return 0;
+}
+
+
+/* @brief   Read a busy block again from the filesystem handler and release it
+ *
+ * @param   page, busy block that is not dirty
+ * @return  0 on success, negative errno on failure
+ *
+ * Used for blocks mapped into user space, which cannot be discarded without
+ * detaching them from the file.  If the read fails the block is discarded.
+ */
+int brefresh(struct Page *page)
+{
+  off64_t offset;
+  ssize_t xfered;
+  
+  offset = page->file_offset;
+  xfered = vfs_read(page->vnode, KUCOPY, page->vaddr, PAGE_SIZE, &offset);
+  
+  if (xfered < 0) {
+    page->bflags |= B_ERROR;
+    brelse(page);
+    return -EIO;
+  } else if (xfered < PAGE_SIZE) {
+    memset(page->vaddr + xfered, 0, PAGE_SIZE - xfered);
+  }
+  
+  brelse(page);
+  return 0;
+}
+
+
 /* @brief   Discard a buffer in the cache, removing it from a vnode
  *
  * @param   page, buffer to discard
@@ -432,18 +1569,43 @@ void brelse(struct Page *page)
 {
   klog_info("brelse() page:%08x", (uint32_t)page);
   
+  if ((page->bflags & B_QUEUED) && (page->bflags & (B_ERROR | B_DISCARD | B_DIRTY | B_MAPPED))) {
+    // No longer a clean block, take it off the a1in queue it was left on
+    remove_from_free_page_queue(page);
+    page->bflags &= ~B_QUEUED;
+  }
+
   if (page->bflags & (B_ERROR | B_DISCARD)) {
     if (page->bflags & B_ERROR) {
       klog_error("File Block Error");
     }
     
+    if (page->bflags & B_DIRTY) {
+      remove_from_vnode_dirty_page_list(page);
+    }
+    
     remove_from_lookup_page_hash(page);    
     remove_from_vnode_page_list(page);
 
     page->file_offset = 0;
     page->vnode = NULL;
-    page->bflags = 0;
-    add_to_free_page_queue_tail(page);
+    
+    if (page->bflags & B_MAPPED) {
+      // Detached from the file, freed by bunmap() when the last mapping goes
+      page->bflags = B_MAPPED;
+    } else {
+      page->bflags = 0;
+      add_to_free_page_queue_tail(page);
+    }
+
+  } else if (page->bflags & (B_DIRTY | B_MAPPED)) {
+    // Dirty blocks stay off the free page queue until bdflush writes them,
+    // mapped blocks until their last mapping is removed
+    page->bflags &= ~B_BUSY;
+
+  } else if (page->bflags & B_QUEUED) {
+    // Keeps its place on the a1in queue
+    page->bflags &= ~(B_BUSY | B_QUEUED);
 
   } else {      
     page->bflags &= ~B_BUSY;
@@ -455,40 +1617,156 @@ void brelse(struct Page *page)
 }
 
 
-/* @brief   Mark all pages belonging to a file in the cache as busy
+/* @brief   Sync all dirty blocks of a vnode to disk
+ *
+ * @param   vnode, file to sync
+ * @return  0 on success, negative errno on failure
  *
- * The purpose is to ensure no pages can be removed from the vnode->page_list
- * whilst truncatev is walking the list.
+ * Writes the delayed-write blocks of the file in clusters regardless of when
+ * they expire, waiting for any that are busy, then asks the filesystem handler
+ * to sync the file.  An earlier delayed write that failed is reported here and
+ * then cleared.
+ *
+ * Called with vnode exclusive locked, maybe also the superblock vnode_list locked/busy or rwlock
  */
-void mark_all_vnode_pages_as_busy(struct VNode *vnode)
+int bsyncv(struct VNode *vnode)
 {
+  page_list_t dirty_list;
   struct Page *page;
-
-  page = DLIST_HEAD(&vnode->page_list);
+  int sc = 0;
+  int fsync_sc;
   
-  while (page != NULL) {
-    page->bflags |= B_BUSY;
-    page = DLIST_NEXT(page, vnode_link);
+  klog_info("bsyncv()");
+
+  while ((page = DLIST_HEAD(&vnode->dirty_page_list)) != NULL) {
+    DLIST_INIT(&dirty_list);
+    
+    if (getblk_dirty_vnode_list(vnode, UINT64_MAX, &dirty_list) == 0) {
+      // Remaining dirty blocks are all busy
+      TaskSleep(&page->rendez);
+      continue;
+    }
+    
+    if (bwrite_dirty_list(&dirty_list) != 0) {
+      // Blocks that failed are dirty again, leave them for bdflush to retry
+      sc = -EIO;
+      break;
+    }
+  }
+
+  fsync_sc = vfs_fsync(vnode);
+
+  if (vnode->write_error != 0) {
+    sc = vnode->write_error;
+    vnode->write_error = 0;
   }
+  
+  return (sc != 0) ? sc : fsync_sc;
 }
 
 
-/* @brief   Sync all dirty blocks of a vnode to disk
+/* @brief   Write the dirty blocks of part of a file to disk
  *
  * @param   vnode, file to sync
+ * @param   start, page-aligned offset of the start of the range
+ * @param   end, offset of the end of the range
  * @return  0 on success, negative errno on failure
  *
- * Called with vnode exclusive locked, maybe also the superblock vnode_list locked/busy or rwlock
+ * Used before a direct read or write of the range so that the filesystem
+ * handler holds the current contents of the file.  Busy blocks in the range
+ * are waited for, as they may be in the middle of being written.
+ */
+int bsyncv_range(struct VNode *vnode, off64_t start, off64_t end)
+{
+  page_list_t dirty_list;
+  struct Page *page;
+  struct Page *busy;
+  int sc = 0;
+
+  while (1) {
+    DLIST_INIT(&dirty_list);
+    busy = NULL;
+    page = pagetree_lookup_ge(vnode, start);
+    
+    while (page != NULL && page->file_offset < end) {
+      if (page->bflags & B_BUSY) {
+        busy = page;
+        break;
+      }
+      
+      if (page->bflags & B_DIRTY) {
+        page->bflags |= B_BUSY;
+        DLIST_ADD_TAIL(&dirty_list, page, tmp_link);
+      }
+      
+      page = pagetree_next(page);
+    }
+    
+    if (!DLIST_EMPTY(&dirty_list)) {
+      if (bwrite_dirty_list(&dirty_list) != 0) {
+        sc = -EIO;
+        break;
+      }
+    } else if (busy != NULL) {
+      start = busy->file_offset;
+      TaskSleep(&busy->rendez);
+    } else {
+      break;
+    }
+  }
+  
+  return sc;
+}
+
+
+/* @brief   Remove part of a file from the cache after it was written directly
+ *
+ * @param   vnode, file to invalidate blocks of
+ * @param   start, page-aligned offset of the start of the range
+ * @param   end, offset of the end of the range
+ * @return  0 on success, negative errno on failure
  *
- * TODO: There should be no dirty blocks in cache (there should be no dirty bit or dirty list).
+ * Blocks in the range are discarded.  Blocks that are mapped into user space
+ * cannot be discarded without detaching them from the file, so they are read
+ * again from the filesystem handler instead.
  */
-int bsyncv(struct VNode *vnode)
+int binvalidatev_range(struct VNode *vnode, off64_t start, off64_t end)
 {
-  klog_info("bsyncv()");
+  struct Page *page;
+  int sc = 0;
 
-  vfs_fsync(vnode);
+  remove_cache_ghosts(vnode, start, end);
 
-  return 0;
+  while ((page = pagetree_lookup_ge(vnode, start)) != NULL && page->file_offset < end) {
+    if (page->bflags & B_BUSY) {
+      TaskSleep(&page->rendez);
+      continue;
+    }
+    
+    if ((page->bflags & (B_DIRTY | B_MAPPED)) == 0) {
+      remove_from_free_page_queue(page);        
+    }
+    
+    page->bflags |= B_BUSY;
+    start = page->file_offset + PAGE_SIZE;
+    
+    if ((page->bflags & B_MAPPED) == 0) {
+      bdiscard(page);
+      continue;
+    }
+    
+    if (page->bflags & B_DIRTY) {
+      remove_from_vnode_dirty_page_list(page);
+      page->bflags &= ~B_DIRTY;
+      pmap_page_clear_write(page);
+    }
+    
+    if (brefresh(page) != 0) {
+      sc = -EIO;
+    }
+  }
+
+  return sc;
 }
 
 
@@ -504,33 +1782,37 @@ int bsyncv(struct VNode *vnode)
  * The new size must already be set within the vnode structure and the vnode
  * should already have an exclusive lock.
  *
+ * Only the pages from the end of the file onwards are visited, found through
+ * the vnode's page tree, waiting for any that are busy.
+ *
  * TODO: Maybe send a truncate message to the filesystem handler in here
  */
 int btruncatev(struct VNode *vnode)
 {
   struct Page *page;
-  struct Page *next;
+  off64_t file_offset;
   off64_t cluster_offset;
   off64_t remaining;
 
-
-  mark_all_vnode_pages_as_busy(vnode);
-
-  page = DLIST_HEAD(&vnode->page_list);
+  file_offset = ALIGN_DOWN(vnode->size, PAGE_SIZE);
+  
+  while ((page = pagetree_lookup_ge(vnode, file_offset)) != NULL) {
+    if (page->bflags & B_BUSY) {
+      TaskSleep(&page->rendez);
+      continue;
+    }
+    
+    if ((page->bflags & (B_DIRTY | B_MAPPED)) == 0) {
+      remove_from_free_page_queue(page);        
+    }
     
-  while(page != NULL) {
-    next = DLIST_NEXT(page, vnode_link); 
+    page->bflags |= B_BUSY;
+    file_offset = page->file_offset + PAGE_SIZE;
   
     if (vnode->size <= page->file_offset) {
-      page->bflags &= ~B_VALID;
-      
-      remove_from_free_page_queue(page);        
-      remove_from_lookup_page_hash(page);
-      remove_from_vnode_page_list(page);
-
       bdiscard(page);
          
-    } else if ((vnode->size - page->file_offset) < PAGE_SIZE) {
+    } else {
       // Clear partial buf at end of file, write page immediately
       cluster_offset = vnode->size - page->file_offset;
       remaining = PAGE_SIZE - cluster_offset;
@@ -539,10 +1821,9 @@ int btruncatev(struct VNode *vnode)
 
       bwrite(page);
     }
-      
-    page = next;
   }
   
+  remove_cache_ghosts(vnode, ALIGN_DOWN(vnode->size, PAGE_SIZE), INT64_MAX);
   return 0;
 }
 
@@ -558,19 +1839,61 @@ int binvalidatev(struct VNode *vnode)
 {
   struct Page *page;
 
-  while((page = DLIST_HEAD(&vnode->page_list)) != NULL) {
-    page->bflags |= B_BUSY;
-    page->bflags &= ~B_VALID;
+  while((page = pagetree_first(vnode)) != NULL) {
+    if (page->bflags & B_BUSY) {
+      TaskSleep(&page->rendez);
+      continue;
+    }
     
-    remove_from_free_page_queue(page);        
-    remove_from_lookup_page_hash(page);
-    remove_from_vnode_page_list(page);
-
+    if ((page->bflags & (B_DIRTY | B_MAPPED)) == 0) {
+      remove_from_free_page_queue(page);        
+    }
+    
+    page->bflags |= B_BUSY;
     bdiscard(page);
   }
 
+  remove_cache_ghosts(vnode, 0, INT64_MAX);
   return 0;
 }
 
 
 
+
+
+/* @brief   Get the file cache's replacement policy counters
+ *
+ * @param   buf, user address to copy a struct CacheStats to
+ * @param   sz, size of buf in bytes
+ * @return  number of bytes copied or negative errno on failure
+ *
+ * Used to check that frequently used blocks such as directories and
+ * executables remain in the cache during large sequential reads.
+ */
+int sys_getcachestats(void *buf, size_t sz)
+{
+  struct CacheStats stats;
+  
+  klog_info("sys_getcachestats(buf:%08x, sz:%u)", (uint32_t)buf, sz);
+
+  memcpy(&stats, &cache_stats, sizeof stats);
+  
+  stats.page_cnt = cache_page_cnt;
+  stats.free_cnt = free_page_cnt;
+  stats.anon_cnt = anon_page_cnt;
+  stats.zero_cnt = zero_page_cnt;
+  stats.a1in_cnt = cache_a1in_cnt;
+  stats.am_cnt = cache_am_cnt;
+  stats.dirty_cnt = dirty_page_cnt;
+  stats.ghost_cnt = cache_ghost_cnt;
+  
+  if (sz > sizeof stats) {
+    sz = sizeof stats;
+  }
+  
+  if (copyout(buf, &stats, sz) != 0) {
+    return -EFAULT;
+  }
+  
+  return sz;
+}
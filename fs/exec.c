@@ -39,6 +39,7 @@ char execargs_buf[MAX_ARGS_SZ];
 int do_exec(int fd, char *name, struct execargs *_args);
 static int check_elf_headers(int fd);
 static int load_process(struct Process *proc, int fd, void **entry_point);
+static int load_segment(int fd, Elf32_PHdr *phdr, uint32_t sec_prot);
 ssize_t read_file (int fd, off_t offset, void *vaddr, size_t sz);
 ssize_t kread_file (int fd, off_t offset, void *vaddr, size_t sz);
 
@@ -166,6 +167,8 @@ int do_exec(int fd, char *name, struct execargs *_args)
 
   current->exit_in_progress = false;
 
+  fini_asyncio(current);
+  
   if (cleanup_address_space(&current->as) != 0) {
     klog_error("exec cleanup address space failed");
     free_arg_pool(pool);
@@ -422,12 +425,8 @@ static int load_process(struct Process *proc, int fd, void **entry_point)
   int t;
   int rc;
   int32_t phdr_cnt;
-  off_t phdr_offs, sec_offs;
-  void *sec_addr;
-  int32_t sec_file_sz;
-  vm_size sec_mem_sz;
+  off_t phdr_offs;
   uint32_t sec_prot;
-  void *ret_addr;
   Elf32_EHdr ehdr;
   Elf32_PHdr phdr;
 
@@ -457,13 +456,9 @@ static int load_process(struct Process *proc, int fd, void **entry_point)
       continue;
     }
     
-    sec_addr = (void *)ALIGN_DOWN(phdr.p_vaddr, PAGE_SIZE);
-    sec_file_sz = phdr.p_filesz;
-    sec_mem_sz = ALIGN_UP(phdr.p_vaddr + phdr.p_memsz, PAGE_SIZE) - (vm_addr)sec_addr;
-    sec_offs = phdr.p_offset;
     sec_prot = 0;
 
-    if (sec_mem_sz < sec_file_sz) {
+    if (phdr.p_memsz < phdr.p_filesz) {
       klog_error("sec_mem_sz < file_sz");
       return -EIO;
     }
@@ -475,30 +470,98 @@ static int load_process(struct Process *proc, int fd, void **entry_point)
     if (phdr.p_flags & PF_W)
       sec_prot |= PROT_WRITE;
 
-		klog_info("section sec_addr:%08x sec_mem_sz:%08x", sec_addr, sec_mem_sz);
+    if ((rc = load_segment(fd, &phdr, sec_prot)) != 0) {
+      return rc;
+    }
+  }
 
-    if (sec_mem_sz != 0) {
-      ret_addr = sys_mmap(sec_addr, sec_mem_sz, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_FIXED, -1, 0);
+  klog_info("exec: load_process ok");
 
-      if (ret_addr == MAP_FAILED) {
-        klog_error("Failed to alloc fixed mem");
-        return -ENOMEM;
-      }
+  return 0;
+}
+
+
+/* @brief   Map a PT_LOAD segment of an executable into the current process
+ *
+ * @param   fd, file descriptor of the executable
+ * @param   phdr, program header of the segment
+ * @param   sec_prot, PROT_READ, PROT_WRITE and PROT_EXEC protection of the segment
+ * @return  0 on success, negative errno on failure
+ *
+ * The whole pages of the segment that hold file data are mapped MAP_PRIVATE
+ * from the file and faulted in from the file cache as they are accessed.
+ * Read-only pages such as text are shared by every process running the file,
+ * writable pages are copied on first write.
+ *
+ * The page holding both the end of the file data and the start of the bss is
+ * read into anonymous memory so that the rest of it is zero, the remaining
+ * pages of the bss are anonymous.  A segment whose file offset and address
+ * differ by other than a multiple of the page size is read in entirely.
+ *
+ * Pages that have not yet been touched by the process are also faulted in
+ * when a server reads or writes them with ipcopy(), see pmap_pagetable_walk(),
+ * so string literals and globals can be passed directly to system calls.
+ */
+static int load_segment(int fd, Elf32_PHdr *phdr, uint32_t sec_prot)
+{
+  vm_addr sec_addr;
+  vm_addr sec_ceiling;
+  vm_addr file_ceiling;
+  vm_addr map_ceiling;
+  vm_addr read_addr;
+  void *ret_addr;
+  ssize_t rc;
+  
+  sec_addr = ALIGN_DOWN(phdr->p_vaddr, PAGE_SIZE);
+  sec_ceiling = ALIGN_UP(phdr->p_vaddr + phdr->p_memsz, PAGE_SIZE);
+  file_ceiling = phdr->p_vaddr + phdr->p_filesz;
+
+  if (phdr->p_filesz == 0 || ((phdr->p_vaddr - phdr->p_offset) % PAGE_SIZE) != 0) {
+    map_ceiling = sec_addr;
+  } else if (phdr->p_memsz > phdr->p_filesz) {
+    map_ceiling = ALIGN_DOWN(file_ceiling, PAGE_SIZE);
+  } else {
+    map_ceiling = ALIGN_UP(file_ceiling, PAGE_SIZE);
+  }
+
+  klog_info("segment sec_addr:%08x map_ceiling:%08x sec_ceiling:%08x",
+            sec_addr, map_ceiling, sec_ceiling);
+
+  if (map_ceiling > sec_addr) {
+    ret_addr = sys_mmap((void *)sec_addr, map_ceiling - sec_addr, sec_prot,
+                        MAP_FIXED | MAP_PRIVATE, fd, ALIGN_DOWN(phdr->p_offset, PAGE_SIZE));
+
+    if (ret_addr == MAP_FAILED) {
+      klog_error("Failed to map file");
+      return -ENOMEM;
     }
+  }
 
-    if (sec_file_sz != 0) {
-      rc = read_file(fd, sec_offs, (void *)phdr.p_vaddr, sec_file_sz);
+  if (sec_ceiling > map_ceiling) {
+    ret_addr = sys_mmap((void *)map_ceiling, sec_ceiling - map_ceiling,
+                        PROT_READ | PROT_WRITE | PROT_EXEC, MAP_FIXED, -1, 0);
 
-      if (rc != sec_file_sz) {
-        klog_error("Failed to read file");
-        return -ENOMEM;
-      }
+    if (ret_addr == MAP_FAILED) {
+      klog_error("Failed to alloc fixed mem");
+      return -ENOMEM;
     }
+  }
+
+  if (file_ceiling > map_ceiling) {
+    read_addr = (map_ceiling > phdr->p_vaddr) ? map_ceiling : phdr->p_vaddr;
+    
+    rc = read_file(fd, phdr->p_offset + (read_addr - phdr->p_vaddr), (void *)read_addr,
+                   file_ceiling - read_addr);
 
-    sys_mprotect(sec_addr, sec_mem_sz, sec_prot);
+    if (rc != (ssize_t)(file_ceiling - read_addr)) {
+      klog_error("Failed to read file");
+      return -ENOMEM;
+    }
   }
 
-  klog_info("exec: load_process ok");
+  if (sec_ceiling > map_ceiling) {
+    sys_mprotect((void *)map_ceiling, sec_ceiling - map_ceiling, sec_prot);
+  }
 
   return 0;
 }
@@ -34,12 +34,15 @@ KLOG_REGISTER(LOG_FS_FILE)
  * @param   dst, destination address to copy file data to (kernel or user)
  * @param   sz, number of bytes to read
  * @param   offset, pointer to filp's offset which will be updated
+ * @param   ra, read-ahead state of the filp, or NULL to not read ahead
  * @param   inkernel, set to true if the destination address is in the kernel (for kread)
  * @return  number of bytes read or negative errno on failure  
  */
-ssize_t read_from_file(struct VNode *vnode, void *dst, size_t sz, off64_t *offset, bool inkernel)
+ssize_t read_from_file(struct VNode *vnode, void *dst, size_t sz, off64_t *offset,
+                       struct ReadAhead *ra, bool inkernel)
 {
-  struct Page *page;
+  struct Page *page[BREADN_MAX_PAGES];
+  int page_cnt;
   off64_t cluster_base;
   off64_t cluster_offset;
   size_t nbytes_xfer;
@@ -58,18 +61,24 @@ ssize_t read_from_file(struct VNode *vnode, void *dst, size_t sz, off64_t *offse
   nbytes_total = 0;
   nbytes_to_read = (remaining_in_file < sz) ? remaining_in_file : sz;
 
+  if (ra != NULL) {
+    file_readahead(vnode, ra, *offset, nbytes_to_read);
+  }
+
   while (nbytes_total < nbytes_to_read) {  
+    // Read the pages spanned by the rest of the read as one cluster
     cluster_base = ALIGN_DOWN(*offset, PAGE_SIZE);
-    cluster_offset = *offset % PAGE_SIZE;
-
     remaining_to_xfer = nbytes_to_read - nbytes_total;
-    remaining_in_cluster = PAGE_SIZE - cluster_offset;
-    nbytes_xfer = (remaining_to_xfer < remaining_in_cluster) ? remaining_to_xfer : remaining_in_cluster;
-		
-    page = bread(vnode, cluster_base);
+    page_cnt = (ALIGN_UP(*offset + remaining_to_xfer, PAGE_SIZE) - cluster_base) / PAGE_SIZE;
+    
+    if (page_cnt > BREADN_MAX_PAGES) {
+      page_cnt = BREADN_MAX_PAGES;
+    }
+    
+    page_cnt = breadn(vnode, cluster_base, page_cnt, page);
 
-    if (page == NULL) {
-      klog_warn("bread page is NULL");
+    if (page_cnt < 0) {
+      klog_warn("breadn failed");
       
       if (nbytes_total > 0) {
         return nbytes_total;
@@ -78,20 +87,30 @@ ssize_t read_from_file(struct VNode *vnode, void *dst, size_t sz, off64_t *offse
       }
     }
 
-    if (inkernel == true) {
-      memcpy(dst, page->vaddr + cluster_offset, nbytes_xfer);
-    } else {    
-      if (copyout(dst, page->vaddr + cluster_offset, nbytes_xfer) != 0) {
-      	return -EFAULT;
+    for (int t = 0; t < page_cnt; t++) {
+      cluster_offset = *offset % PAGE_SIZE;
+      remaining_to_xfer = nbytes_to_read - nbytes_total;
+      remaining_in_cluster = PAGE_SIZE - cluster_offset;
+      nbytes_xfer = (remaining_to_xfer < remaining_in_cluster) ? remaining_to_xfer : remaining_in_cluster;
+
+      if (inkernel == true) {
+        memcpy(dst, page[t]->vaddr + cluster_offset, nbytes_xfer);
+      } else {    
+        if (copyout(dst, page[t]->vaddr + cluster_offset, nbytes_xfer) != 0) {
+          while (t < page_cnt) {
+            brelse(page[t++]);
+          }
+          
+        	return -EFAULT;
+        }
       }
+      
+      brelse(page[t]);
+          
+      dst += nbytes_xfer;
+      *offset += nbytes_xfer;
+      nbytes_total += nbytes_xfer;
     }
-    
-    // FIXME: Could have been a dirty page, if so need to return it to the dirty queue
-    brelse(page);
-        
-    dst += nbytes_xfer;
-    *offset += nbytes_xfer;
-    nbytes_total += nbytes_xfer;
   }
 
   return nbytes_total;
@@ -106,8 +125,12 @@ ssize_t read_from_file(struct VNode *vnode, void *dst, size_t sz, off64_t *offse
  * @param   offset, pointer to filp's offset which will be updated
  * @return  number of bytes written or negative errno on failure  
  *
- * If we are writing a full block, can we avoid reading it in?
- * if block doesn't exist, does bread create it?
+ * Blocks are released with bdwrite() and written to the filesystem handler
+ * later by the bdflush task, unless the filesystem is mounted write-through.
+ *
+ * A block is only read from the filesystem handler if it holds file data
+ * that the write does not cover.  Blocks that are completely overwritten are
+ * neither read nor cleared.
  *
  * FIXME: Do we need an exclusive lock?
  */
@@ -133,10 +156,13 @@ ssize_t write_to_file(struct VNode *vnode, void *src, size_t sz, off64_t *offset
 		remaining_in_cluster = PAGE_SIZE - cluster_offset;
 		nbytes_xfer = (remaining_to_xfer < remaining_in_cluster) ? remaining_to_xfer : remaining_in_cluster;
 		
-		if (cluster_base < vnode->size) {
-      page = bread(vnode, cluster_base);
-    } else {
+    if (cluster_offset == 0 && nbytes_xfer == PAGE_SIZE) {
+      page = getblk_overwrite(vnode, cluster_base);
+    } else if (cluster_base >= vnode->size
+               || (cluster_offset == 0 && cluster_base + nbytes_xfer >= vnode->size)) {
       page = bread_zero(vnode, cluster_base);
+    } else {
+      page = bread(vnode, cluster_base);
     }
     
     if (page == NULL) {
@@ -148,8 +174,20 @@ ssize_t write_to_file(struct VNode *vnode, void *src, size_t sz, off64_t *offset
     }
 
     if (copyin(page->vaddr + cluster_offset, src, nbytes_xfer) != 0) {
+      // Contents no longer match the file, a clean block must not stay cached.
+      // A mapped block is read again so that it stays attached to the file.
+      if (page->bflags & B_DIRTY) {
+        brelse(page);
+      } else if (page->bflags & B_MAPPED) {
+        brefresh(page);
+      } else {
+        bdiscard(page);
+      }
+      
       return -EFAULT;  
     }
+    
+    page->bflags |= B_VALID;
 		 
     src += nbytes_xfer;
     *offset += nbytes_xfer;
@@ -169,14 +207,137 @@ ssize_t write_to_file(struct VNode *vnode, void *src, size_t sz, off64_t *offset
     
     // We may want to set a flag B_SYNC to indicate it won't be used again soon, so that
     // it can be removed from the FS handler's cache.  (after writing to end of block
-    // for example).  Similarly mark as B_DELWRI to indicate to FS handler to keep
-    // block around as more data will be written to it.
-    // Or FS handler could determine it if the size of a write hits the end of a full
-    // page.
+    // for example).
     
-    bwrite(page);
+    if (vnode->superblock->flags & SBF_WRITETHRU) {
+      bwrite(page);
+    } else {
+      bdwrite(page);
+    }
+  }
+
+  return nbytes_total;
+}
+
+
+/* @brief   Check if a read or write of a file opened with O_DIRECT can bypass the cache
+ *
+ * @param   offset, file offset of the transfer
+ * @param   nbytes, size of the transfer
+ * @return  true if both are multiples of DIRECT_IO_ALIGN
+ *
+ * Unaligned transfers go through the file cache as normal.
+ */
+bool is_direct_io_aligned(off64_t offset, size_t nbytes)
+{
+  return (offset % DIRECT_IO_ALIGN) == 0 && (nbytes % DIRECT_IO_ALIGN) == 0;
+}
+
+
+/* @brief   Read from a file directly into a user buffer, bypassing the file cache
+ *
+ * @param   vnode, file to read from
+ * @param   dst, user-space destination address
+ * @param   sz, number of bytes to read, a multiple of DIRECT_IO_ALIGN
+ * @param   offset, pointer to filp's offset which will be updated
+ * @return  number of bytes read or negative errno on failure
+ *
+ * The filesystem handler copies the data straight into the caller's buffer,
+ * as read_from_block() does for block devices.  Dirty cached blocks in the
+ * range are written first so that the read returns their contents.
+ */
+ssize_t read_from_file_direct(struct VNode *vnode, void *dst, size_t sz, off64_t *offset)
+{
+  size_t nbytes_total;
+  size_t nbytes_to_read;
+  ssize_t xfered;
+  int sc;
+
+  if (*offset >= vnode->size) {
+    return 0;
+  }
+
+  if ((off64_t)sz < vnode->size - *offset) {
+    nbytes_to_read = sz;
+  } else {
+    nbytes_to_read = vnode->size - *offset;
+  }
+
+  if ((sc = bsyncv_range(vnode, *offset, *offset + nbytes_to_read)) != 0) {
+    return sc;
+  }
+
+  nbytes_total = 0;
+
+  while (nbytes_total < nbytes_to_read) {
+    xfered = vfs_read(vnode, IPCOPY, dst, nbytes_to_read - nbytes_total, offset);
+
+    if (xfered == 0) {
+      break;
+    }
+
+    if (xfered < 0) {
+      return (nbytes_total > 0) ? (ssize_t)nbytes_total : xfered;
+    }
+
+    dst += xfered;
+    nbytes_total += xfered;
+  }
+
+  return nbytes_total;
+}
+
+
+/* @brief   Write to a file directly from a user buffer, bypassing the file cache
+ *
+ * @param   vnode, file to write to
+ * @param   src, user-space source address
+ * @param   sz, number of bytes to write, a multiple of DIRECT_IO_ALIGN
+ * @param   offset, pointer to filp's offset which will be updated
+ * @return  number of bytes written or negative errno on failure
+ *
+ * The filesystem handler copies the data straight from the caller's buffer.
+ * Dirty cached blocks in the range are written first so they cannot later
+ * overwrite the new data, and cached blocks of the range are invalidated
+ * once written, see binvalidatev_range().
+ */
+ssize_t write_to_file_direct(struct VNode *vnode, void *src, size_t sz, off64_t *offset)
+{
+  off64_t start;
+  size_t nbytes_total;
+  ssize_t xfered;
+  ssize_t sc;
+
+  start = *offset;
+
+  if ((sc = bsyncv_range(vnode, start, start + sz)) != 0) {
+    return sc;
+  }
+
+  nbytes_total = 0;
+  sc = 0;
+
+  while (nbytes_total < sz) {
+    xfered = vfs_write(vnode, IPCOPY, src, sz - nbytes_total, offset);
+
+    if (xfered <= 0) {
+      sc = xfered;
+      break;
+    }
+
+    src += xfered;
+    nbytes_total += xfered;
+  }
+
+  if (*offset > vnode->size) {
+    vnode->size = *offset;
+  }
+
+  if (nbytes_total == 0) {
+    return sc;
   }
 
+  binvalidatev_range(vnode, start, start + nbytes_total);
   return nbytes_total;
 }
 
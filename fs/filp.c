@@ -93,6 +93,7 @@ struct Filp *filp_get_new(void)
   filp->reference_cnt = 1;
   filp->type = FILP_TYPE_UNDEF;
   memset(&filp->u, 0, sizeof filp->u);
+  memset(&filp->ra, 0, sizeof filp->ra);
   
   filp->flags = 0;
 
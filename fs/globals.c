@@ -71,6 +71,42 @@ dname_list_t dname_hash[DNAME_HASH];
  */
 struct VNode *logger_vnode = NULL;
 
+int max_asyncio;
+struct AsyncIO *asyncio_table;
+asyncio_list_t free_asyncio_list;
+int free_asyncio_cnt;
+
+
+/*
+ * File read-ahead
+ */
+struct ReadAheadReq readahead_table[NR_READAHEAD];
+readahead_list_t readahead_free_list;
+readahead_list_t readahead_pending_list;
+struct Rendez readahead_rendez;
+struct Thread *readahead_thread;
+
+
 
 
 
+/*
+ * File cache replacement policy
+ */
+int max_cache_ghost;
+int cache_ghost_cnt;
+struct CacheGhost *cache_ghost_table;
+cacheghost_list_t cache_ghost_queue;
+cacheghost_list_t cache_ghost_hash[PAGE_LOOKUP_HASH_SZ];
+struct CacheStats cache_stats;
+
+
+/*
+ * Memory reclaim
+ */
+struct Rendez reclaim_rendez;
+struct Thread *reclaim_thread;
+int free_page_low;
+int free_page_high;
+int cache_min_pages;
+int cache_max_pages;
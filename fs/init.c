@@ -37,6 +37,9 @@ void init_vfs(void)
 
   init_vfs_lists();
   init_vfs_pipes();
+  init_readahead();
+  init_cache();
+  init_reclaim();
    
 //  dirty_queues_busy = false;
 //  InitRendez(&dirty_queues_rendez);
@@ -91,6 +94,16 @@ void init_vfs_lists(void)
     DLIST_ADD_TAIL(&free_superblock_list, &superblock_table[t], link);
     rwlock_init(&superblock_table[t].lock);
   }
+
+  DLIST_INIT(&free_asyncio_list);
+
+  for (int t = 0; t < max_asyncio; t++) {
+    asyncio_table[t].state = AIO_STATE_FREE;
+    asyncio_table[t].proc = NULL;
+    DLIST_ADD_TAIL(&free_asyncio_list, &asyncio_table[t], link);
+  }
+  
+  free_asyncio_cnt = max_asyncio;
 }
 
 
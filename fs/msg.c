@@ -37,6 +37,22 @@
 KLOG_REGISTER(LOG_FS_MSG)
 
 
+// Static prototypes
+static int do_getmsg(struct MsgPort *msgport, msgid_t *_msgid, iorequest_t *_req,
+                     size_t inline_sz);
+static int do_replymsg(struct MsgPort *msgport, msgid_t msgid, int status, ioreply_t *rep,
+                       size_t inline_sz);
+static ssize_t do_readmsg(struct Process *current_proc, struct Msg *msg, void *addr,
+                          size_t buf_sz, off_t offset);
+static ssize_t do_writemsg(struct Process *current_proc, struct Msg *msg, void *addr,
+                           size_t buf_sz, off_t offset);
+static struct Msg *find_sender_head(struct MsgPort *msgport, struct Process *sender);
+static void enqueue_pending_msg(struct MsgPort *msgport, struct Msg *msg);
+static void dequeue_pending_msg(struct MsgPort *msgport, struct Msg *msg);
+static void requeue_pending_msg(struct MsgPort *msgport, struct Msg *msg);
+static void notify_receiver(struct MsgPort *msgport);
+
+
 /* @brief   Get a message from a mount's message port
  *
  * @param   fd, file descriptor of mount created by sys_mount()
@@ -55,9 +71,6 @@ KLOG_REGISTER(LOG_FS_MSG)
 int sys_getmsg(int fd, msgid_t *_msgid, iorequest_t *_req, size_t req_sz)
 {
   struct SuperBlock *sb;  
-  struct MsgPort *msgport;
-  struct Msg *msg;
-  msgid_t msgid;
   struct Process *current_proc;
 
   klog_info("sys_getmsg(fd:%d,,,)", fd);
@@ -73,30 +86,114 @@ int sys_getmsg(int fd, msgid_t *_msgid, iorequest_t *_req, size_t req_sz)
     return -EINVAL;
   }
   
-  msgport = &sb->msgport;
+  return do_getmsg(&sb->msgport, _msgid, _req, 0);
+}
+
+
+/* @brief   Get a message from a mount's message port along with inline data
+ *
+ * @param   fd, file descriptor of mount created by sys_mount()
+ * @param   msgidp, user address to store the message's msgid
+ * @param   _req, address of buffer to read the iorequest and inline data into
+ * @param   req_sz, size of the iorequest header plus the inline data buffer
+ * @return  size of read iorequest header plus any inline data, or negative
+ *          errno on error.
+ *
+ * Same as sys_getmsg() except that up to MSG_INLINE_SZ bytes from the start
+ * of the message's data, such as the filename of a lookup, are copied out
+ * immediately after the header. This saves a sys_readmsg() call for small
+ * messages.
+ */
+int sys_getmsginline(int fd, msgid_t *_msgid, iorequest_t *_req, size_t req_sz)
+{
+  struct SuperBlock *sb;  
+  struct Process *current_proc;
+
+  klog_info("sys_getmsginline(fd:%d,,,)", fd);
+
+  if (req_sz < sizeof(iorequest_t) || _msgid == NULL || _req == NULL) {
+    return -EINVAL;
+  }
   
-  msg = kpeekmsg(msgport);
+  current_proc = get_current_process();  
+  sb = get_superblock(current_proc, fd);
   
-  if (msg == NULL) {
-    return 0;
+  if (sb == NULL) {
+    return -EINVAL;
   }
   
-  if (msg->req->cmd != CMD_ABORT) {
-    msg = kgetmsg(msgport);
+  return do_getmsg(&sb->msgport, _msgid, _req, req_sz - sizeof(iorequest_t));
+}
+
+
+/* @brief   Get multiple messages from a mount's message port
+ *
+ * @param   fd, file descriptor of mount created by sys_createmsgport()
+ * @param   _msgids, user array to store the msgid of each message received
+ * @param   _reqs, user array to store the iorequest header of each message received
+ * @param   cnt, number of entries in the _msgids and _reqs arrays
+ * @return  number of messages received, 0 if none are pending, or negative
+ *          errno on error
+ *
+ * Non-blocking, vectored form of sys_getmsg(). Drains up to cnt messages
+ * from the pending list in a single system call. The msgid in _msgids[n]
+ * is the msgid of the iorequest in _reqs[n]. Messages being aborted are
+ * returned with a CMD_ABORT header, as with sys_getmsg().
+ */
+int sys_getmsgv(int fd, msgid_t *_msgids, iorequest_t *_reqs, int cnt)
+{
+  struct SuperBlock *sb;  
+  struct MsgPort *msgport;
+  struct Msg *msg;
+  struct Process *current_proc;
+  int n;
+  
+  klog_info("sys_getmsgv(fd:%d, cnt:%d)", fd, cnt);
+
+  if (cnt < 1 || _msgids == NULL || _reqs == NULL) {
+    return -EINVAL;
+  }
+
+  if (bounds_check(_msgids, sizeof(msgid_t) * cnt) != 0 
+      || bounds_check(_reqs, sizeof(iorequest_t) * cnt) != 0) {
+    return -EFAULT;
+  }
+  
+  current_proc = get_current_process();  
+  sb = get_superblock(current_proc, fd);
+  
+  if (sb == NULL) {
+    return -EINVAL;
+  }
+  
+  msgport = &sb->msgport;
+  
+  for (n = 0; n < cnt; n++) {
+    msg = kpeekmsg(msgport);
     
     if (msg == NULL) {
-      return 0;
+      break;
     }
-  } else {
-    kremovemsg(msgport, msg);  
-  }
-
-  msgid = msg->msgid;
-
-  copyout (_msgid, &msgid, sizeof (msgid_t));
-  copyout (_req, msg->req, sizeof (iorequest_t));
+    
+    if (msg->req->cmd != CMD_ABORT) {
+      if ((msg = kgetmsg(msgport)) == NULL) {
+        break;
+      }
+    } else {
+      kremovemsg(msgport, msg);
+    }
+    
+    msgport_receive_priority(msg, get_current_thread());
 
-  return sizeof(iorequest_t);
+    if (copyout(&_msgids[n], &msg->msgid, sizeof (msgid_t)) != 0
+        || copyout(&_reqs[n], msg->req, sizeof (iorequest_t)) != 0) {
+      // Put the message back so that it is not lost
+      requeue_pending_msg(msgport, msg);
+      return (n > 0) ? n : -EFAULT;
+    }
+  }
+  
+  return n;
 }
 
 
@@ -106,9 +203,13 @@ int sys_getmsg(int fd, msgid_t *_msgid, iorequest_t *_req, size_t req_sz)
  * @param   msgid, unique message identifier returned by sys_getmsg()
  * @param   status, error status to return to caller (0 on success or negative errno)
  * @param   rep, pointer to optional ioreply for commands that require it.
- * @param   rep_sz, size of ioreply_t
+ * @param   rep_sz, size of ioreply_t plus the size of any inline reply data
  * @return  0 on success, negative errno on error 
  *
+ * Up to MSG_INLINE_SZ bytes placed immediately after the ioreply are written
+ * to the start of the message's reply buffers before the reply is sent, in
+ * place of a separate sys_writemsg() call.
+ *
  * FIXME: Check return values of ipcopy and copyout
  * TODO: Check range is user space for source and dest
  */
@@ -116,11 +217,10 @@ int sys_replymsg(int fd, msgid_t msgid, int status, ioreply_t *rep, size_t rep_s
 {
   struct Process *current_proc;
   struct SuperBlock *sb;
-  struct Msg *msg;
 
   klog_info("sys_replymsg(fd:%d)", fd);
 
-  if (rep != NULL && rep_sz != sizeof(ioreply_t)) {
+  if (rep != NULL && (rep_sz < sizeof(ioreply_t) || rep_sz > sizeof(ioreply_t) + MSG_INLINE_SZ)) {
     return -EINVAL;
   }
   
@@ -131,10 +231,211 @@ int sys_replymsg(int fd, msgid_t msgid, int status, ioreply_t *rep, size_t rep_s
     return -EINVAL;
   }
   
-  if ((msg = msgid_to_msg(&sb->msgport, msgid)) == NULL) {
+  return do_replymsg(&sb->msgport, msgid, status, rep,
+                     (rep != NULL) ? rep_sz - sizeof(ioreply_t) : 0);
+}
+
+
+/* @brief   Reply to a message and wait for the next message to arrive
+ *
+ * @param   fd, file descriptor of mounted file system created with sys_createmsgport()
+ * @param   _msgid, on entry the msgid to reply to, or INVALID_PID to only wait.
+ *                  On return the msgid of the newly received message.
+ * @param   status, error status to return to caller of replied message
+ * @param   rep, pointer to optional ioreply for commands that require it
+ * @param   _req, address of buffer to read the next iorequest message header into
+ * @param   _timeout, optional maximum duration to wait for a message, or NULL
+ * @return  size of read iorequest header, -ETIMEDOUT if the timeout expired,
+ *          or other negative errno on error
+ *
+ * Combines sys_replymsg() and a blocking sys_getmsg() so that a server's
+ * main loop needs a single kernel entry per request. Unlike sys_getmsg()
+ * this blocks on the message port's rendez rather than relying on the
+ * caller waiting for a thread event.
+ *
+ * Any number of a server's threads may wait on the same message port with
+ * this call. Each new message wakes one of them and a message received by
+ * one thread may be replied to by any other.
+ */
+int sys_replywaitmsg(int fd, msgid_t *_msgid, int status, ioreply_t *rep,
+                     iorequest_t *_req, struct timespec *_timeout)
+{
+  struct Process *current_proc;
+  struct SuperBlock *sb;
+  struct MsgPort *msgport;
+  struct Thread *client_thread;
+  struct timespec timeout;
+  uint64_t deadline;
+  uint64_t now;
+  uint64_t ticks;
+  msgid_t msgid;
+  int sc;
+  
+  klog_info("sys_replywaitmsg(fd:%d)", fd);
+
+  if (_msgid == NULL || _req == NULL) {
+    return -EINVAL;
+  }
+  
+  if (copyin(&msgid, _msgid, sizeof msgid) != 0) {
+    return -EFAULT;
+  }
+
+  if (_timeout != NULL) {
+    if (copyin(&timeout, _timeout, sizeof timeout) != 0) {
+      return -EFAULT;
+    }
+    
+    if (timeout.tv_sec < 0 || timeout.tv_nsec < 0 || timeout.tv_nsec >= 1000000000) {
+      return -EINVAL;
+    }
+
+    // Wakeups without a message must not restart the full timeout
+    deadline = get_hardclock() + ((uint64_t)timeout.tv_sec * JIFFIES_PER_SECOND)
+                 + (timeout.tv_nsec + NANOSECONDS_PER_JIFFY - 1) / NANOSECONDS_PER_JIFFY;
+  }
+  
+  current_proc = get_current_process();  
+  sb = get_superblock(current_proc, fd);
+
+  if (sb == NULL) {
+    return -EINVAL;
+  }
+
+  msgport = &sb->msgport;
+  client_thread = NULL;
+  
+  if (msgid != INVALID_PID) {
+    if ((sc = do_replymsg(msgport, msgid, status, rep, 0)) != 0) {
+      return sc;
+    }
+    
+    // Synchronous msgids are the sending thread's ID, hand back to it if we block
+    if (msgid < max_pid) {
+      client_thread = get_thread(msgid);
+    }
+  }
+
+  while (kpeekmsg(msgport) == NULL) {
+    if (msgport->flags & MPF_SHUTDOWN) {
+      return -ECONNABORTED;
+    }
+    
+    if (_timeout != NULL) {
+      now = get_hardclock();
+      
+      if (now >= deadline) {
+        return -ETIMEDOUT;
+      }
+      
+      ticks = deadline - now;
+      timeout.tv_sec = ticks / JIFFIES_PER_SECOND;
+      timeout.tv_nsec = (ticks % JIFFIES_PER_SECOND) * NANOSECONDS_PER_JIFFY;
+    }
+    
+    sc = kwaitport_handoff(msgport, (_timeout != NULL) ? &timeout : NULL, client_thread);
+    client_thread = NULL;
+    
+    if (sc != 0) {
+      return sc;
+    }
+  }
+  
+  return do_getmsg(msgport, _msgid, _req, 0);
+}
+
+
+/* @brief   Remove the next message from a message port and copy out its header
+ *
+ * @param   msgport, message port to get message from
+ * @param   _msgid, user address to store the message's msgid
+ * @param   _req, user address to store the iorequest message header
+ * @param   inline_sz, size of buffer following _req for inline message data
+ * @return  size of read iorequest header and inline data, 0 if no message or
+ *          negative errno on error
+ *
+ * A message that is being aborted is removed from the pending list but not
+ * added to the received list, as it has already been received once.
+ */
+static int do_getmsg(struct MsgPort *msgport, msgid_t *_msgid, iorequest_t *_req,
+                     size_t inline_sz)
+{
+  struct Process *current_proc;
+  struct Msg *msg;
+  msgid_t msgid;
+  ssize_t nbytes_read;
+
+  msg = kpeekmsg(msgport);
+  
+  if (msg == NULL) {
+    return 0;
+  }
+  
+  if (msg->req->cmd != CMD_ABORT) {
+    msg = kgetmsg(msgport);
+    
+    if (msg == NULL) {
+      return 0;
+    }
+  } else {
+    kremovemsg(msgport, msg);  
+  }
+
+  // The sender's priority follows the message to the thread serving it
+  msgport_receive_priority(msg, get_current_thread());
+
+  msgid = msg->msgid;
+
+  copyout (_msgid, &msgid, sizeof (msgid_t));
+  copyout (_req, msg->req, sizeof (iorequest_t));
+
+  if (inline_sz > MSG_INLINE_SZ) {
+    inline_sz = MSG_INLINE_SZ;
+  }
+  
+  if (inline_sz == 0 || msg->siov_cnt == 0 || msg->req->cmd == CMD_ABORT) {
+    return sizeof(iorequest_t);
+  }
+  
+  current_proc = get_current_process();
+  nbytes_read = do_readmsg(current_proc, msg, (uint8_t *)_req + sizeof(iorequest_t),
+                           inline_sz, 0);
+  
+  if (nbytes_read < 0) {
+    nbytes_read = 0;
+  }
+  
+  return sizeof(iorequest_t) + nbytes_read;
+}
+
+
+/* @brief   Reply to a message received on a message port
+ *
+ * @param   msgport, message port the message was received on
+ * @param   msgid, unique message identifier returned by sys_getmsg()
+ * @param   status, error status to return to caller
+ * @param   rep, user address of optional ioreply
+ * @param   inline_sz, size of inline reply data following the ioreply
+ * @return  0 on success, negative errno on error 
+ */
+static int do_replymsg(struct MsgPort *msgport, msgid_t msgid, int status, ioreply_t *rep,
+                       size_t inline_sz)
+{
+  struct Process *current_proc;
+  struct Msg *msg;
+  
+  if ((msg = msgid_to_msg(msgport, msgid)) == NULL) {
     return -EINVAL;
   }
 
+  if (inline_sz > 0 && rep != NULL) {
+    current_proc = get_current_process();
+
+    if (do_writemsg(current_proc, msg, (uint8_t *)rep + sizeof(ioreply_t), inline_sz, 0) < 0) {
+      status = -EFAULT;
+    }
+  }
+
   msg->reply_status = status;
 
   if (msg->reply != NULL && rep != NULL) {
@@ -170,13 +471,6 @@ int sys_readmsg(int fd, msgid_t msgid, void *addr, size_t buf_sz, off_t offset)
   struct Process *current_proc;
   struct SuperBlock *sb;
   struct Msg *msg;
-  size_t nbytes_to_read;
-  ssize_t nbytes_read;
-  size_t buf_remaining;
-  size_t iov_remaining;
-  off_t iov_offset;
-  int i;
-  int sc;
 
   klog_info("sys_readmsg(fd:%d)", fd);
           
@@ -190,15 +484,45 @@ int sys_readmsg(int fd, msgid_t msgid, void *addr, size_t buf_sz, off_t offset)
   if ((msg = msgid_to_msg(&sb->msgport, msgid)) == NULL) {
     return -EINVAL;
   }
+  
+  return do_readmsg(current_proc, msg, addr, buf_sz, offset);
+}
+
+
+/* @brief   Copy data from a message's send buffers into the server
+ *
+ * @param   current_proc, server process reading the message
+ * @param   msg, message to read from
+ * @param   addr, address of buffer in the server to read into
+ * @param   buf_sz, size of buffer to read into
+ * @param   offset, offset within the message to read
+ * @return  number of bytes read on success, negative errno on error 
+ */
+static ssize_t do_readmsg(struct Process *current_proc, struct Msg *msg, void *addr,
+                          size_t buf_sz, off_t offset)
+{
+  size_t nbytes_to_read;
+  ssize_t nbytes_read;
+  size_t buf_remaining;
+  size_t iov_remaining;
+  off_t iov_offset;
+  int i;
+  int sc;
+  struct IPCopyFixed *fixed;
     
   if (msg->siov_cnt == 0 || msg->siov_cnt >= IOV_MAX) {
     return -EINVAL;
   }
   
-  if (seekiov(msg->siov_cnt, msg->siov, offset, &i, &iov_remaining, &iov_offset) != 0) {
+  if (seekiov_cursor(msg->siov_cnt, msg->siov, &msg->siov_cursor, offset,
+                     &i, &iov_remaining, &iov_offset) != 0) {
     return -EINVAL;
   }
 
+  // Copies to or from the server's registered buffers skip the page table walk
+  fixed = ipcopy_fixed_get(msg->port->fixed_bufs);
+  msg->ipcopy_cache.fixed = fixed;
+
   nbytes_read = 0;
   buf_remaining = buf_sz;
     
@@ -209,7 +533,7 @@ int sys_readmsg(int fd, msgid_t msgid, void *addr, size_t buf_sz, off_t offset)
       sc = ipcopy(&current_proc->as, msg->src_as,
                   addr + nbytes_read,
                   msg->siov[i].addr + iov_offset,
-                  nbytes_to_read);
+                  nbytes_to_read, &msg->ipcopy_cache);
     } else {
       sc = copyout(addr + nbytes_read,
                    msg->siov[i].addr + iov_offset,
@@ -217,6 +541,8 @@ int sys_readmsg(int fd, msgid_t msgid, void *addr, size_t buf_sz, off_t offset)
     }
 
     if (sc != 0) {
+      ipcopy_fixed_put(fixed);
+      msg->ipcopy_cache.fixed = NULL;
       return -EFAULT;
     }
 
@@ -231,7 +557,12 @@ int sys_readmsg(int fd, msgid_t msgid, void *addr, size_t buf_sz, off_t offset)
       iov_offset = 0;
     }      
   }
-    
+
+  msg->siov_cursor.i = i;
+  msg->siov_cursor.base = offset + nbytes_read - iov_offset;    
+  ipcopy_fixed_put(fixed);
+  msg->ipcopy_cache.fixed = NULL;
+
   return nbytes_read;
 }
 
@@ -254,13 +585,6 @@ int sys_writemsg(int fd, msgid_t msgid, void *addr, size_t buf_sz, off_t offset)
   struct Process *current_proc;
   struct SuperBlock *sb;
   struct Msg *msg;
-  ssize_t nbytes_written;       // nbytes_transferred
-  size_t nbytes_to_write;       // TODO: Rename chunk_size
-  size_t buf_remaining;         // TODO: Rename src_buf_remaining
-  size_t iov_remaining;         // TODO: Rename dst_iov_remaining
-  off_t iov_offset;             // TODO: Rename dst_iov_offset
-  int i;
-  int sc;
 
   klog_info("sys_writemsg(fd:%d)", fd);
 
@@ -276,14 +600,43 @@ int sys_writemsg(int fd, msgid_t msgid, void *addr, size_t buf_sz, off_t offset)
     return -EINVAL;
   }
 
+  return do_writemsg(current_proc, msg, addr, buf_sz, offset);
+}
+
+
+/* @brief   Copy data from the server into a message's reply buffers
+ *
+ * @param   current_proc, server process writing the message
+ * @param   msg, message to write to
+ * @param   addr, address of buffer in the server to write from
+ * @param   buf_sz, size of buffer to write from
+ * @param   offset, offset within the message to write
+ * @return  number of bytes written on success, negative errno on error 
+ */
+static ssize_t do_writemsg(struct Process *current_proc, struct Msg *msg, void *addr,
+                           size_t buf_sz, off_t offset)
+{
+  ssize_t nbytes_written;       // nbytes_transferred
+  size_t nbytes_to_write;       // TODO: Rename chunk_size
+  size_t buf_remaining;         // TODO: Rename src_buf_remaining
+  size_t iov_remaining;         // TODO: Rename dst_iov_remaining
+  off_t iov_offset;             // TODO: Rename dst_iov_offset
+  int i;
+  int sc;
+  struct IPCopyFixed *fixed;
+
   if (msg->riov == NULL || msg->riov_cnt == 0 || msg->riov_cnt > IOV_MAX) {
     return -EINVAL;
   }
   
-  if (seekiov(msg->riov_cnt, msg->riov, offset, &i, &iov_remaining, &iov_offset) != 0) {
+  if (seekiov_cursor(msg->riov_cnt, msg->riov, &msg->riov_cursor, offset,
+                     &i, &iov_remaining, &iov_offset) != 0) {
     return -EINVAL;
   }
 
+  fixed = ipcopy_fixed_get(msg->port->fixed_bufs);
+  msg->ipcopy_cache.fixed = fixed;
+
   nbytes_written = 0;
   buf_remaining = buf_sz;
 
@@ -294,7 +647,7 @@ int sys_writemsg(int fd, msgid_t msgid, void *addr, size_t buf_sz, off_t offset)
       sc = ipcopy(msg->src_as, &current_proc->as,
                   msg->riov[i].addr + iov_offset,
                   addr + nbytes_written,
-                  nbytes_to_write);
+                  nbytes_to_write, &msg->ipcopy_cache);
     } else {      
       sc = copyin(msg->riov[i].addr + iov_offset,
                   addr + nbytes_written,
@@ -302,6 +655,8 @@ int sys_writemsg(int fd, msgid_t msgid, void *addr, size_t buf_sz, off_t offset)
     }
            
     if (sc != 0) {
+      ipcopy_fixed_put(fixed);
+      msg->ipcopy_cache.fixed = NULL;
       return -EFAULT;
     }
     
@@ -318,6 +673,11 @@ int sys_writemsg(int fd, msgid_t msgid, void *addr, size_t buf_sz, off_t offset)
     }
   }
 
+  msg->riov_cursor.i = i;
+  msg->riov_cursor.base = offset + nbytes_written - iov_offset;
+  ipcopy_fixed_put(fixed);
+  msg->ipcopy_cache.fixed = NULL;
+
   return nbytes_written;
 }
 
@@ -338,6 +698,7 @@ int sys_readmsgiov(int fd, msgid_t msgid, int iov_cnt, msgiov_t *_iov, off_t off
   struct Msg *msg;
   msgiov_t iov[IOV_MAX];
   int sc;
+  struct IPCopyFixed *fixed;
   ssize_t nbytes_read;
   size_t nbytes_to_read;
   int si;
@@ -372,10 +733,14 @@ int sys_readmsgiov(int fd, msgid_t msgid, int iov_cnt, msgiov_t *_iov, off_t off
     return -EINVAL;
   }
     
-  if (seekiov(msg->siov_cnt, msg->siov, offset, &si, &siov_remaining, &siov_offset) != 0) {
+  if (seekiov_cursor(msg->siov_cnt, msg->siov, &msg->siov_cursor, offset,
+                     &si, &siov_remaining, &siov_offset) != 0) {
     return -EINVAL;
   }
 
+  fixed = ipcopy_fixed_get(msg->port->fixed_bufs);
+  msg->ipcopy_cache.fixed = fixed;
+
   xi = 0;
   xiov_remaining = iov[0].size;
   xiov_offset = 0;
@@ -388,7 +753,7 @@ int sys_readmsgiov(int fd, msgid_t msgid, int iov_cnt, msgiov_t *_iov, off_t off
       sc = ipcopy(&current_proc->as, msg->src_as,
                   iov[xi].addr + xiov_offset,
                   msg->siov[si].addr + siov_offset,
-                  nbytes_to_read);
+                  nbytes_to_read, &msg->ipcopy_cache);
     } else {
       sc = copyout(iov[xi].addr + xiov_offset,
                    msg->siov[si].addr + siov_offset,
@@ -418,7 +783,12 @@ int sys_readmsgiov(int fd, msgid_t msgid, int iov_cnt, msgiov_t *_iov, off_t off
       siov_offset = 0;
     }
   }
-    
+
+  msg->siov_cursor.i = si;
+  msg->siov_cursor.base = offset + nbytes_read - siov_offset;
+  ipcopy_fixed_put(fixed);
+  msg->ipcopy_cache.fixed = NULL;
+
   return nbytes_read;
 }
 
@@ -439,6 +809,7 @@ int sys_writemsgiov(int fd, msgid_t msgid, int iov_cnt, msgiov_t *_iov, off_t of
   struct Msg *msg;
   msgiov_t iov[IOV_MAX];
   int sc;
+  struct IPCopyFixed *fixed;
   ssize_t nbytes_written;
   size_t nbytes_to_write;
   int ri;
@@ -473,10 +844,14 @@ int sys_writemsgiov(int fd, msgid_t msgid, int iov_cnt, msgiov_t *_iov, off_t of
     return 0;
   }
   
-  if (seekiov(msg->riov_cnt, msg->riov, offset, &ri, &riov_remaining, &riov_offset) != 0) {
+  if (seekiov_cursor(msg->riov_cnt, msg->riov, &msg->riov_cursor, offset,
+                     &ri, &riov_remaining, &riov_offset) != 0) {
     return -EINVAL;
   }
 
+  fixed = ipcopy_fixed_get(msg->port->fixed_bufs);
+  msg->ipcopy_cache.fixed = fixed;
+
   xi = 0;
   xiov_remaining = iov[0].size;
   xiov_offset = 0;
@@ -489,7 +864,7 @@ int sys_writemsgiov(int fd, msgid_t msgid, int iov_cnt, msgiov_t *_iov, off_t of
       sc = ipcopy(msg->src_as, &current_proc->as,
                   msg->riov[ri].addr + riov_offset,
                   iov[xi].addr + xiov_offset,
-                  nbytes_to_write);
+                  nbytes_to_write, &msg->ipcopy_cache);
     } else {      
       sc = copyin(msg->riov[ri].addr + riov_offset,
                   iov[xi].addr + xiov_offset,
@@ -520,6 +895,11 @@ int sys_writemsgiov(int fd, msgid_t msgid, int iov_cnt, msgiov_t *_iov, off_t of
     }
   }
 
+  msg->riov_cursor.i = ri;
+  msg->riov_cursor.base = offset + nbytes_written - riov_offset;
+  ipcopy_fixed_put(fixed);
+  msg->ipcopy_cache.fixed = NULL;
+
   return nbytes_written;
 }
 
@@ -620,6 +1000,7 @@ int ksendmsg(struct MsgPort *msgport, int ipc, iorequest_t *req, ioreply_t *repl
 {
   struct Process *current_proc;
   struct Thread *current_thread;
+  struct Thread *server_thread;
   struct Msg msg;
 	int sc;
 	
@@ -642,6 +1023,16 @@ int ksendmsg(struct MsgPort *msgport, int ipc, iorequest_t *req, ioreply_t *repl
   msg.src_as = (ipc == IPCOPY) ? &current_proc->as : NULL;
   msg.req = req;
   msg.reply = reply;
+  msg.priority = -1;
+  msg.lent_tid = INVALID_PID;
+  init_msg_cursors(&msg);
+  
+  // The server thread that kputmsg() will wake, if it is waiting for a message
+  server_thread = DLIST_HEAD(&msgport->rendez.blocked_list);
+  
+  if (server_thread == NULL) {
+    server_thread = get_thread(msgport->target_tid);
+  }
   
   klog_info("calling kputmsg()");
     
@@ -654,7 +1045,8 @@ int ksendmsg(struct MsgPort *msgport, int ipc, iorequest_t *req, ioreply_t *repl
   
   klog_info("calling kwaitport() on replyport");
   
-  while ((kwaitport(&current_thread->reply_port, NULL)) != 0) {   
+  while ((kwaitport_handoff(&current_thread->reply_port, NULL, server_thread)) != 0) {   
+    server_thread = NULL;
     sc = kabortmsg(msgport, &msg);
     
     klog_info("kabortmsg returned :%d", sc);
@@ -699,6 +1091,7 @@ int kabortmsg(struct MsgPort *msgport, struct Msg *msg)
     if (req->cmd == CMD_ABORT) {
       // An abort is already in progress, invalidate the message so that the server
       // cannot perform any readmsg,writemsg or replymsg on this message.
+      msgport_return_priority(msgport, msg);
       msg->port = NULL;
       msg->msgid = INVALID_PID;
       msg->reply_status = -EINTR;
@@ -707,17 +1100,13 @@ int kabortmsg(struct MsgPort *msgport, struct Msg *msg)
     }
     
     req->cmd = CMD_ABORT;
-        
-    DLIST_ADD_TAIL(&msgport->pending_msg_list, msg, link);
-    
-    // FIXME: notification ?  Error checking of target tid/pid
-    do_thread_event_signal(msgport->target_tid, msgport->target_event);
-    
+    kresendmsg(msgport, msg);
     return 0;
     
   } else if (msg->port == msgport) {
     // message has not been received, but is still on message list of server, remove it 
     kremovemsg(msgport, msg);
+    msgport_return_priority(msgport, msg);
 
     msg->port = NULL;
     msg->msgid = INVALID_PID;
@@ -736,27 +1125,96 @@ int kabortmsg(struct MsgPort *msgport, struct Msg *msg)
  *
  * The calling function must already allocate and set the msgid of the message
  * msg already has the msg.msgid set.
+ *
+ * Pending messages are served in order of a virtual finish tag rather than in
+ * order of arrival. Each message of a sender is tagged a step after the
+ * sender's previous pending message, or after the port's current virtual time
+ * if it has none, with the step set by the sender's I/O priority class. A
+ * process that floods a port therefore only delays its own later messages and
+ * senders in the same class are served round-robin.
+ *
+ * Only the first of each sender's messages is on the pending list, the rest
+ * wait in order of arrival behind it.  The pending list is therefore as long
+ * as the number of senders rather than the number of messages.
  */
 int kputmsg(struct MsgPort *msgport, struct Msg *msg)
 {
+  struct Msg *head;
+  struct Msg *last;
+  
+  msg->qstate = MSG_QSTATE_NONE;
+  msg->sender_next = msg;
+  msg->sender_prev = msg;
+
   if (msgport->flags & MPF_SHUTDOWN) {
     return -ECONNABORTED;
   }
 
   msg->port = msgport;
-  DLIST_ADD_TAIL(&msgport->pending_msg_list, msg, link);
+  msg->sender = get_current_process();
+  msg->vtag = msgport->vtime;
+
+  // Follow on from the sender's last message that is still pending
+  if ((head = find_sender_head(msgport, msg->sender)) != NULL) {
+    last = head->sender_prev;
 
-  // FIXME: notification required.  Error checking, thread belonging to msgport owner process
-  do_thread_event_signal(msgport->target_tid, msgport->target_event);
+    if (VTAG_BEFORE(msg->vtag, last->vtag)) {
+      msg->vtag = last->vtag;
+    }
+  }
   
-  // tid_t 
+  msg->vtag += ioprio_vtime_step(msg->sender);
+  
+  if (head != NULL) {
+    msg->sender_next = head;
+    msg->sender_prev = last;
+    last->sender_next = msg;
+    head->sender_prev = msg;
+    msg->qstate = MSG_QSTATE_QUEUED;
+  } else {
+    msg->qstate = MSG_QSTATE_PENDING;
+    enqueue_pending_msg(msgport, msg);
+  }
+
+  msgport_lend_priority(msgport, msg, get_current_thread()->priority);
 
+  if (msgport->sq != NULL) {
+    msgring_reap(msgport);
+    msgring_submit(msgport);
+  }
+
+  notify_receiver(msgport);
+  return 0;
+}
+
+
+/* @brief   Send a message that the server has already received again
+ *
+ * @param   msgport, message port the message was received on
+ * @param   msg, received message, such as one changed to a CMD_ABORT
+ * @return  0 on success, negative errno on failure
+ *
+ * The message keeps its original tag and is queued ahead of its sender's
+ * other pending messages, so the server sees it promptly.
+ */
+int kresendmsg(struct MsgPort *msgport, struct Msg *msg)
+{
+  if (msgport->flags & MPF_SHUTDOWN) {
+    return -ECONNABORTED;
+  }
+
+  requeue_pending_msg(msgport, msg);
+  msgring_submit(msgport);
+  notify_receiver(msgport);
   return 0;
 }
 
 
 /* @brief   Reply to a kernel message
  *
+ * A thread's own reply port only ever has one waiter, but the reply port
+ * of asynchronous I/O can have several threads of a process waiting on
+ * different ioids, so all are woken to check for their own completion.
  */
 int kreplymsg(struct Msg *msg)
 {
@@ -765,10 +1223,12 @@ int kreplymsg(struct Msg *msg)
   kassert (msg != NULL);  
   kassert (msg->reply_port != NULL);
   
+  msgport_return_priority(msg->port, msg);
+
   msg->port = msg->reply_port;
   reply_port = msg->reply_port;
   DLIST_ADD_TAIL(&reply_port->pending_msg_list, msg, link);
-  TaskWakeup(&reply_port->rendez);
+  TaskWakeupAll(&reply_port->rendez);
  
   return 0;  
 }
@@ -787,7 +1247,11 @@ struct Msg *kgetmsg(struct MsgPort *msgport)
   msg = DLIST_HEAD(&msgport->pending_msg_list);
   
   if (msg) {
-    DLIST_REM_HEAD(&msgport->pending_msg_list, link);
+    dequeue_pending_msg(msgport, msg);
+    
+    if (VTAG_BEFORE(msgport->vtime, msg->vtag)) {
+      msgport->vtime = msg->vtag;
+    }
   
   // TODO: Add to a received_msg_list, so they can be cancelled.
   
@@ -797,6 +1261,74 @@ struct Msg *kgetmsg(struct MsgPort *msgport)
 }
 
 
+/* @brief   Notify one server thread that a message has arrived
+ *
+ * @param   msgport, message port the message was added to
+ *
+ * A server may have several receiver threads blocked in kwaitport(), for
+ * example in sys_replywaitmsg(). Only the thread at the head of the rendez is
+ * woken so that each message wakes a single idle receiver.  The receivers
+ * loop back to sleep if another thread takes the message first. The port's
+ * target thread event is only raised when no receiver is waiting in the
+ * kernel, as a busy receiver will find the message when it next checks.
+ *
+ * FIXME: Error checking, target thread belonging to msgport owner process
+ */
+static void notify_receiver(struct MsgPort *msgport)
+{
+  if (DLIST_HEAD(&msgport->rendez.blocked_list) != NULL) {
+    TaskWakeup(&msgport->rendez);
+  } else {
+    do_thread_event_signal(msgport->target_tid, msgport->target_event);
+  }
+}
+
+
+/* @brief   Find the first pending message of a sender
+ *
+ * @param   msgport, message port to search
+ * @param   sender, process that sent the message
+ * @return  the sender's message on the pending list, or NULL if it has none
+ */
+static struct Msg *find_sender_head(struct MsgPort *msgport, struct Process *sender)
+{
+  struct Msg *head;
+  
+  head = DLIST_HEAD(&msgport->pending_msg_list);
+  
+  while (head != NULL && head->sender != sender) {
+    head = DLIST_NEXT(head, link);
+  }
+  
+  return head;
+}
+
+
+/* @brief   Insert a message into a port's pending list in order of virtual tag
+ *
+ * @param   msgport, message port to add the message to
+ * @param   msg, first pending message of its sender, with vtag set
+ *
+ * Messages with equal tags keep their order of arrival.
+ */
+static void enqueue_pending_msg(struct MsgPort *msgport, struct Msg *msg)
+{
+  struct Msg *prev;
+  
+  prev = DLIST_TAIL(&msgport->pending_msg_list);
+  
+  while (prev != NULL && VTAG_BEFORE(msg->vtag, prev->vtag)) {
+    prev = DLIST_PREV(prev, link);
+  }
+  
+  if (prev == NULL) {
+    DLIST_ADD_HEAD(&msgport->pending_msg_list, msg, link);
+  } else {
+    DLIST_INSERT_AFTER(&msgport->pending_msg_list, prev, msg, link);
+  }
+}
+
+
 /*
  *
  */
@@ -806,12 +1338,83 @@ struct Msg *kpeekmsg(struct MsgPort *msgport)
 }
 
 
-/*
+/* @brief   Remove a message from a port's pending list or its sender's queue
  *
+ * @param   msgport, message port the message is queued on
+ * @param   msg, message to remove
+ *
+ * If the message was first of its sender's messages the next one, if any,
+ * takes its place on the pending list.  Messages on a reply port are never
+ * behind another message and are only removed from the pending list.
+ */
+static void dequeue_pending_msg(struct MsgPort *msgport, struct Msg *msg)
+{
+  struct Msg *next;
+  
+  next = msg->sender_next;
+  
+  if (msg->qstate != MSG_QSTATE_QUEUED) {
+    DLIST_REM_ENTRY(&msgport->pending_msg_list, msg, link);
+  }
+  
+  msg->sender_prev->sender_next = msg->sender_next;
+  msg->sender_next->sender_prev = msg->sender_prev;
+  msg->sender_next = msg;
+  msg->sender_prev = msg;
+
+  if (msg->qstate == MSG_QSTATE_PENDING && next != msg) {
+    next->qstate = MSG_QSTATE_PENDING;
+    enqueue_pending_msg(msgport, next);
+  }
+
+  msg->qstate = MSG_QSTATE_NONE;
+}
+
+
+/* @brief   Put a received message back in front of its sender's messages
+ *
+ * @param   msgport, message port the message was received on
+ * @param   msg, message that is no longer queued, keeping its vtag
+ */
+static void requeue_pending_msg(struct MsgPort *msgport, struct Msg *msg)
+{
+  struct Msg *head;
+  
+  if ((head = find_sender_head(msgport, msg->sender)) != NULL) {
+    DLIST_REM_ENTRY(&msgport->pending_msg_list, head, link);
+    head->qstate = MSG_QSTATE_QUEUED;
+
+    msg->sender_next = head;
+    msg->sender_prev = head->sender_prev;
+    head->sender_prev->sender_next = msg;
+    head->sender_prev = msg;
+  }
+  
+  msg->qstate = MSG_QSTATE_PENDING;
+  enqueue_pending_msg(msgport, msg);
+}
+
+
+/* @brief   Remove a message from a message port before it is received
+ *
+ * @param   msgport, message port the message is queued on
+ * @param   msg, message to remove
  */
 void kremovemsg(struct MsgPort *msgport, struct Msg *msg)
 {   
-  DLIST_REM_ENTRY(&msgport->pending_msg_list, msg, link);
+  dequeue_pending_msg(msgport, msg);
+}
+
+
+/* @brief   Check if a message is still queued on a message port
+ *
+ * @param   msgport, message port the message was sent to
+ * @param   msg, message to look for
+ * @return  true if the message has not yet been received by the server
+ */
+bool kmsgpending(struct MsgPort *msgport, struct Msg *msg)
+{
+  return (msg->port == msgport && msg->qstate != MSG_QSTATE_NONE) ? true : false;
 }
 
 
@@ -826,13 +1429,30 @@ void kremovemsg(struct MsgPort *msgport, struct Msg *msg)
  * TODO: Allow kwaitport to be interrupted by signals.
  */
 int kwaitport(struct MsgPort *msgport, struct timespec *timeout)
+{
+  return kwaitport_handoff(msgport, timeout, NULL);
+}
+
+
+/* @brief   Wait for a message port to receive a message, handing off to another thread
+ *
+ * @param   msgport, message port to wait on
+ * @param   timeout, duration to wait for a message
+ * @param   handoff, thread to switch to directly if it is runnable, or NULL
+ * @return  0 on success,
+ *          -ETIMEDOUT on timeout
+ *          negative errno on other failure
+ *
+ * See TaskSleepHandoff()
+ */
+int kwaitport_handoff(struct MsgPort *msgport, struct timespec *timeout, struct Thread *handoff)
 {
   int sc;
 
   klog_info("kwaitport()");
   
   if (DLIST_HEAD(&msgport->pending_msg_list) == NULL) {
-    if ((sc = TaskSleepInterruptible(&msgport->rendez, timeout, INTRF_NONE)) != 0) {
+    if ((sc = TaskSleepHandoff(&msgport->rendez, handoff, timeout, INTRF_NONE)) != 0) {
       if (DLIST_HEAD(&msgport->pending_msg_list) == NULL) {
         klog_info("kwaitport() - pending list is empty");
 
@@ -853,6 +1473,8 @@ int kwaitport(struct MsgPort *msgport, struct timespec *timeout)
  * @param   msgid, message ID of the message to lookup.
  * @return  Pointer to message structure, or NULL on failure
  *
+ * Synchronous messages use the sending thread's ID as the msgid. Messages
+ * of asynchronous I/O requests use msgids at max_pid and above.
  */
 struct Msg *msgid_to_msg(struct MsgPort *msgport, msgid_t msgid)
 {
@@ -861,13 +1483,16 @@ struct Msg *msgid_to_msg(struct MsgPort *msgport, msgid_t msgid)
   
   kassert(msgport != NULL);
   
-  thread = get_thread(msgid);
+  if (msgid >= max_pid) {
+    msg = asyncio_msgid_to_msg(msgid);
+  } else {
+    thread = get_thread(msgid);
+    msg = (thread != NULL) ? thread->msg : NULL;
+  }
   
-  if (thread == NULL || thread->msg == NULL) {
+  if (msg == NULL) {
     return NULL;
   }  
-
-  msg = thread->msg;
   
   if (msg->port != msgport) {
     return NULL;
@@ -914,3 +1539,74 @@ int seekiov(int iov_cnt, msgiov_t *iov, off_t offset, int *ret_i, size_t *ret_re
   return 0;
 }
 
+
+/* @brief   Seek to a position within a multi-part message, starting from a cursor
+ *
+ * @param   iov_cnt, number of iovs
+ * @param   iov, array of iovs of the message
+ * @param   cursor, position where the last transfer of these iovs finished
+ * @param   offset, offset within the message to seek to
+ * @param   ret_i, location to store the index of the iov containing offset
+ * @param   ret_remaining, location to store the bytes remaining in that iov
+ * @param   ret_offset, location to store the offset within that iov
+ * @return  0 on success, -EINVAL if offset is beyond the end of the message
+ *
+ * Servers usually transfer a large message in several calls at increasing
+ * offsets. Searching from the cursor rather than from the first iov makes
+ * each such call independent of the number of iovs already transferred.
+ */
+int seekiov_cursor(int iov_cnt, msgiov_t *iov, struct MsgIovCursor *cursor, off_t offset,
+                   int *ret_i, size_t *ret_remaining, off_t *ret_offset)
+{
+  off_t base_offset;
+  int i;
+  
+  if (offset < 0) {
+    return -EINVAL;
+  }
+  
+  kassert(iov_cnt > 0);
+
+  if (cursor->i < iov_cnt && offset >= cursor->base) {
+    i = cursor->i;
+    base_offset = cursor->base;
+  } else {
+    i = 0;
+    base_offset = 0;
+  }
+  
+  for (; i < iov_cnt; i++) {
+    if (offset < base_offset + iov[i].size) {
+      break;
+    }
+
+    base_offset += iov[i].size;
+  }
+
+  if (i >= iov_cnt) {
+    return -EINVAL;
+  }
+
+  cursor->i = i;
+  cursor->base = base_offset;
+
+  *ret_i = i;
+  *ret_remaining = base_offset + iov[i].size - offset;
+  *ret_offset = offset - base_offset;
+  return 0;
+}
+
+
+/* @brief   Reset a message's iov cursors and translation cache
+ *
+ * @param   msg, message about to be sent
+ */
+void init_msg_cursors(struct Msg *msg)
+{
+  msg->siov_cursor.i = 0;
+  msg->siov_cursor.base = 0;
+  msg->riov_cursor.i = 0;
+  msg->riov_cursor.base = 0;
+  init_ipcopy_cache(&msg->ipcopy_cache);
+}
+
@@ -27,6 +27,12 @@
 KLOG_REGISTER(LOG_FS_MSGPORT)
 
 
+// Static prototypes
+static void lend_priority_to_thread(struct Msg *msg, struct Thread *thread);
+static void withdraw_priority(struct Msg *msg);
+static void update_inherited_priority(struct Thread *thread);
+
+
 /* @brief   Create a named msgport (mount point) in the file system namespace
  *
  * @param   _path, path to mount root of new filesystem at
@@ -166,8 +172,32 @@ int sys_createmsgport(char *_path, uint32_t flags, struct stat *_stat, pid_t tid
   
   sb->msgport.context = sb;
 
+  if (flags & SBF_MSGRING) {
+    if ((sc = init_msgring(&sb->msgport, current)) != 0) {
+      klog_error("createmsgport failed to create msgring, sc:%d", sc);
+
+      if (do_lookup_cleanup) {
+        lookup_cleanup(&ld);
+      }
+      
+      return sc;
+    }
+  }
+
   sb->root = mount_root_vnode;
   sb->flags = flags;
+
+  if (S_ISDIR(stat.st_mode) && (flags & SBF_READONLY) == 0) {
+    if ((sc = init_superblock_bdflush(sb)) != 0) {
+      klog_error("createmsgport failed to create bdflush task, sc:%d", sc);
+
+      if (do_lookup_cleanup) {
+        lookup_cleanup(&ld);
+      }
+      
+      return sc;
+    }
+  }
   sb->reference_cnt = 1;          // 1 reference count of the root vnode (maybe also handle?)
   
   sb->dev = stat.st_dev;
@@ -251,6 +281,72 @@ int sys_unmount(char *_path, uint32_t flags)
 }
 
 
+/* @brief   Register a server's fixed buffers for message transfers
+ *
+ * @param   fd, file descriptor of mount created by sys_createmsgport()
+ * @param   iov_cnt, number of buffers, or 0 to unregister all buffers
+ * @param   _iov, array of buffers to register
+ * @return  0 on success, negative errno on failure
+ *
+ * Replaces any buffers registered previously.  The pages of the buffers are
+ * resolved now, so that sys_readmsg(), sys_writemsg(), sys_readmsgiov() and
+ * sys_writemsgiov() of user-to-user messages that copy to or from these
+ * buffers do not need to walk the server's page tables on every call.
+ * This suits drivers that reuse the same DMA buffers for every request.
+ */
+int sys_registermsgbufs(int fd, int iov_cnt, msgiov_t *_iov)
+{
+  struct Process *current;
+  struct SuperBlock *sb;
+  struct IPCopyFixed *fixed;
+  msgiov_t iov[IPCOPY_FIXED_BUFS];
+  int sc;
+  
+  klog_info("sys_registermsgbufs(fd:%d, iov_cnt:%d)", fd, iov_cnt);
+
+  if (iov_cnt < 0 || iov_cnt > IPCOPY_FIXED_BUFS) {
+    return -EINVAL;
+  }
+  
+  if (iov_cnt > 0) {
+    if (copyin(iov, _iov, sizeof(msgiov_t) * iov_cnt) != 0) {
+      return -EFAULT;
+    }
+  }
+  
+  current = get_current_process();
+  sb = get_superblock(current, fd);
+
+  if (sb == NULL) {
+    return -EINVAL;
+  }
+
+  // Copies in progress keep their own reference to the old buffers
+  ipcopy_fixed_put(sb->msgport.fixed_bufs);
+  sb->msgport.fixed_bufs = NULL;
+  
+  if (iov_cnt == 0) {
+    return 0;
+  }
+  
+  if ((fixed = kmalloc_page()) == NULL) {
+    return -ENOMEM;
+  }
+  
+  init_ipcopy_fixed(fixed, &current->as);
+  
+  for (int t = 0; t < iov_cnt; t++) {
+    if ((sc = ipcopy_add_fixed(fixed, iov[t].addr, iov[t].size)) < 0) {
+      ipcopy_fixed_put(fixed);
+      return sc;
+    }
+  }
+  
+  sb->msgport.fixed_bufs = fixed;
+  return 0;
+}
+
+
 /* @brief   Initialize a message port
  *
  * @param   msgport, message port to initialize
@@ -267,6 +363,11 @@ int init_msgport(struct MsgPort *msgport, pid_t tid, int event)
   msgport->flags = 0;
   msgport->target_tid = tid;
   msgport->target_event = event;
+  msgport->sq = NULL;
+  msgport->cq = NULL;
+  msgport->ring_uaddr = NULL;
+  msgport->vtime = 0;
+  msgport->fixed_bufs = NULL;
   
   return 0;
 }
@@ -288,30 +389,165 @@ int fini_msgport(struct MsgPort *port)
   struct Msg *msg;
   
   port->flags |= MPF_SHUTDOWN;
+  fini_msgring(port);
     
   while ((msg = DLIST_HEAD(&port->received_msg_list)) != NULL) {
     DLIST_REM_HEAD(&port->received_msg_list, link);
 
+    msgport_return_priority(port, msg);
     msg->msgid = INVALID_PID;
     msg->reply_status = -ECONNABORTED;      
     msg->port = msg->reply_port;
     
     DLIST_ADD_TAIL(&msg->reply_port->pending_msg_list, msg, link);
-    TaskWakeup(&msg->reply_port->rendez);   // FIXME: Is this used?  
+    TaskWakeupAll(&msg->reply_port->rendez);   // FIXME: Is this used?  
   }
   
   while ((msg = DLIST_HEAD(&port->pending_msg_list)) != NULL) {
-    DLIST_REM_HEAD(&port->pending_msg_list, link);
+    kremovemsg(port, msg);
 
+    msgport_return_priority(port, msg);
     msg->msgid = INVALID_PID;
     msg->reply_status = -ECONNABORTED;      
     msg->port = msg->reply_port;
     
     DLIST_ADD_TAIL(&msg->reply_port->pending_msg_list, msg, link);
-    TaskWakeup(&msg->reply_port->rendez);   // FIXME: Is this used?
+    TaskWakeupAll(&msg->reply_port->rendez);   // FIXME: Is this used?
   }
+
+  // Wake any server threads blocked in sys_replywaitmsg()
+  TaskWakeupAll(&port->rendez);
+  
+  ipcopy_fixed_put(port->fixed_bufs);
+  port->fixed_bufs = NULL;
   
   return 0;
 }
 
 
+/* @brief   Lend a sender's priority to the thread serving a message port
+ *
+ * @param   msgport, message port the message is sent to
+ * @param   msg, message being sent
+ * @param   priority, effective priority of the sending thread
+ *
+ * Until the message is received its priority is lent to the target thread of
+ * the message port, then to the thread that received it, see
+ * msgport_receive_priority().  A server thread inherits the highest priority
+ * of the messages lent to it and not yet replied to, from any port.  This
+ * prevents a high priority client waiting behind other runnable threads while
+ * a low priority server handles its request.  As the sender's effective
+ * priority is used, priority is passed on along a chain of servers.
+ *
+ * A message lends its priority only once, a CMD_ABORT resend keeps the
+ * priority lent by the original send.
+ */
+void msgport_lend_priority(struct MsgPort *msgport, struct Msg *msg, int priority)
+{
+  if (msg->priority != -1 || priority < 0 || priority > 31) {
+    return;
+  }
+  
+  msg->priority = priority;
+  msg->lent_tid = INVALID_PID;
+  lend_priority_to_thread(msg, get_thread(msgport->target_tid));
+}
+
+
+/* @brief   Move the priority lent by a message to the thread that received it
+ *
+ * @param   msg, message that has been received
+ * @param   thread, server thread that received the message
+ */
+void msgport_receive_priority(struct Msg *msg, struct Thread *thread)
+{
+  if (msg->priority == -1 || msg->lent_tid == thread->tid) {
+    return;
+  }
+  
+  withdraw_priority(msg);
+  lend_priority_to_thread(msg, thread);
+}
+
+
+/* @brief   Return the priority lent by a message that is replied to or aborted
+ *
+ * @param   msgport, message port the message was sent to
+ * @param   msg, message that is no longer outstanding
+ */
+void msgport_return_priority(struct MsgPort *msgport, struct Msg *msg)
+{
+  if (msgport == NULL || msg->priority == -1) {
+    return;
+  }
+  
+  withdraw_priority(msg);
+  msg->priority = -1;
+}
+
+
+/* @brief   Add a message's priority to those lent to a thread
+ *
+ * @param   msg, message with priority set
+ * @param   thread, thread to lend the priority to, or NULL
+ */
+static void lend_priority_to_thread(struct Msg *msg, struct Thread *thread)
+{
+  if (thread == NULL) {
+    return;
+  }
+  
+  thread->lent_priority_cnt[msg->priority]++;
+  thread->lent_priority_bitmap |= (1 << msg->priority);
+  msg->lent_tid = thread->tid;
+
+  update_inherited_priority(thread);
+}
+
+
+/* @brief   Remove a message's priority from those lent to a thread
+ *
+ * @param   msg, message with priority set
+ *
+ * Nothing is withdrawn if the thread has since exited.
+ */
+static void withdraw_priority(struct Msg *msg)
+{
+  struct Thread *thread;
+  
+  thread = get_thread(msg->lent_tid);
+  msg->lent_tid = INVALID_PID;
+  
+  if (thread == NULL || thread->lent_priority_cnt[msg->priority] == 0) {
+    return;
+  }
+  
+  thread->lent_priority_cnt[msg->priority]--;
+  
+  if (thread->lent_priority_cnt[msg->priority] == 0) {
+    thread->lent_priority_bitmap &= ~(1 << msg->priority);
+  }
+
+  update_inherited_priority(thread);
+}
+
+
+/* @brief   Set a thread's inherited priority to the highest lent priority
+ */
+static void update_inherited_priority(struct Thread *thread)
+{
+  int priority;
+  
+  priority = -1;
+  
+  if (thread->lent_priority_bitmap != 0) {
+    for (priority = 31; priority >= 0; priority--) {
+      if ((thread->lent_priority_bitmap & (1 << priority)) != 0) {
+        break;
+      }
+    }
+  }
+  
+  SchedInheritPriority(thread, priority);
+}
+
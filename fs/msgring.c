@@ -0,0 +1,346 @@
+/*
+ * Copyright 2014  Marven Gilhespie
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * --
+ * Shared memory submission and completion rings for message ports.
+ *
+ * A server that creates its message port with the SBF_MSGRING flag has a
+ * pair of rings mapped into its address space.  Messages sent to the port are
+ * moved from the pending list into the submission ring as they arrive and the
+ * server posts replies into the completion ring.  The server only needs to
+ * call sys_waitmsgring() when it has run out of work, so a busy server can
+ * receive and reply to many messages per system call.  Message bodies are
+ * still transferred with sys_readmsg() and sys_writemsg().
+ */
+
+#include <kernel/dbg.h>
+#include <kernel/filesystem.h>
+#include <kernel/globals.h>
+#include <kernel/msg.h>
+#include <kernel/proc.h>
+#include <kernel/types.h>
+#include <kernel/vm.h>
+#include <string.h>
+#include <sys/iorequest.h>
+#include <sys/mman.h>
+
+KLOG_REGISTER(LOG_FS_MSG)
+
+
+/* @brief   Get the address the rings of a message port are mapped at
+ *
+ * @param   fd, file descriptor of mount created by sys_createmsgport()
+ * @param   _ring, user address to store the address of the submission ring.
+ *                 The completion ring follows it at the next page.
+ * @return  0 on success, negative errno on failure
+ */
+int sys_getmsgring(int fd, void **_ring)
+{
+  struct Process *current;
+  struct SuperBlock *sb;
+
+  current = get_current_process();
+  sb = get_superblock(current, fd);
+
+  if (sb == NULL) {
+    return -EINVAL;
+  }
+
+  if (sb->msgport.sq == NULL) {
+    return -ENXIO;
+  }
+
+  if (copyout(_ring, &sb->msgport.ring_uaddr, sizeof (void *)) != 0) {
+    return -EFAULT;
+  }
+
+  return 0;
+}
+
+
+/* @brief   Reap completions and wait for messages on a ring message port
+ *
+ * @param   fd, file descriptor of mount created by sys_createmsgport()
+ * @param   _timeout, optional maximum duration to wait for a message, or NULL
+ * @return  number of entries in the submission ring, -ETIMEDOUT if the timeout
+ *          expired, or other negative errno on error
+ *
+ * Replies that the server has posted to the completion ring are returned to
+ * their senders and any messages waiting for space are moved into the
+ * submission ring.  Blocks only if the submission ring is then empty.
+ */
+int sys_waitmsgring(int fd, struct timespec *_timeout)
+{
+  struct Process *current;
+  struct SuperBlock *sb;
+  struct MsgPort *msgport;
+  struct timespec timeout;
+  uint32_t cnt;
+  int sc;
+
+  klog_info("sys_waitmsgring(fd:%d)", fd);
+
+  if (_timeout != NULL) {
+    if (copyin(&timeout, _timeout, sizeof timeout) != 0) {
+      return -EFAULT;
+    }
+  }
+
+  current = get_current_process();
+  sb = get_superblock(current, fd);
+
+  if (sb == NULL) {
+    return -EINVAL;
+  }
+
+  msgport = &sb->msgport;
+
+  if (msgport->sq == NULL) {
+    return -ENXIO;
+  }
+
+  while (1) {
+    // The rings are released when the port is shut down
+    if (msgport->flags & MPF_SHUTDOWN) {
+      return -ECONNABORTED;
+    }
+
+    if ((sc = msgring_reap(msgport)) != 0) {
+      return sc;
+    }
+
+    msgring_submit(msgport);
+
+    cnt = msgport->sq->tail - msgport->sq->head;
+
+    if (cnt != 0) {
+      return (cnt <= MSGRING_ENTRIES) ? cnt : -EIO;
+    }
+
+    if ((sc = kwaitport(msgport, (_timeout != NULL) ? &timeout : NULL)) != 0) {
+      return sc;
+    }
+  }
+}
+
+
+/* @brief   Allocate the rings of a message port and map them into a server
+ *
+ * @param   msgport, message port to switch to ring mode
+ * @param   proc, server process to map the rings into
+ * @return  0 on success, negative errno on failure
+ *
+ * The message port and each mapping of the rings hold a reference to the
+ * ring pages.  The pages are marked PGF_SHARED so that they remain shared,
+ * rather than copy-on-write, if the server forks.
+ */
+int init_msgring(struct MsgPort *msgport, struct Process *proc)
+{
+  struct AddressSpace *as;
+  struct MemRegion *mr;
+  struct Page *sq_page;
+  struct Page *cq_page;
+  vm_addr uaddr;
+  uint32_t flags;
+
+  kassert(sizeof (struct MsgRingSQ) + MSGRING_ENTRIES * sizeof (struct MsgRingSQE) <= PAGE_SIZE);
+  kassert(sizeof (struct MsgRingCQ) + MSGRING_ENTRIES * sizeof (struct MsgRingCQE) <= PAGE_SIZE);
+
+  as = &proc->as;
+  flags = PROT_READ | PROT_WRITE | MAP_USER | CACHE_WRITEBACK;
+
+  if ((sq_page = alloc_page()) == NULL) {
+    return -ENOMEM;
+  }
+
+  sq_page->mflags |= PGF_SHARED;
+  sq_page->reference_cnt = 1;
+
+  if ((cq_page = alloc_page()) == NULL) {
+    free_page(sq_page);
+    return -ENOMEM;
+  }
+
+  cq_page->mflags |= PGF_SHARED;
+  cq_page->reference_cnt = 1;
+
+  mr = memregion_create(as, 0, 2 * PAGE_SIZE, flags, MR_TYPE_ALLOC);
+
+  if (mr == NULL) {
+    free_page(cq_page);
+    free_page(sq_page);
+    return -ENOMEM;
+  }
+
+  uaddr = mr->base_addr;
+
+  if (pmap_enter(as, uaddr, sq_page->physical_addr, flags) != 0) {
+    memregion_free(as, uaddr, 2 * PAGE_SIZE);
+    free_page(cq_page);
+    free_page(sq_page);
+    return -ENOMEM;
+  }
+
+  if (pmap_enter(as, uaddr + PAGE_SIZE, cq_page->physical_addr, flags) != 0) {
+    pmap_remove(as, uaddr);
+    memregion_free(as, uaddr, 2 * PAGE_SIZE);
+    free_page(cq_page);
+    free_page(sq_page);
+    return -ENOMEM;
+  }
+
+  pmap_flush_tlbs();
+
+  // References held by the server's mapping
+  sq_page->reference_cnt++;
+  cq_page->reference_cnt++;
+
+  msgport->sq = sq_page->vaddr;
+  msgport->cq = cq_page->vaddr;
+  msgport->ring_uaddr = (void *)uaddr;
+
+  memset(msgport->sq, 0, PAGE_SIZE);
+  memset(msgport->cq, 0, PAGE_SIZE);
+  return 0;
+}
+
+
+/* @brief   Shut down the rings of a message port and release its ring pages
+ *
+ * @param   msgport, message port being shut down
+ *
+ * Messages already placed in the submission ring are treated the same as
+ * messages received with sys_getmsg().  The pages are freed once the server
+ * unmaps the rings or exits and its mapping releases the last reference.
+ */
+void fini_msgring(struct MsgPort *msgport)
+{
+  if (msgport->sq == NULL) {
+    return;
+  }
+
+  msgport->sq->flags |= MSGRING_SHUTDOWN;
+
+  free_page(pmap_va_to_page((vm_addr)msgport->sq));
+  free_page(pmap_va_to_page((vm_addr)msgport->cq));
+
+  msgport->sq = NULL;
+  msgport->cq = NULL;
+  msgport->ring_uaddr = NULL;
+}
+
+
+/* @brief   Move pending messages into the submission ring
+ *
+ * @param   msgport, message port to fill the submission ring of
+ *
+ * Each message is received as though by sys_getmsg() and its header is
+ * copied into the next free entry.  Messages that do not fit remain on the
+ * pending list until the server makes room.
+ */
+void msgring_submit(struct MsgPort *msgport)
+{
+  struct MsgRingSQ *sq;
+  struct MsgRingSQE *sqe;
+  struct Msg *msg;
+  uint32_t tail;
+
+  sq = msgport->sq;
+
+  if (sq == NULL || (msgport->flags & MPF_SHUTDOWN)) {
+    return;
+  }
+
+  tail = sq->tail;
+
+  while ((tail - sq->head) < MSGRING_ENTRIES) {
+    if ((msg = kpeekmsg(msgport)) == NULL) {
+      break;
+    }
+
+    if (msg->req->cmd != CMD_ABORT) {
+      if ((msg = kgetmsg(msgport)) == NULL) {
+        break;
+      }
+    } else {
+      kremovemsg(msgport, msg);
+    }
+
+    sqe = &sq->entries[tail & (MSGRING_ENTRIES - 1)];
+    sqe->msgid = msg->msgid;
+    memcpy(&sqe->req, msg->req, sizeof (iorequest_t));
+
+    tail++;
+
+    // Publish each entry only after its contents are written
+    sq->tail = tail;
+  }
+}
+
+
+/* @brief   Return replies posted to the completion ring to their senders
+ *
+ * @param   msgport, message port to reap completions of
+ * @return  0 on success, -EIO if the server corrupted the ring indices
+ *
+ * Entries with a msgid that does not refer to a message received on this
+ * port are skipped.
+ */
+int msgring_reap(struct MsgPort *msgport)
+{
+  struct MsgRingCQ *cq;
+  struct MsgRingCQE *cqe;
+  struct Msg *msg;
+  uint32_t head;
+  uint32_t tail;
+
+  cq = msgport->cq;
+
+  if (cq == NULL) {
+    return 0;
+  }
+
+  head = cq->head;
+  tail = cq->tail;
+
+  if ((tail - head) > MSGRING_ENTRIES) {
+    klog_error("msgring_reap, corrupt completion ring");
+    cq->head = tail;
+    return -EIO;
+  }
+
+  while (head != tail) {
+    cqe = &cq->entries[head & (MSGRING_ENTRIES - 1)];
+    head++;
+
+    if ((msg = msgid_to_msg(msgport, cqe->msgid)) == NULL
+        || kmsgpending(msgport, msg)) {
+      continue;
+    }
+
+    msg->reply_status = cqe->status;
+
+    if (msg->reply != NULL) {
+      memcpy(msg->reply, &cqe->reply, sizeof (ioreply_t));
+    }
+
+    kassert(msg->reply_port != NULL);
+    kreplymsg(msg);
+  }
+
+  cq->head = head;
+  return 0;
+}
+
@@ -38,6 +38,8 @@ KLOG_REGISTER(LOG_FS_OPEN)
  *          O_CREAT, create a file if it does not exist
  *          O_APPEND, seek to the end of the file on open
  *          O_TRUNC, truncate a file to 0 bytes
+ *          O_DIRECT, aligned reads and writes of a regular file bypass the
+ *                    file cache, see read_from_file_direct()
  * @param   mode, optional mode access bits to apply when creating a file
  * @return  file descriptor number of success, negative errno on failure.
  */
@@ -0,0 +1,377 @@
+/*
+ * Copyright 2014  Marven Gilhespie
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * --
+ * Per-vnode index of cached pages.
+ *
+ * The pages of a file that are in the cache are kept in an AVL tree ordered
+ * by file offset, rooted at vnode->page_tree.  The tree links are embedded in
+ * struct Page so that inserting a page never needs to allocate memory.
+ * Lookups are O(log n) and the tree can be walked in file offset order, which
+ * lets truncation, invalidation and read-ahead visit only the pages in the
+ * range they are interested in rather than every cached page of the file.
+ */
+
+#include <kernel/dbg.h>
+#include <kernel/filesystem.h>
+#include <kernel/globals.h>
+#include <kernel/types.h>
+#include <kernel/vm.h>
+
+KLOG_REGISTER(LOG_FS_CACHE)
+
+
+// Static prototypes
+static int pagetree_height(struct Page *page);
+static void pagetree_update_height(struct Page *page);
+static void pagetree_replace_child(struct VNode *vnode, struct Page *parent,
+                                   struct Page *old_child, struct Page *new_child);
+static struct Page *pagetree_rotate_left(struct VNode *vnode, struct Page *page);
+static struct Page *pagetree_rotate_right(struct VNode *vnode, struct Page *page);
+static void pagetree_rebalance(struct VNode *vnode, struct Page *page);
+static struct Page *pagetree_leftmost(struct Page *page);
+
+
+/* @brief   Find a cached page of a file
+ *
+ * @param   vnode, file to find the page of
+ * @param   file_offset, page-aligned offset within the file
+ * @return  Page on success, NULL if not present
+ */
+struct Page *pagetree_lookup(struct VNode *vnode, off64_t file_offset)
+{
+  struct Page *page;
+
+  page = vnode->page_tree;
+
+  while (page != NULL) {
+    if (file_offset < page->file_offset) {
+      page = page->tree_left;
+    } else if (file_offset > page->file_offset) {
+      page = page->tree_right;
+    } else {
+      return page;
+    }
+  }
+
+  return NULL;
+}
+
+
+/* @brief   Find the first cached page of a file at or after an offset
+ *
+ * @param   vnode, file to find the page of
+ * @param   file_offset, offset within the file
+ * @return  Page with the lowest file offset not less than file_offset,
+ *          NULL if there is none
+ */
+struct Page *pagetree_lookup_ge(struct VNode *vnode, off64_t file_offset)
+{
+  struct Page *page;
+  struct Page *found = NULL;
+
+  page = vnode->page_tree;
+
+  while (page != NULL) {
+    if (page->file_offset >= file_offset) {
+      found = page;
+      page = page->tree_left;
+    } else {
+      page = page->tree_right;
+    }
+  }
+
+  return found;
+}
+
+
+/* @brief   Get the cached page of a file with the lowest file offset
+ *
+ * @param   vnode, file to get the page of
+ * @return  Page, or NULL if the file has no cached pages
+ */
+struct Page *pagetree_first(struct VNode *vnode)
+{
+  if (vnode->page_tree == NULL) {
+    return NULL;
+  }
+
+  return pagetree_leftmost(vnode->page_tree);
+}
+
+
+/* @brief   Get the next cached page of the same file in file offset order
+ *
+ * @param   page, cached page
+ * @return  Page, or NULL if page is the last cached page of the file
+ */
+struct Page *pagetree_next(struct Page *page)
+{
+  struct Page *parent;
+
+  if (page->tree_right != NULL) {
+    return pagetree_leftmost(page->tree_right);
+  }
+
+  parent = page->tree_parent;
+
+  while (parent != NULL && page == parent->tree_right) {
+    page = parent;
+    parent = page->tree_parent;
+  }
+
+  return parent;
+}
+
+
+/* @brief   Find the first page of a file, at or after an offset, that is not cached
+ *
+ * @param   vnode, file to search
+ * @param   file_offset, page-aligned offset within the file
+ * @return  page-aligned offset of the first page not in the cache
+ */
+off64_t pagetree_next_missing(struct VNode *vnode, off64_t file_offset)
+{
+  struct Page *page;
+
+  page = pagetree_lookup(vnode, file_offset);
+
+  while (page != NULL && page->file_offset == file_offset) {
+    file_offset += PAGE_SIZE;
+    page = pagetree_next(page);
+  }
+
+  return file_offset;
+}
+
+
+/* @brief   Add a page to a file's tree of cached pages
+ *
+ * @param   vnode, file the page belongs to
+ * @param   page, page with file_offset set, not already in a tree
+ */
+void pagetree_insert(struct VNode *vnode, struct Page *page)
+{
+  struct Page *parent = NULL;
+  struct Page **link;
+
+  link = &vnode->page_tree;
+
+  while (*link != NULL) {
+    parent = *link;
+
+    kassert(page->file_offset != parent->file_offset);
+
+    if (page->file_offset < parent->file_offset) {
+      link = &parent->tree_left;
+    } else {
+      link = &parent->tree_right;
+    }
+  }
+
+  page->tree_parent = parent;
+  page->tree_left = NULL;
+  page->tree_right = NULL;
+  page->tree_height = 1;
+  *link = page;
+
+  pagetree_rebalance(vnode, parent);
+}
+
+
+/* @brief   Remove a page from a file's tree of cached pages
+ *
+ * @param   vnode, file the page belongs to
+ * @param   page, page to remove
+ *
+ * A page with two children is replaced by its in-order successor, the tree
+ * is then rebalanced from the lowest node whose subtree changed.
+ */
+void pagetree_remove(struct VNode *vnode, struct Page *page)
+{
+  struct Page *successor;
+  struct Page *child;
+  struct Page *start;
+
+  if (page->tree_left != NULL && page->tree_right != NULL) {
+    successor = pagetree_leftmost(page->tree_right);
+
+    if (successor->tree_parent != page) {
+      start = successor->tree_parent;
+      pagetree_replace_child(vnode, start, successor, successor->tree_right);
+
+      successor->tree_right = page->tree_right;
+      successor->tree_right->tree_parent = successor;
+    } else {
+      start = successor;
+    }
+
+    successor->tree_left = page->tree_left;
+    successor->tree_left->tree_parent = successor;
+    pagetree_replace_child(vnode, page->tree_parent, page, successor);
+
+  } else {
+    child = (page->tree_left != NULL) ? page->tree_left : page->tree_right;
+    start = page->tree_parent;
+    pagetree_replace_child(vnode, start, page, child);
+  }
+
+  page->tree_parent = NULL;
+  page->tree_left = NULL;
+  page->tree_right = NULL;
+  page->tree_height = 0;
+
+  pagetree_rebalance(vnode, start);
+}
+
+
+/*
+ *
+ */
+static int pagetree_height(struct Page *page)
+{
+  return (page != NULL) ? page->tree_height : 0;
+}
+
+
+/*
+ *
+ */
+static void pagetree_update_height(struct Page *page)
+{
+  int left_height;
+  int right_height;
+
+  left_height = pagetree_height(page->tree_left);
+  right_height = pagetree_height(page->tree_right);
+
+  page->tree_height = 1 + ((left_height > right_height) ? left_height : right_height);
+}
+
+
+/* @brief   Make new_child take the place of old_child under parent
+ */
+static void pagetree_replace_child(struct VNode *vnode, struct Page *parent,
+                                   struct Page *old_child, struct Page *new_child)
+{
+  if (parent == NULL) {
+    vnode->page_tree = new_child;
+  } else if (parent->tree_left == old_child) {
+    parent->tree_left = new_child;
+  } else {
+    parent->tree_right = new_child;
+  }
+
+  if (new_child != NULL) {
+    new_child->tree_parent = parent;
+  }
+}
+
+
+/*
+ *
+ */
+static struct Page *pagetree_rotate_left(struct VNode *vnode, struct Page *page)
+{
+  struct Page *pivot;
+
+  pivot = page->tree_right;
+
+  page->tree_right = pivot->tree_left;
+
+  if (pivot->tree_left != NULL) {
+    pivot->tree_left->tree_parent = page;
+  }
+
+  pagetree_replace_child(vnode, page->tree_parent, page, pivot);
+
+  pivot->tree_left = page;
+  page->tree_parent = pivot;
+
+  pagetree_update_height(page);
+  pagetree_update_height(pivot);
+  return pivot;
+}
+
+
+/*
+ *
+ */
+static struct Page *pagetree_rotate_right(struct VNode *vnode, struct Page *page)
+{
+  struct Page *pivot;
+
+  pivot = page->tree_left;
+
+  page->tree_left = pivot->tree_right;
+
+  if (pivot->tree_right != NULL) {
+    pivot->tree_right->tree_parent = page;
+  }
+
+  pagetree_replace_child(vnode, page->tree_parent, page, pivot);
+
+  pivot->tree_right = page;
+  page->tree_parent = pivot;
+
+  pagetree_update_height(page);
+  pagetree_update_height(pivot);
+  return pivot;
+}
+
+
+/* @brief   Restore the AVL balance of the path from a node to the root
+ */
+static void pagetree_rebalance(struct VNode *vnode, struct Page *page)
+{
+  int balance;
+
+  while (page != NULL) {
+    pagetree_update_height(page);
+
+    balance = pagetree_height(page->tree_left) - pagetree_height(page->tree_right);
+
+    if (balance > 1) {
+      if (pagetree_height(page->tree_left->tree_left) < pagetree_height(page->tree_left->tree_right)) {
+        pagetree_rotate_left(vnode, page->tree_left);
+      }
+
+      page = pagetree_rotate_right(vnode, page);
+
+    } else if (balance < -1) {
+      if (pagetree_height(page->tree_right->tree_right) < pagetree_height(page->tree_right->tree_left)) {
+        pagetree_rotate_right(vnode, page->tree_right);
+      }
+
+      page = pagetree_rotate_left(vnode, page);
+    }
+
+    page = page->tree_parent;
+  }
+}
+
+
+/*
+ *
+ */
+static struct Page *pagetree_leftmost(struct Page *page)
+{
+  while (page->tree_left != NULL) {
+    page = page->tree_left;
+  }
+
+  return page;
+}
+
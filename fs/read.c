@@ -71,7 +71,11 @@ ssize_t sys_read(int fd, void *dst, size_t sz)
         if (S_ISCHR(vnode->mode)) {
           retval = read_from_char(vnode, dst, sz);
         } else if (S_ISREG(vnode->mode)) {
-          retval = read_from_file(vnode, dst, sz, &filp->offset, false);
+          if ((filp->flags & O_DIRECT) && is_direct_io_aligned(filp->offset, sz)) {
+            retval = read_from_file_direct(vnode, dst, sz, &filp->offset);
+          } else {
+            retval = read_from_file(vnode, dst, sz, &filp->offset, &filp->ra, false);
+          }
         } else if (S_ISFIFO(vnode->mode)) {
           retval = read_from_pipe(vnode, dst, sz);  
         } else if (S_ISBLK(vnode->mode)) {
@@ -136,7 +140,7 @@ ssize_t kread(int fd, void *dst, size_t sz)
         rwlock_shared(&vnode->lock);
 
         if (S_ISREG(vnode->mode)) {
-          retval = read_from_file(vnode, dst, sz, &filp->offset, true);
+          retval = read_from_file(vnode, dst, sz, &filp->offset, &filp->ra, true);
         } else {
           klog_info("kread() -EBADF a");
 
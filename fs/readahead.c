@@ -0,0 +1,243 @@
+/*
+ * Copyright 2014  Marven Gilhespie
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * --
+ * Read-ahead of files into the VFS file cache.
+ *
+ * Each open file tracks whether it is being read sequentially. While it is,
+ * a window of the pages following the reader is fetched into the cache by the
+ * readahead-kt kernel thread with a single multi-page read, so that the reader
+ * finds them already valid. The window doubles each time it is consumed, up to
+ * READAHEAD_MAX_PAGES, and is dropped on the first non-sequential read.
+ */
+
+#include <kernel/dbg.h>
+#include <kernel/filesystem.h>
+#include <kernel/globals.h>
+#include <kernel/proc.h>
+#include <kernel/vm.h>
+#include <kernel/types.h>
+#include <string.h>
+
+KLOG_REGISTER(LOG_FS_READAHEAD)
+
+
+// Static prototypes
+static void do_readahead(struct VNode *vnode, off64_t file_offset, int page_cnt);
+
+
+/* @brief   Initialize the read-ahead request lists
+ */
+void init_readahead(void)
+{
+  kassert(READAHEAD_MAX_PAGES <= BREADN_MAX_PAGES);
+  
+  DLIST_INIT(&readahead_free_list);
+  DLIST_INIT(&readahead_pending_list);
+  InitRendez(&readahead_rendez);
+  
+  for (int t = 0; t < NR_READAHEAD; t++) {
+    DLIST_ADD_TAIL(&readahead_free_list, &readahead_table[t], link);
+  }
+}
+
+
+/* @brief   Update the read-ahead state of a file and start any read-ahead
+ *
+ * @param   vnode, file being read
+ * @param   ra, read-ahead state of the file pointer being read
+ * @param   offset, offset the read starts at
+ * @param   sz, number of bytes being read
+ *
+ * Called before the read is performed. Read-ahead is started once less than
+ * half of the current window remains ahead of the reader, so a steady
+ * sequential reader keeps a window in flight. Pages of the read itself that
+ * are not yet cached are included, so that a large read needs one message to
+ * the filesystem handler rather than one per page.
+ */
+void file_readahead(struct VNode *vnode, struct ReadAhead *ra, off64_t offset, size_t sz)
+{
+  off64_t end;
+  off64_t start;
+  off64_t ceiling;
+  int page_cnt;
+  
+  end = offset + sz;
+  
+  if (offset != ra->next_offset) {
+    ra->window = 0;
+    ra->ahead_offset = 0;
+    ra->next_offset = end;
+    return;
+  }
+  
+  ra->next_offset = end;
+
+  if (ra->window == 0) {
+    ra->window = READAHEAD_MIN_PAGES;
+  }
+  
+  if (ra->ahead_offset >= end + (ra->window / 2) * PAGE_SIZE) {
+    return;
+  }
+  
+  start = ALIGN_DOWN(offset, PAGE_SIZE);
+  
+  if (start < ra->ahead_offset) {
+    start = ra->ahead_offset;
+  }
+  
+  ceiling = ALIGN_UP(end, PAGE_SIZE) + ra->window * PAGE_SIZE;
+  
+  if (ceiling > ALIGN_UP(vnode->size, PAGE_SIZE)) {
+    ceiling = ALIGN_UP(vnode->size, PAGE_SIZE);
+  }
+  
+  if (start >= ceiling) {
+    return;
+  }
+  
+  page_cnt = (ceiling - start) / PAGE_SIZE;
+  
+  if (page_cnt > READAHEAD_MAX_PAGES) {
+    page_cnt = READAHEAD_MAX_PAGES;
+  }
+  
+  if (bread_ahead(vnode, start, page_cnt) != 0) {
+    return;
+  }
+  
+  ra->ahead_offset = start + page_cnt * PAGE_SIZE;
+  
+  if (ra->window < READAHEAD_MAX_PAGES) {
+    ra->window *= 2;
+  }
+}
+
+
+/* @brief   Queue pages of a file to be read into the cache
+ *
+ * @param   vnode, file to read ahead
+ * @param   file_offset, page-aligned offset of first page to read
+ * @param   page_cnt, number of pages to read, up to READAHEAD_MAX_PAGES
+ * @return  0 on success, -EAGAIN if too many requests are already queued
+ *
+ * Read-ahead is only a hint, the request is dropped if the queue is full.
+ */
+int bread_ahead(struct VNode *vnode, off64_t file_offset, int page_cnt)
+{
+  struct ReadAheadReq *req;
+  
+  if ((req = DLIST_HEAD(&readahead_free_list)) == NULL) {
+    return -EAGAIN;
+  }
+  
+  DLIST_REM_HEAD(&readahead_free_list, link);
+  
+  vnode_ref(vnode);
+  req->vnode = vnode;
+  req->file_offset = file_offset;
+  req->page_cnt = (page_cnt < READAHEAD_MAX_PAGES) ? page_cnt : READAHEAD_MAX_PAGES;
+  
+  DLIST_ADD_TAIL(&readahead_pending_list, req, link);
+  TaskWakeup(&readahead_rendez);
+  return 0;
+}
+
+
+/* @brief   Kernel task that performs queued read-ahead requests
+ *
+ * @param   arg, unused
+ */
+void readahead_task(void *arg)
+{
+  struct ReadAheadReq *req;
+  
+  while (1) {
+    while ((req = DLIST_HEAD(&readahead_pending_list)) == NULL) {
+      TaskSleep(&readahead_rendez);
+    }
+    
+    DLIST_REM_HEAD(&readahead_pending_list, link);
+    
+    if ((req->vnode->superblock->flags & SBF_ABORT) == 0) {
+      rwlock_shared(&req->vnode->lock);
+      do_readahead(req->vnode, req->file_offset, req->page_cnt);
+      rwlock_release(&req->vnode->lock);
+    }
+    
+    vnode_put(req->vnode);
+    req->vnode = NULL;
+    DLIST_ADD_TAIL(&readahead_free_list, req, link);
+  }
+}
+
+
+/* @brief   Read a run of pages that are not in the cache with a single message
+ *
+ * @param   vnode, file to read
+ * @param   file_offset, page-aligned offset of first page to read
+ * @param   page_cnt, maximum number of pages to read
+ *
+ * Pages at the start of the range that are already cached are skipped, the
+ * read then stops at the next page already in the cache or being read by
+ * another thread. The pages are held busy while the read is in progress, so a reader
+ * that reaches one of them sleeps in getblk() until it is valid.
+ */
+static void do_readahead(struct VNode *vnode, off64_t file_offset, int page_cnt)
+{
+  struct Page *page[READAHEAD_MAX_PAGES];
+  off64_t offset;
+  int cnt;
+  
+  offset = pagetree_next_missing(vnode, file_offset);
+  page_cnt -= (offset - file_offset) / PAGE_SIZE;
+  file_offset = offset;
+  
+  for (cnt = 0; cnt < page_cnt; cnt++) {
+    offset = file_offset + cnt * PAGE_SIZE;
+    
+    if (offset >= vnode->size || find_blk(vnode, offset) != NULL) {
+      break;
+    }
+    
+    if ((page[cnt] = getblk(vnode, offset)) == NULL) {
+      break;
+    }
+    
+    // getblk() may have slept, another thread may have read the page meanwhile
+    if (page[cnt]->bflags & B_VALID) {
+      brelse(page[cnt]);
+      break;
+    }
+  }
+
+  if (cnt == 0) {
+    return;
+  }
+  
+  klog_info("do_readahead(offs:%08x, cnt:%d)", (uint32_t)file_offset, cnt);
+  
+  breadv(vnode, page, cnt);
+  
+  for (int t = 0; t < cnt; t++) {
+    if (page[t]->bflags & B_VALID) {
+      brelse(page[t]);
+    } else {
+      bdiscard(page[t]);
+    }
+  }
+}
+
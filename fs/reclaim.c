@@ -0,0 +1,129 @@
+/*
+ * Copyright 2014  Marven Gilhespie
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * --
+ * Background reclaim of file cache pages.
+ *
+ * Pages are shared between anonymous memory, allocated with alloc_page(), and
+ * the file cache.  The reclaim-kt kernel thread keeps a reserve of empty pages
+ * on the free page queue so that allocations rarely have to evict a cached
+ * block themselves.  It is woken when the number of free pages falls below
+ * free_page_low and evicts clean cached blocks until free_page_high pages are
+ * free.  If there are not enough clean blocks, dirty blocks are written back
+ * first.
+ *
+ * The balance between the two users of pages is set by cache_min_pages, which
+ * anonymous allocations cannot take from the file cache, and cache_max_pages,
+ * beyond which the file cache recycles its own blocks rather than free pages.
+ */
+
+#include <kernel/dbg.h>
+#include <kernel/filesystem.h>
+#include <kernel/globals.h>
+#include <kernel/proc.h>
+#include <kernel/timer.h>
+#include <kernel/types.h>
+#include <kernel/vm.h>
+
+KLOG_REGISTER(LOG_FS_RECLAIM)
+
+
+// Static prototypes
+static void do_reclaim(void);
+
+
+/* @brief   Initialize the free page watermarks and the cache balance
+ *
+ * Must be called after the free page queue has been initialized.
+ */
+void init_reclaim(void)
+{
+  InitRendez(&reclaim_rendez);
+
+  free_page_low = (cache_page_cnt * RECLAIM_LOW_PERCENT) / 100;
+  free_page_high = (cache_page_cnt * RECLAIM_HIGH_PERCENT) / 100;
+  cache_min_pages = (cache_page_cnt * CACHE_MIN_PERCENT) / 100;
+  cache_max_pages = (cache_page_cnt * CACHE_MAX_PERCENT) / 100;
+
+  klog_info("init_reclaim, pages:%d, low:%d, high:%d, cache min:%d, max:%d",
+            cache_page_cnt, free_page_low, free_page_high, cache_min_pages, cache_max_pages);
+}
+
+
+/* @brief   Wake the reclaim task if the free page queue is below its low watermark
+ */
+void check_free_page_low(void)
+{
+  if (free_page_cnt < free_page_low) {
+    TaskWakeup(&reclaim_rendez);
+  }
+}
+
+
+/* @brief   Kernel task that keeps a reserve of free pages
+ *
+ * @param   arg, unused
+ */
+void reclaim_task(void *arg)
+{
+  struct timespec timeout;
+
+  while (1) {
+    timeout.tv_sec = RECLAIM_INTERVAL_TICKS / JIFFIES_PER_SECOND;
+    timeout.tv_nsec = (RECLAIM_INTERVAL_TICKS % JIFFIES_PER_SECOND) * NANOSECONDS_PER_JIFFY;
+
+    TaskSleepInterruptible(&reclaim_rendez, &timeout, INTRF_NONE);
+
+    if (free_page_cnt < free_page_low) {
+      do_reclaim();
+    }
+  }
+}
+
+
+/* @brief   Evict cached blocks until free_page_high pages are free
+ *
+ * If there are not enough clean blocks the dirty blocks of every mounted
+ * filesystem are written back, regardless of when they expire, and the
+ * blocks then evicted.
+ */
+static void do_reclaim(void)
+{
+  struct SuperBlock *sb;
+  int target;
+  int cnt;
+
+  target = free_page_high - free_page_cnt;
+  cnt = reclaim_cached_blks(target);
+
+  klog_info("do_reclaim, target:%d, reclaimed:%d, dirty:%d", target, cnt, dirty_page_cnt);
+
+  if (cnt >= target || dirty_page_cnt == 0) {
+    return;
+  }
+
+  sb = DLIST_HEAD(&mounted_superblock_list);
+
+  while (sb != NULL) {
+    if ((sb->flags & SBF_ABORT) == 0 && !DLIST_EMPTY(&sb->dirty_vnode_list)) {
+      bdflush_superblock(sb, UINT64_MAX);
+    }
+
+    sb = DLIST_NEXT(sb, link);
+  }
+
+  reclaim_cached_blks(free_page_high - free_page_cnt);
+}
+
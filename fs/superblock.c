@@ -81,6 +81,8 @@ struct SuperBlock *alloc_superblock(void)
   sb->flags = 0;
   
   DLIST_INIT(&sb->vnode_list);
+  DLIST_INIT(&sb->dirty_vnode_list);
+  InitRendez(&sb->bdflush_rendez);
   
   // TODO: Will need to hold mounted_superblock_list_busy rwlock EXCLUSIVE
   // Unless we can make temporary copies of lists at a given instant and make
@@ -237,6 +239,7 @@ int do_close_superblock(struct SuperBlock *sb)
     sb->flags |= SBF_ABORT;
     
     detach_mount(sb);
+    fini_superblock_bdflush(sb, 0);
     fini_msgport(&sb->msgport);
     fini_character_device_queues(sb); 
   }      
@@ -26,7 +26,8 @@ KLOG_REGISTER(LOG_FS_SYNC)
 
 /* @brief   Write all mounted filesystems to disk
  *
- * Send sync message to all mounted filesystems
+ * Write all delayed-write blocks in the cache then send sync message to
+ * all mounted filesystems
  * TODO: Do we increment superblock reference count, then decrement once finished ?
  */
 int sys_sync(void)
@@ -58,6 +59,12 @@ int sys_sync(void)
   while((sb = DLIST_HEAD(&sync_superblock_list)) != NULL) {
     DLIST_REM_HEAD(&sync_superblock_list, sync_link);
     
+    sc = bdflush_superblock(sb, UINT64_MAX);
+
+    if (saved_sc == 0 && sc != 0) {
+      saved_sc = sc;
+    }
+
     sc = vfs_syncfs(sb);
     
     if (saved_sc == 0 && sc != 0) {
@@ -112,7 +119,7 @@ int sys_fsync(int fd)
   }
   
   rwlock_shared(&vnode->lock);
-  sc = vfs_fsync(vnode);  // TODO: vfs message to a filesystem handler to sync a specific file
+  sc = bsyncv(vnode);
   rwlock_release(&vnode->lock);
   
   return sc;  
@@ -118,7 +118,9 @@ struct VNode *vnode_get_new(struct SuperBlock *sb)
   vnode->gid = 9999;
   vnode->size = 0;
 
-  DLIST_INIT(&vnode->page_list);  
+  vnode->page_tree = NULL;
+  DLIST_INIT(&vnode->dirty_page_list);
+  vnode->write_error = 0;
   DLIST_INIT(&vnode->dname_list);
   DLIST_INIT(&vnode->directory_dname_list);
 
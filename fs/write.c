@@ -67,7 +67,13 @@ ssize_t sys_write(int fd, void *src, size_t sz)
           retval = write_to_char(vnode, src, sz);  
         } else if (S_ISREG(vnode->mode)) {
           rwlock_upgrade(&vnode->lock);
-          retval = write_to_file(vnode, src, sz, &filp->offset);
+
+          if ((filp->flags & O_DIRECT) && is_direct_io_aligned(filp->offset, sz)) {
+            retval = write_to_file_direct(vnode, src, sz, &filp->offset);
+          } else {
+            retval = write_to_file(vnode, src, sz, &filp->offset);
+          }
+          
           rwlock_downgrade(&vnode->lock);
         } else if (S_ISFIFO(vnode->mode)) {
           retval = write_to_pipe(vnode, src, sz);
@@ -42,6 +42,8 @@
 #define LOG_FS_PIPE             LOG_LEVEL_WARN
 #define LOG_FS_POLL             LOG_LEVEL_WARN
 #define LOG_FS_READ             LOG_LEVEL_WARN
+#define LOG_FS_READAHEAD        LOG_LEVEL_WARN
+#define LOG_FS_RECLAIM          LOG_LEVEL_WARN
 #define LOG_FS_RENAME           LOG_LEVEL_WARN
 #define LOG_FS_REVOKE           LOG_LEVEL_WARN
 #define LOG_FS_SEEK             LOG_LEVEL_WARN
@@ -58,6 +60,7 @@
 
 #define LOG_PROC_ID             LOG_LEVEL_WARN
 #define LOG_PROC_INTERRUPT      LOG_LEVEL_WARN
+#define LOG_PROC_IOPRIO         LOG_LEVEL_WARN
 #define LOG_PROC_PID            LOG_LEVEL_WARN
 #define LOG_PROC_PRIVILEGES     LOG_LEVEL_WARN
 #define LOG_PROC_PROC           LOG_LEVEL_WARN
@@ -74,10 +77,12 @@
 #define LOG_PROC_USAGE          LOG_LEVEL_WARN
 
 #define LOG_VM_AS               LOG_LEVEL_WARN
+#define LOG_VM_IPCOPY           LOG_LEVEL_WARN
 #define LOG_VM_MEMREGION        LOG_LEVEL_WARN
 #define LOG_VM_MMAP             LOG_LEVEL_WARN
 #define LOG_VM_PAGE             LOG_LEVEL_WARN
 #define LOG_VM_PAGEFAULT        LOG_LEVEL_WARN
+#define LOG_VM_ZEROPAGE         LOG_LEVEL_WARN
 
 
 
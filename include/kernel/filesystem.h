@@ -23,6 +23,11 @@
 #include <sys/select.h>
 #include <sys/syscalls.h>
 
+// Open flag to bypass the file cache, newlib only defines it as _FDIRECT
+#ifndef O_DIRECT
+#define O_DIRECT        _FDIRECT
+#endif
+
 
 // Forward declarations
 struct VNodeLock;
@@ -44,6 +49,8 @@ DLIST_TYPE(SuperBlock, superblock_list_t, superblock_link_t);
 DLIST_TYPE(Pipe, pipe_list_t, pipe_link_t);
 DLIST_TYPE(TTYState, ttystate_list_t, ttystate_link_t);
 DLIST_TYPE(DelWriMsg, delwrimsg_list_t, delwrimsg_link_t);
+DLIST_TYPE(ReadAheadReq, readahead_list_t, readahead_link_t);
+DLIST_TYPE(CacheGhost, cacheghost_list_t, cacheghost_link_t);
 
 
 // lookup() flags
@@ -89,11 +96,33 @@ DLIST_TYPE(DelWriMsg, delwrimsg_list_t, delwrimsg_link_t);
 
 #define ASYNC_WRITE_DELAY_TICKS             50     // Time in ticks to delay an async-write
 #define DIRTY_WRITE_DELAY_TICKS             500    // Time in ticks to delay a delayed-write
-#define DIRTY_FLUSH_INTERVAL_TICKS          50
+#define DIRTY_FLUSH_INTERVAL_TICKS          50     // Interval in ticks between bdflush passes
+#define DIRTY_MIN_FREE_PAGES                64     // Write synchronously if fewer free cache pages
+
+#define RECLAIM_LOW_PERCENT                 2      // Wake reclaim task below this percent of pages free
+#define RECLAIM_HIGH_PERCENT                4      // Reclaim task frees pages up to this percent
+#define CACHE_MIN_PERCENT                   10     // Cached pages anonymous memory cannot take
+#define CACHE_MAX_PERCENT                   75     // Cache recycles its own blocks above this percent
+#define RECLAIM_INTERVAL_TICKS              100    // Interval in ticks between reclaim checks
+#define RECLAIM_ALLOC_TIMEOUT_TICKS         200    // Maximum time in ticks an allocation waits for a page
 
 
 #define SCHED_PRIO_CACHE_HANDLER      16      // Task priority of bdflush tasks.
 
+#define BREADN_MAX_PAGES              16      // Largest cluster read by breadn(), no more than IOV_MAX
+
+#define CACHE_BLOCK_SIZE_MEDIUM       0x4000    // Cache block size of medium sized files
+#define CACHE_BLOCK_SIZE_LARGE        0x10000   // Cache block size of large files, no more than BREADN_MAX_PAGES
+#define CACHE_BLOCK_MEDIUM_FILE_SZ    0x40000   // Smallest file read in CACHE_BLOCK_SIZE_MEDIUM blocks
+#define CACHE_BLOCK_LARGE_FILE_SZ     0x400000  // Smallest file read in CACHE_BLOCK_SIZE_LARGE blocks
+#define BWRITEV_MAX_PAGES             16      // Largest cluster written by bwritev(), no more than IOV_MAX
+#define DIRECT_IO_ALIGN               PAGE_SIZE // Offset and size alignment of O_DIRECT transfers
+#define CACHE_A1IN_PERCENT            25      // Share of the cache for blocks used once (2Q Kin)
+
+#define NR_READAHEAD                  64      // Number of queued read-ahead requests
+#define READAHEAD_MIN_PAGES           4       // Initial read-ahead window of a sequential reader
+#define READAHEAD_MAX_PAGES           16      // Largest read-ahead window, no more than BREADN_MAX_PAGES
+
 
 
 #define MAX_RENAME_PATH_CHECK_DEPTH   128   /* Max directories to ascend when checking rename
@@ -170,7 +199,10 @@ struct VNode
   vnode_link_t hash_link;               // hash table lookup link    
   vnode_link_t vnode_link;              // Free list or in use link
   
-  page_list_t page_list;                // All pages belonging to a file that are in the cache
+  struct Page *page_tree;               // Root of tree of the file's cached pages, see fs/pagetree.c
+  page_list_t dirty_page_list;          // Delayed-write pages, oldest first
+  vnode_link_t dirty_link;              // Superblock's list of vnodes with dirty pages
+  int write_error;                      // Failed delayed write, returned by next fsync()
     
   dname_list_t dname_list;              // All dname entries pointing to this vnode
   dname_list_t directory_dname_list;    // All entries within this directory
@@ -213,12 +245,18 @@ struct SuperBlock
   bool vnode_list_busy;
   struct Rendez vnode_list_rendez;  
   vnode_list_t  vnode_list; 
+
+  struct Thread *bdflush_thread;        // Task writing back delayed writes, see fs/bdflush.c
+  struct Rendez bdflush_rendez;
+  vnode_list_t dirty_vnode_list;        // Vnodes with pages on their dirty_page_list
 };
 
 // SuperBlock.flags
 #define SBF_ABORT                  (1 << 0)
 #define SBF_READONLY               (1 << 1)
 #define SBF_WRITETHRU              (1 << 2)
+#define SBF_MSGRING                (1 << 3)   // Message port uses shared submission/completion rings
+#define SBF_SMALLBLOCKS            (1 << 4)   // Cache files in page-sized blocks only
 
 // Sepcial-case SuperBlock.dev major/minor numbers
 #define DEV_T_DEV_TTY   0x0500
@@ -239,11 +277,75 @@ struct DName {
 };
 
 
+/* @brief   Identity of a block recently evicted from the cache's a1in queue
+ *
+ * The file is identified by superblock and inode number rather than by vnode
+ * as the vnode may be recycled for another file while the ghost remains.
+ */
+struct CacheGhost
+{
+  struct SuperBlock *superblock;        // NULL if the entry is unused
+  ino_t inode_nr;
+  off64_t file_offset;
+  cacheghost_link_t hash_link;
+  cacheghost_link_t lru_link;
+};
+
+
+/* @brief   File cache replacement policy counters, see sys_getcachestats()
+ */
+struct CacheStats
+{
+  uint32_t hits;                        // Blocks found in the cache
+  uint32_t misses;                      // Blocks not found in the cache
+  uint32_t a1in_hits;                   // Hits on blocks used once since being read
+  uint32_t am_hits;                     // Hits on frequently used blocks
+  uint32_t ghost_hits;                  // Misses on blocks with a ghost entry, promoted to am
+  uint32_t a1in_evictions;              // Blocks evicted from a1in
+  uint32_t am_evictions;                // Blocks evicted from am
+  
+  uint32_t page_cnt;                    // Pages available to the cache
+  uint32_t free_cnt;                    // Pages without valid contents
+  uint32_t a1in_cnt;                    // Clean blocks on the a1in queue
+  uint32_t am_cnt;                      // Clean blocks on the am queue
+  uint32_t dirty_cnt;                   // Delayed-write blocks
+  uint32_t ghost_cnt;                   // Ghost entries in use
+  uint32_t anon_cnt;                    // Pages allocated to anonymous memory
+  
+  uint32_t alloc_stalls;                // Allocations that waited for a page
+  uint32_t alloc_failures;              // Allocations that timed out waiting for a page
+  uint32_t reclaimed;                   // Cached blocks evicted by the reclaim task
+  uint32_t zero_cnt;                    // Free pages already zero filled
+};
+
+
+/* @brief   Sequential access detection of an open file, see fs/readahead.c
+ */
+struct ReadAhead
+{
+  off64_t next_offset;                  // Offset the next read starts at if sequential
+  off64_t ahead_offset;                 // End of the pages read-ahead has been started for
+  int window;                           // Pages to read ahead, 0 if not reading sequentially
+};
+
+
+/* @brief   Queued request for the read-ahead kernel task
+ */
+struct ReadAheadReq
+{
+  readahead_link_t link;
+  struct VNode *vnode;
+  off64_t file_offset;
+  int page_cnt;
+};
+
+
 /* @brief   File pointer of an open file
  */
 struct Filp
 {
   off64_t offset;
+  struct ReadAhead ra;
   
   mode_t mode;                          // TODO: Need to set the access mode on file open or fcntl
   uint32_t flags;                       // Access flags, e.g. O_READ, O_WRITE
@@ -334,6 +436,7 @@ bool match_supplementary_group(struct Process *proc, gid_t gid);
 int init_superblock_bdflush(struct SuperBlock *sb);
 void fini_superblock_bdflush(struct SuperBlock *sb, int how);
 void bdflush_task(void *arg);
+int bdflush_superblock(struct SuperBlock *sb, uint64_t now);
 int pause_bdflush_async_writes(struct SuperBlock *sb);
 int restart_bdflush_async_writes(struct SuperBlock *sb);
 
@@ -346,14 +449,20 @@ int do_close_block_device(struct VNode *vnode);
 
 
 /* fs/cache.c */
+void init_cache(void);
+int sys_getcachestats(void *buf, size_t sz);
 struct Page *getblk(struct VNode *vnode, uint64_t file_offset);
+struct Page *getblk_overwrite(struct VNode *vnode, uint64_t file_offset);
 struct Page *getblk_anon(void);
 void putblk_anon(struct Page *page);
 
 int getblk_dirty_list(struct SuperBlock *sb, uint64_t now, page_list_t *dirty_list);
+int getblk_dirty_vnode_list(struct VNode *vnode, uint64_t now, page_list_t *dirty_list);
 
 struct Page *find_blk(struct VNode *vnode, uint64_t file_offset);
-struct Page *find_available_blk(void);
+struct Page *find_available_blk(bool anon);
+size_t get_cache_block_size(struct VNode *vnode);
+int reclaim_cached_blks(int cnt);
 
 void remove_from_free_page_queue(struct Page *page);
 void remove_from_dirty_page_queue(struct Page *page);
@@ -374,19 +483,26 @@ int calc_page_lookup_hash(ino_t inode_nr, off64_t file_offset);
 int calc_dirty_hash(uint64_t now_ms);
 
 struct Page *bread(struct VNode *vnode, off64_t file_offset);
+int breadn(struct VNode *vnode, off64_t file_offset, int page_cnt, struct Page **page);
+int breadv(struct VNode *vnode, struct Page **page, int page_cnt);
 struct Page *bread_zero(struct VNode *vnode, off64_t file_offset);
+struct Page *bmap(struct VNode *vnode, off64_t file_offset);
+void bunmap(struct Page *page);
+void bmap_dirty(struct Page *page);
 int bwrite(struct Page *buf);
+int bwritev(struct VNode *vnode, struct Page **page, int page_cnt);
+int bwrite_dirty_list(page_list_t *dirty_list);
 int bawrite(struct Page *buf);
 int bdwrite(struct Page *buf);
 
 int bdiscard(struct Page *buf);
+int brefresh(struct Page *buf);
 void brelse(struct Page *buf);
 
-void mark_all_vnode_pages_as_busy(struct VNode *vnode);
-void mark_dirty_vnode_pages_as_busy(struct VNode *vnode);
-
 int bsyncv(struct VNode *vnode);
+int bsyncv_range(struct VNode *vnode, off64_t start, off64_t end);
 int binvalidatev(struct VNode *vnode);
+int binvalidatev_range(struct VNode *vnode, off64_t start, off64_t end);
 int btruncatev(struct VNode *vnode);
 
 void lock_dirty_queues(void);
@@ -442,8 +558,12 @@ int init_root_argv(char *pool, struct execargs *args, char *exe_name, void *ifs_
 ssize_t read_ifs(void *base, off_t offset, void *vaddr, size_t sz);
 
 /* fs/file.c */
-ssize_t read_from_file(struct VNode *vnode, void *src, size_t nbytes, off64_t *offset, bool inkernel);
+ssize_t read_from_file(struct VNode *vnode, void *src, size_t nbytes, off64_t *offset,
+                       struct ReadAhead *ra, bool inkernel);
 ssize_t write_to_file(struct VNode *vnode, void *src, size_t nbytes, off64_t *offset);
+ssize_t read_from_file_direct(struct VNode *vnode, void *dst, size_t nbytes, off64_t *offset);
+ssize_t write_to_file_direct(struct VNode *vnode, void *src, size_t nbytes, off64_t *offset);
+bool is_direct_io_aligned(off64_t offset, size_t nbytes);
 int do_close_file(struct VNode *vnode);
 
 /* fs/filedesc.c */
@@ -508,6 +628,15 @@ int sys_open(char *_path, int oflags, mode_t mode);
 int kopen(char *_path, int oflags, mode_t mode);
 int do_open(struct lookupdata *ld, int oflags, mode_t mode);
 
+/* fs/pagetree.c */
+struct Page *pagetree_lookup(struct VNode *vnode, off64_t file_offset);
+struct Page *pagetree_lookup_ge(struct VNode *vnode, off64_t file_offset);
+struct Page *pagetree_first(struct VNode *vnode);
+struct Page *pagetree_next(struct Page *page);
+off64_t pagetree_next_missing(struct VNode *vnode, off64_t file_offset);
+void pagetree_insert(struct VNode *vnode, struct Page *page);
+void pagetree_remove(struct VNode *vnode, struct Page *page);
+
 /* fs/pipe.c */
 struct Pipe *alloc_pipe(void);
 void free_pipe(struct Pipe *pipe);
@@ -528,6 +657,17 @@ ssize_t sys_read(int fd, void *buf, size_t count);
 ssize_t kread(int fd, void *dst, size_t sz);
 ssize_t sys_blkreadv(int fd, msgiov_t *iov, int iov_cnt);
 
+/* fs/readahead.c */
+void init_readahead(void);
+void file_readahead(struct VNode *vnode, struct ReadAhead *ra, off64_t offset, size_t sz);
+int bread_ahead(struct VNode *vnode, off64_t file_offset, int page_cnt);
+void readahead_task(void *arg);
+
+/* fs/reclaim.c */
+void init_reclaim(void);
+void check_free_page_low(void);
+void reclaim_task(void *arg);
+
 /* fs/rename.c */
 int sys_rename(char *oldpath, char *newpath);
 
@@ -22,6 +22,7 @@ extern struct Page *page_table;
 extern int free_page_cnt;
 extern int dirty_page_cnt;
 extern int busy_page_cnt;
+extern int anon_page_cnt;
 
 //extern bool dirty_queues_busy;
 //extern struct Rendez dirty_queues_rendez;
@@ -29,6 +30,16 @@ extern int busy_page_cnt;
 //extern struct RWLock cache_lock;
 
 extern page_list_t free_page_queue;
+extern page_list_t cache_a1in_queue;
+extern page_list_t cache_am_queue;
+extern page_list_t zero_page_queue;
+extern int cache_page_cnt;
+extern int cache_a1in_cnt;
+extern int cache_am_cnt;
+extern int zero_page_cnt;
+
+extern struct Rendez zero_page_rendez;
+extern struct Thread *zero_page_thread;
 
 //extern page_list_t dirty_page_queue[DIRTY_HASH];
 
@@ -188,6 +199,43 @@ extern dname_list_t dname_hash[DNAME_HASH];
  */
 extern struct VNode *logger_vnode;
 
+/*
+ * Asynchronous I/O
+ */
+extern int max_asyncio;
+extern struct AsyncIO *asyncio_table;
+extern asyncio_list_t free_asyncio_list;
+extern int free_asyncio_cnt;
+
+/*
+ * File read-ahead
+ */
+extern struct ReadAheadReq readahead_table[NR_READAHEAD];
+extern readahead_list_t readahead_free_list;
+extern readahead_list_t readahead_pending_list;
+extern struct Rendez readahead_rendez;
+extern struct Thread *readahead_thread;
+
+/*
+ * File cache replacement policy
+ */
+extern int max_cache_ghost;
+extern int cache_ghost_cnt;
+extern struct CacheGhost *cache_ghost_table;
+extern cacheghost_list_t cache_ghost_queue;
+extern cacheghost_list_t cache_ghost_hash[PAGE_LOOKUP_HASH_SZ];
+extern struct CacheStats cache_stats;
+
+/*
+ * Memory reclaim
+ */
+extern struct Rendez reclaim_rendez;
+extern struct Thread *reclaim_thread;
+extern int free_page_low;
+extern int free_page_high;
+extern int cache_min_pages;
+extern int cache_max_pages;
+
 
 
 #endif
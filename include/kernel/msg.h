@@ -5,18 +5,35 @@
 #include <sys/queue2.h>
 #include <kernel/types.h>
 #include <kernel/sync.h>
+#include <kernel/vm.h>
 #include <sys/syscalls.h>
 #include <sys/iorequest.h>
+#include <sys/syslimits.h>
 #include <unistd.h>
 
 
 // Forward declarations
 struct Process;
+struct Thread;
+struct VNode;
 struct Msg;
 struct MsgPort;
+struct AsyncIO;
+struct MsgRingSQ;
+struct MsgRingCQ;
 
 // List types
 DLIST_TYPE(Msg, msg_list_t, msg_link_t);
+DLIST_TYPE(AsyncIO, asyncio_list_t, asyncio_link_t);
+
+
+/* @brief   Position in a message's iovs where the last transfer finished
+ */
+struct MsgIovCursor
+{
+  int i;                      // Index of iov
+  off_t base;                 // Offset within the message of the start of iov i
+};
 
 
 /* @brief   Kernel Message
@@ -39,6 +56,16 @@ struct Msg
   msgiov_t *siov;
   int riov_cnt;
   msgiov_t *riov;
+  int priority;               // Sender's priority lent to the server, or -1
+  pid_t lent_tid;             // Server thread the priority is lent to, or INVALID_PID
+  struct Process *sender;     // Process that sent the message, for fair queuing
+  uint32_t vtag;              // Virtual finish tag, pending list is in tag order
+  int qstate;                 // Where the message is queued on the port, see below
+  struct Msg *sender_next;    // Sender's pending messages to the same port, in
+  struct Msg *sender_prev;    // order of arrival, a circular list
+  struct MsgIovCursor siov_cursor;    // Where the last read of siov finished
+  struct MsgIovCursor riov_cursor;    // Where the last write of riov finished
+  struct IPCopyCache ipcopy_cache;    // Page translations of the last transfers
 };
 
 
@@ -57,13 +84,113 @@ struct MsgPort
   pid_t target_tid;
   int target_event;
   void *context;              // For pointer to superblock or other data
+  struct MsgRingSQ *sq;       // Kernel mapping of submission ring, NULL if not in ring mode
+  struct MsgRingCQ *cq;       // Kernel mapping of completion ring
+  void *ring_uaddr;           // Address the rings are mapped at in the server
+  uint32_t vtime;                     // Tag of the last message received
+  struct IPCopyFixed *fixed_bufs;     // Buffers registered by sys_registermsgbufs(), or NULL
 };
 
 
+// Compare virtual tags, allowing for wraparound
+#define VTAG_BEFORE(a, b)   ((int32_t)((a) - (b)) < 0)
+
+
+// Msg.qstate
+#define MSG_QSTATE_NONE       0     // Not queued on a server's port
+#define MSG_QSTATE_PENDING    1     // On the pending list, first of its sender's messages
+#define MSG_QSTATE_QUEUED     2     // Waiting behind an earlier message of its sender
+
+
 // MsgPort.flags
 #define MPF_SHUTDOWN   (1<<0)
 
 
+/* @brief   Submission and completion rings shared with a server
+ *
+ * A message port created with SBF_MSGRING has a submission ring page and a
+ * completion ring page mapped into the server at ring_uaddr and
+ * ring_uaddr + PAGE_SIZE.  See fs/msgring.c.
+ *
+ * The head and tail indices increase freely and are masked with
+ * MSGRING_ENTRIES - 1 to index the entries array.  The kernel advances
+ * sq->tail and cq->head, the server advances sq->head and cq->tail.
+ */
+struct MsgRingSQE
+{
+  msgid_t msgid;
+  iorequest_t req;
+};
+
+struct MsgRingCQE
+{
+  msgid_t msgid;
+  int status;
+  ioreply_t reply;
+};
+
+struct MsgRingSQ
+{
+  volatile uint32_t head;
+  volatile uint32_t tail;
+  volatile uint32_t flags;
+  struct MsgRingSQE entries[];
+};
+
+struct MsgRingCQ
+{
+  volatile uint32_t head;
+  volatile uint32_t tail;
+  volatile uint32_t flags;
+  struct MsgRingCQE entries[];
+};
+
+// MsgRingSQ.flags
+#define MSGRING_SHUTDOWN   (1<<0)
+
+// Number of entries in each ring, must be a power of 2 and fit in a page
+#define MSGRING_ENTRIES    16
+
+
+/* @brief   Asynchronous I/O descriptor
+ *
+ * Holds the kernel's copy of a request started with sys_beginio() so that
+ * the client thread can continue running while the server processes it.
+ * The descriptor's index within asyncio_table is the ioid returned to the
+ * client.  Its message's msgid is offset by max_pid so that it does not
+ * clash with the thread IDs used as msgids by synchronous ksendmsg().
+ */
+struct AsyncIO
+{
+  asyncio_link_t link;        // Global free list, or process's free or busy list
+  struct Process *proc;       // Process that reserved this descriptor
+  int state;
+  int fd;                     // File descriptor the request was started on
+  struct VNode *vnode;
+  struct MsgPort *msgport;    // Server message port the request was sent to
+  struct Msg msg;
+  iorequest_t req;
+  msgiov_t siov[IOV_MAX];
+  msgiov_t riov[IOV_MAX];
+};
+
+// AsyncIO.state
+#define AIO_STATE_FREE    0   // On the global free list
+#define AIO_STATE_IDLE    1   // Reserved by a process with sys_alloc_asyncio()
+#define AIO_STATE_BUSY    2   // Started with sys_beginio(), not yet reaped by sys_waitio()
+
+// Maximum data copied inline by sys_getmsginline() and sys_replymsg()
+#define MSG_INLINE_SZ     512
+
+// sys_waitio() ioid and flags
+#define IOID_ANY          -1
+#define WAITIO_NOWAIT     (1<<0)
+
+// Static table sizes
+#define NR_ASYNCIO              1024
+#define ASYNCIO_MAX_PER_PROC    64
+
+
 // ksendmsg options
 #define KUCOPY    0     // Message is from kernel to user or user to kernel
 #define IPCOPY    1     // Message is from user to user
@@ -76,7 +203,11 @@ struct MsgPort
  * Prototypes
  */ 
 int sys_getmsg(int server_fd, msgid_t *msgid, iorequest_t *req, size_t req_sz);
+int sys_getmsgv(int server_fd, msgid_t *msgids, iorequest_t *reqs, int cnt);
+int sys_getmsginline(int server_fd, msgid_t *msgid, iorequest_t *req, size_t req_sz);
 int sys_replymsg(int server_fd, msgid_t msgid, int status, ioreply_t *reply, size_t rep_sz);
+int sys_replywaitmsg(int server_fd, msgid_t *msgid, int status, ioreply_t *reply,
+                     iorequest_t *req, struct timespec *timeout);
 int sys_readmsg(int server_fd, msgid_t msgid, void *buf, size_t buf_sz, off_t offset);
 int sys_writemsg(int server_fd, msgid_t msgid, void *buf, size_t buf_sz, off_t offset);
 int sys_readmsgiov(int fd, msgid_t msgid, int iov_cnt, msgiov_t *_iov, off_t offset);
@@ -88,24 +219,47 @@ int sys_waitio(int fd, int ioid, int flags);
 int sys_abortio(int fd, int ioid, int flags);
 int sys_alloc_asyncio(int n);
 int sys_free_asyncio(int n);
+int sys_beginread(int fd, void *buf, size_t sz, off64_t *offset);
+int sys_beginwrite(int fd, void *buf, size_t sz, off64_t *offset);
+int sys_getmsgring(int fd, void **ring);
+int sys_waitmsgring(int fd, struct timespec *timeout);
+
+void init_asyncio(struct Process *proc);
+void fini_asyncio(struct Process *proc);
+struct Msg *asyncio_msgid_to_msg(msgid_t msgid);
+
+int init_msgring(struct MsgPort *msgport, struct Process *proc);
+void fini_msgring(struct MsgPort *msgport);
+void msgring_submit(struct MsgPort *msgport);
+int msgring_reap(struct MsgPort *msgport);
 
 int kabortmsg(struct MsgPort *msgport, struct Msg *msg);
 int ksendmsg(struct MsgPort *msgport, int ipc, iorequest_t *req, ioreply_t *reply,
              int siov_cnt, msgiov_t *siov, int riov_cnt, msgiov_t *riov);
 
 int kputmsg(struct MsgPort *msgport, struct Msg *msg);
+int kresendmsg(struct MsgPort *msgport, struct Msg *msg);
 int kreplymsg(struct Msg *msg);
 struct Msg *kgetmsg(struct MsgPort *port);
 struct Msg *kpeekmsg(struct MsgPort *port);
 void kremovemsg(struct MsgPort *msgport, struct Msg *msg);
+bool kmsgpending(struct MsgPort *msgport, struct Msg *msg);
 
 int kwaitport(struct MsgPort *msgport, struct timespec *timeout);
+int kwaitport_handoff(struct MsgPort *msgport, struct timespec *timeout, struct Thread *handoff);
 
 int seekiov(int iov_cnt, msgiov_t *iov, off_t offset, int *ret_i, size_t *ret_remaining, off_t *ret_offset);
+int seekiov_cursor(int iov_cnt, msgiov_t *iov, struct MsgIovCursor *cursor, off_t offset,
+                   int *ret_i, size_t *ret_remaining, off_t *ret_offset);
+void init_msg_cursors(struct Msg *msg);
 
 struct Msg *msgid_to_msg(struct MsgPort *msgport, msgid_t msgid);
+int sys_registermsgbufs(int fd, int iov_cnt, msgiov_t *_iov);
 int init_msgport(struct MsgPort *msgport, pid_t tid, int event);
 int fini_msgport(struct MsgPort *msgport);
+void msgport_lend_priority(struct MsgPort *msgport, struct Msg *msg, int priority);
+void msgport_receive_priority(struct Msg *msg, struct Thread *thread);
+void msgport_return_priority(struct MsgPort *msgport, struct Msg *msg);
 
 
 #endif
@@ -115,8 +115,25 @@ struct Process
   uint64_t privileges_after_exec;   // Privilege bitmap to use after exec.  
 
   futex_list_t futex_list;
+
+  struct MsgPort asyncio_port;        // Reply port of requests started with sys_beginio()
+  asyncio_list_t asyncio_free_list;   // Reserved asyncio descriptors not in use
+  asyncio_list_t asyncio_busy_list;   // Started asyncio descriptors not yet reaped
+  int asyncio_cnt;                    // Number of descriptors reserved by sys_alloc_asyncio()
+
+  int ioprio_class;                   // I/O priority class set by sys_setioprio()
 };
 
+// Process.ioprio_class
+#define IOPRIO_CLASS_RT     1       // Real-time, largest share of a message port
+#define IOPRIO_CLASS_BE     2       // Best-effort, the default
+#define IOPRIO_CLASS_IDLE   3       // Background, smallest share of a message port
+
+// Virtual time increment per message of each I/O priority class
+#define IOPRIO_STEP_RT      1
+#define IOPRIO_STEP_BE      4
+#define IOPRIO_STEP_IDLE    32
+
 
 // thread.state
 
@@ -180,6 +197,9 @@ struct Thread
   int quanta_used;              // number of ticks the process has run without blocking
   int priority;                 // effective priority of process
   int desired_priority;         // default priority of process
+  int inherited_priority;       // priority lent by message senders, or -1
+  uint32_t lent_priority_bitmap;    // Priorities of messages lent to this thread
+  uint16_t lent_priority_cnt[32];   // Number of messages lent at each priority
 
   // TODO: Remove events, use sigsuspend() to temporarilly unmask and wait for signals.
   uint32_t intr_flags;          // Mask of what sources can interrupt TaskSleepInterruptible
@@ -307,6 +327,13 @@ struct Pgrp *get_pgrp(pid_t pgid);
 void remove_from_pgrp(struct Process *proc);
 void remove_from_session(struct Process *proc);
 
+// proc/ioprio.c
+int sys_setioprio(pid_t pid, int ioprio_class);
+int sys_getioprio(pid_t pid);
+uint32_t ioprio_vtime_step(struct Process *proc);
+void fork_ioprio(struct Process *new_proc, struct Process *old_proc);
+void init_ioprio(struct Process *proc);
+
 // proc/privileges.c
 int sys_set_privileges(int when, uint64_t *set, uint64_t *result);
 int check_privileges(struct Process *proc, uint64_t map);
@@ -333,6 +360,8 @@ void SchedUnlock(void);
 void Reschedule(void);
 void SchedReady(struct Thread *thread);
 void SchedUnready(struct Thread *thread);
+void SchedHandoff(struct Thread *next);
+void SchedInheritPriority(struct Thread *thread, int priority);
 int init_schedparams(struct Thread *thread, int policy, int priority);
 int dup_schedparams(struct Thread *thread, struct Thread *old_thread);
 
@@ -340,6 +369,8 @@ int dup_schedparams(struct Thread *thread, struct Thread *old_thread);
 void InitRendez(struct Rendez *rendez);
 void TaskSleep(struct Rendez *rendez);
 int TaskSleepInterruptible(struct Rendez *rendez, struct timespec *ts, uint32_t intr_flags);
+int TaskSleepHandoff(struct Rendez *rendez, struct Thread *target, struct timespec *ts,
+                     uint32_t intr_flags);
 void TaskWakeup(struct Rendez *rendez);
 void TaskWakeupAll(struct Rendez *rendez);
 void TaskWakeupSpecific(struct Thread *thread, uint32_t intr_reason);
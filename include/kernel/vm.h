@@ -36,6 +36,79 @@ DLIST_TYPE(MemRegion, memregion_list_t, memregion_link_t);
 #define MR_TYPE_FREE          1
 #define MR_TYPE_ALLOC         2
 #define MR_TYPE_PHYS          3
+#define MR_TYPE_FILE_PRIVATE  4     // File mapped with MAP_PRIVATE, copy-on-write
+#define MR_TYPE_FILE_SHARED   5     // File mapped with MAP_SHARED, written back
+
+
+// Minimum page-aligned ipcopy() size at which whole pages are shared
+// copy-on-write with the receiver instead of being copied.
+#define IPCOPY_LEND_THRESHOLD (16 * 1024)
+
+// Number of page translations remembered by an IPCopyCache
+#define IPCOPY_CACHE_ENTRIES  4
+
+
+/* @brief   Page translation remembered by ipcopy() between calls
+ *
+ * An entry is only valid while the generation of the address space's pmap
+ * is unchanged, any pmap_remove() or pmap_protect() invalidates it.
+ */
+struct IPCopyXlat
+{
+  struct AddressSpace *as;
+  vm_addr vaddr;              // Page-aligned user address, 0 if unused
+  uint32_t access;            // PROT_READ or PROT_WRITE access that was resolved
+  uint32_t generation;        // Pmap generation at the time of the translation
+  void *kaddr;                // Kernel address of the page
+};
+
+
+/* @brief   Translations of a message's source and destination pages
+ */
+struct IPCopyCache
+{
+  int next;                   // Entry to replace next
+  struct IPCopyXlat xlat[IPCOPY_CACHE_ENTRIES];
+  struct IPCopyFixed *fixed;  // Fixed buffers of the server, or NULL
+};
+
+
+// Maximum number of fixed buffers, and of their pages, a server can register
+#define IPCOPY_FIXED_BUFS     8
+#define IPCOPY_FIXED_PAGES    960
+
+
+/* @brief   A buffer registered by a server with sys_registermsgbufs()
+ */
+struct IPCopyFixedBuf
+{
+  vm_addr base;               // Page-aligned start of the buffer
+  vm_addr ceiling;            // Page-aligned end of the buffer
+  int page_idx;               // Index of the buffer's first page in kaddr
+};
+
+
+/* @brief   Pre-resolved pages of a server's fixed buffers
+ *
+ * Occupies a single kernel page.  The kernel addresses of the pages are
+ * resolved for write access when registered, so copies to or from a fixed
+ * buffer do not walk the server's page tables or check for copy-on-write.
+ * If the server's pmap generation changes, the pages are resolved again
+ * on next use.
+ *
+ * Reference counted, as a copy may sleep on a page fault while the server
+ * registers new buffers or its message port is destroyed.
+ */
+struct IPCopyFixed
+{
+  int reference_cnt;          // Held by the message port and by copies in progress
+  struct AddressSpace *as;
+  uint32_t generation;        // Pmap generation the kaddr entries are valid for
+  int buf_cnt;
+  int page_cnt;
+  struct IPCopyFixedBuf buf[IPCOPY_FIXED_BUFS];
+  void *kaddr[IPCOPY_FIXED_PAGES];    // Kernel addresses of pages, NULL if not resolved
+};
 
 
 /* @brief   Structure representing an area of a process's address space
@@ -54,6 +127,9 @@ struct MemRegion
 	uint32_t type;
 	uint32_t flags;
 	vm_addr phys_base_addr;
+
+	struct VNode *vnode;        // File of MR_TYPE_FILE_* regions, pages faulted in lazily
+	off64_t file_offset;        // Offset within the file of base_addr
 };
 
 
@@ -80,14 +156,16 @@ struct Page
                                   // The above lists, active, laundered, dirty and strategy
                                   // are on the hashed lookup link.
   
-  page_link_t vnode_link;         // All pages in cache belonging to vnode
+  struct Page *tree_parent;       // Vnode's tree of cached pages, see fs/pagetree.c
+  struct Page *tree_left;
+  struct Page *tree_right;
+  int tree_height;
   page_link_t superblock_link;    // All pages belonging to the SuperBlock
 
   page_link_t tmp_link;           // Link on temporary list of pages
   
-  
-  // uint64_t expiration_ticks;   // Could be sent to filesystem driver as to how long it
-                                  // should delay writing block out to disk.
+  page_link_t dirty_link;         // Vnode's list of delayed-write pages
+  uint64_t expiration_ticks;      // Time after which bdflush writes a dirty page to disk
 
   int reference_cnt;              // Number of references to this page.
     
@@ -102,11 +180,12 @@ struct Page
 #define PGF_KERNEL      (1 << 3)
 #define PGF_USER        (1 << 4)
 #define PGF_PAGETABLE   (1 << 5)
+#define PGF_SHARED      (1 << 6)   // Mappings share the page, never copy-on-write
 
 
 //#define B_READAHEAD (1 << 8)  // Hint to FS Handler to read additional blocks after this block has been read.
 
-//#define B_ERASED    (1 << 1)  // Block is zero filled.
+#define B_ERASED    (1 << 1)  // Block is zero filled, on the zero page queue when free
 #define B_VALID     (1 << 2)  // Valid, on lookup hash list
 #define B_BUSY      (1 << 3)
 
@@ -114,9 +193,18 @@ struct Page
 #define B_DISCARD   (1 << 5)
 
 #define B_DIRTY     (1 << 10)
+#define B_AM        (1 << 11)  // Block is on, or returns to, the frequently used am queue
+#define B_MAPPED    (1 << 12)  // Block is mapped into user space, kept off the queues
+#define B_QUEUED    (1 << 13)  // Busy block left in place on the a1in queue
 
 #define PAGE_LOOKUP_HASH_SZ   1024
 
+#define ZERO_POOL_MAX_PAGES         256   // Pages kept zero filled by the zero page task
+#define ZERO_POOL_LOW_PAGES         64    // Wake the zero page task below this many pages
+#define ZERO_POOL_BATCH_PAGES       16    // Pages cleared before the zero page task sleeps
+#define ZERO_POOL_INTERVAL_TICKS    100   // Interval in ticks between checks of the pool
+#define SCHED_PRIO_ZERO_PAGES       1     // SCHED_OTHER priority of the zero page task
+
 
 
 /*
@@ -151,7 +239,12 @@ int bounds_check_kernel(void *addr, size_t sz);
 
 // vm/ipcopy.c
 ssize_t ipcopy(struct AddressSpace *dst_as, struct AddressSpace *src_as,
-               void *dvaddr, void *svaddr, size_t sz);
+               void *dvaddr, void *svaddr, size_t sz, struct IPCopyCache *cache);
+void init_ipcopy_cache(struct IPCopyCache *cache);
+void init_ipcopy_fixed(struct IPCopyFixed *fixed, struct AddressSpace *as);
+int ipcopy_add_fixed(struct IPCopyFixed *fixed, void *addr, size_t sz);
+struct IPCopyFixed *ipcopy_fixed_get(struct IPCopyFixed *fixed);
+void ipcopy_fixed_put(struct IPCopyFixed *fixed);
 
 // vm/memregion.c
 struct MemRegion *memregion_find_free(struct AddressSpace *as, vm_addr addr);
@@ -172,8 +265,13 @@ struct Page *alloc_page(void);
 void free_page(struct Page *page);
 int ref_page(struct Page *page);
 
+// vm/zeropage.c
+void check_zero_page_low(void);
+void zero_page_task(void *arg);
+
 // vm/pagefault.c
 int page_fault(vm_addr addr, bits32_t access);
+int do_page_fault(struct AddressSpace *as, vm_addr addr, bits32_t access);
 
 // vm/vm.c
 void *sys_mmap(void *_addr, size_t len, int prot, int flags, int fd, off_t offset);
@@ -191,8 +289,11 @@ void pmap_destroy(struct AddressSpace *as);
 int pmap_supports_cache_policy(bits32_t flags);
 int pmap_enter(struct AddressSpace *as, vm_addr addr, vm_addr paddr, int flags);
 int pmap_remove(struct AddressSpace *as, vm_addr addr);
+int pmap_replace(struct AddressSpace *as, vm_addr addr, vm_addr paddr, int flags);
 int pmap_protect(struct AddressSpace *as, vm_addr addr, int flags);
 int pmap_extract(struct AddressSpace *as, vm_addr va, vm_addr *pa, uint32_t *flags);
+void pmap_page_clear_write(struct Page *page);
+uint32_t pmap_get_generation(struct AddressSpace *as);
 
 // Could merge into PmapExtract, return a status flag, with -1 for no pte, -2
 // for no pde etc.
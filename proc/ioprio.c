@@ -0,0 +1,142 @@
+/*
+ * Copyright 2014  Marven Gilhespie
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * --
+ * I/O priority classes of processes.
+ *
+ * A process's I/O class determines the share of a message port's service that
+ * its messages receive relative to other senders. See kputmsg() for how the
+ * pending messages of a port are ordered.
+ */
+
+#include <kernel/dbg.h>
+#include <kernel/error.h>
+#include <kernel/globals.h>
+#include <kernel/proc.h>
+#include <kernel/types.h>
+#include <sys/privileges.h>
+
+KLOG_REGISTER(LOG_PROC_IOPRIO)
+
+
+/* @brief   Set the I/O priority class of a process
+ *
+ * @param   pid, process ID of the process to change, or 0 for the current process
+ * @param   ioprio_class, IOPRIO_CLASS_RT, IOPRIO_CLASS_BE or IOPRIO_CLASS_IDLE
+ * @return  0 on success, negative errno on failure
+ *
+ * Changing another process or selecting the real-time class requires the
+ * PRIV_SCHED privilege. The new class applies to messages sent afterwards.
+ */
+int sys_setioprio(pid_t pid, int ioprio_class)
+{
+  struct Process *current;
+  struct Process *proc;
+  
+  klog_info("sys_setioprio(pid:%d, class:%d)", pid, ioprio_class);
+  
+  current = get_current_process();
+
+  if (ioprio_class != IOPRIO_CLASS_RT && ioprio_class != IOPRIO_CLASS_BE
+      && ioprio_class != IOPRIO_CLASS_IDLE) {
+    return -EINVAL;
+  }
+
+  if (pid == 0 || pid == current->pid) {
+    proc = current;
+  } else {
+    proc = get_process(pid);
+  }
+  
+  if (proc == NULL) {
+    return -ESRCH;
+  }
+  
+  if (proc != current || ioprio_class == IOPRIO_CLASS_RT) {
+    if (check_privileges(current, PRIV_SCHED) != 0) {
+      return -EPERM;
+    }
+  }
+  
+  proc->ioprio_class = ioprio_class;
+  return 0;
+}
+
+
+/* @brief   Get the I/O priority class of a process
+ *
+ * @param   pid, process ID of the process, or 0 for the current process
+ * @return  I/O priority class on success, negative errno on failure
+ */
+int sys_getioprio(pid_t pid)
+{
+  struct Process *proc;
+  
+  if (pid == 0) {
+    proc = get_current_process();
+  } else {
+    proc = get_process(pid);
+  }
+  
+  if (proc == NULL) {
+    return -ESRCH;
+  }
+  
+  return proc->ioprio_class;
+}
+
+
+/* @brief   Get the amount a message advances its sender's virtual time by
+ *
+ * @param   proc, process sending the message
+ * @return  virtual time increment, smaller for classes with a larger share
+ *
+ * A sender in a class with a step of 1 has 4 messages served for every
+ * message of a sender with a step of 4 when both are busy.
+ */
+uint32_t ioprio_vtime_step(struct Process *proc)
+{
+  if (proc == NULL) {
+    return IOPRIO_STEP_BE;
+  }
+  
+  switch (proc->ioprio_class) {
+    case IOPRIO_CLASS_RT:
+      return IOPRIO_STEP_RT;
+    case IOPRIO_CLASS_IDLE:
+      return IOPRIO_STEP_IDLE;
+    default:
+      return IOPRIO_STEP_BE;
+  }
+}
+
+
+/*
+ *
+ */
+void fork_ioprio(struct Process *new_proc, struct Process *old_proc)
+{
+  new_proc->ioprio_class = old_proc->ioprio_class;
+}
+
+
+/*
+ *
+ */
+void init_ioprio(struct Process *proc)
+{
+  proc->ioprio_class = IOPRIO_CLASS_BE;
+}
+
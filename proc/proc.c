@@ -69,6 +69,7 @@ int sys_fork(void)
   fork_fds(new_proc, current_proc);       // FIXME: Need to check error code, can fail if fd_table alloc fails
   fork_signals(new_proc, current_proc);  
   fork_privileges(new_proc, current_proc);
+  fork_ioprio(new_proc, current_proc);
 
   new_thread = fork_thread(new_proc, current_proc, current_thread);
 
@@ -110,6 +111,7 @@ void sys_exit(int status)
 
     do_kill_other_threads_and_wait(current, current_thread);
 
+    fini_asyncio(current);
     fini_futexes(current);
     fini_fproc(current);
     fini_session_pgrp(current);
@@ -343,6 +345,7 @@ struct Process *do_create_process(void (*entry)(void *), void *arg, int policy,
   init_fproc(new_proc);   // FIXME: Need to check error code, fproc could fail to alloc
   init_signals(new_proc);
   init_privileges(new_proc);
+  init_ioprio(new_proc);
   
   thread = do_create_thread(new_proc, entry, NULL, arg, 
                             SCHED_RR, 16, 
@@ -414,7 +417,9 @@ struct Process *alloc_process(struct Process *parent, uint32_t flags, char *name
   DLIST_INIT(&proc->unmasked_signal_thread_list);
 
   DLIST_INIT(&proc->futex_list);
-    
+
+  init_asyncio(proc);
+      
   return proc;
 }
 
@@ -24,10 +24,15 @@
 #include <kernel/proc.h>
 #include <kernel/types.h>
 #include <kernel/arch.h>
+#include <string.h>
 
 KLOG_REGISTER(LOG_PROC_SCHED)
 
 
+// Static prototypes
+static void SwitchToThread(struct Thread *next);
+
+
 /* @brief   Perform a task switch
  *
  * Currently implements round-robin scheduling and a niceness scheduler.
@@ -69,9 +74,7 @@ KLOG_REGISTER(LOG_PROC_SCHED)
  */
 void Reschedule(void)
 {
-  context_word_t context[N_CONTEXT_WORD];
   struct Thread *current, *next;
-  struct Process *current_proc, *next_proc;
   struct CPU *cpu;
   int q;
 
@@ -90,7 +93,7 @@ void Reschedule(void)
       }
     } else if (current->sched_policy == SCHED_OTHER) {
       if (current->quanta_used == SCHED_QUANTA_JIFFIES) {      
-        if (current->priority > 1) {
+        if (current->priority > 1 && current->priority > current->inherited_priority) {
           CIRCLEQ_REM_HEAD(&sched_queue[current->priority], sched_entry);              
           current->priority--;
           CIRCLEQ_ADD_TAIL(&sched_queue[current->priority], current, sched_entry);        
@@ -117,6 +120,61 @@ void Reschedule(void)
     next = cpu->idle_thread;
   }
 
+  SwitchToThread(next);
+}
+
+
+/* @brief   Hand the CPU directly to a thread that has just been made ready
+ *
+ * @param   next, thread to run, must already be on its ready queue
+ *
+ * Used for direct handoff between client and server threads during
+ * synchronous message passing, bypassing the ready queue scan and quanta
+ * accounting of Reschedule().  If a thread of higher priority than next is
+ * ready then Reschedule() is called instead so that priorities are still
+ * honoured.  The next thread is made the head of its ready queue as
+ * Reschedule() expects of the running thread.
+ */
+void SchedHandoff(struct Thread *next)
+{
+  uint32_t higher_mask;
+  
+  if (next->sched_policy == SCHED_IDLE) {
+    Reschedule();
+    return;
+  }
+  
+  higher_mask = ~((2U << next->priority) - 1);
+  
+  if ((sched_queue_bitmap & higher_mask) != 0) {
+    Reschedule();
+    return;
+  }
+  
+  CIRCLEQ_SET_HEAD(&sched_queue[next->priority], next);
+  next->quanta_used = 0;
+  
+  SwitchToThread(next);
+}
+
+
+/* @brief   Switch the CPU's register context and address space to another thread
+ *
+ * @param   next, thread to switch to
+ *
+ * See Reschedule() for a description of how SetContext() and GetContext()
+ * perform the switch.
+ */
+static void SwitchToThread(struct Thread *next)
+{
+  context_word_t context[N_CONTEXT_WORD];
+  struct Thread *current;
+  struct Process *current_proc, *next_proc;
+  struct CPU *cpu;
+
+  cpu = get_cpu();
+  current = get_current_thread();
+
   if (next != NULL) {
     next->state = THREAD_STATE_RUNNING;
     
@@ -197,7 +255,8 @@ void SchedUnready(struct Thread *thread)
       sched_queue_bitmap &= ~(1 << thread->priority);
     }
 
-    thread->priority = thread->desired_priority;
+    thread->priority = (thread->inherited_priority > thread->desired_priority) ?
+                        thread->inherited_priority : thread->desired_priority;
     thread->quanta_used = 0;
   } else if (thread->sched_policy == SCHED_IDLE) {
     // Ignore IDLE sched policy, it's never placed in a sched queue
@@ -208,6 +267,64 @@ void SchedUnready(struct Thread *thread)
 }
 
 
+/* @brief   Lend a priority to a thread or remove a previously lent priority
+ *
+ * @param   thread, thread to change the inherited priority of
+ * @param   priority, priority to lend, or -1 to remove the inherited priority
+ *
+ * Used for priority inheritance when a server thread is processing messages
+ * from higher priority clients, see msgport_lend_priority(). The effective
+ * priority of the thread becomes the higher of its desired priority and its
+ * inherited priority. If the thread is on a ready queue it is moved to the
+ * queue of its new priority.
+ */
+void SchedInheritPriority(struct Thread *thread, int priority)
+{
+  int new_priority;
+  thread_circleq_t *queue;
+  int_state_t int_state;
+  
+  if (thread->sched_policy == SCHED_IDLE) {
+    return;
+  }
+  
+  thread->inherited_priority = priority;
+  
+  new_priority = (priority > thread->desired_priority) ? priority : thread->desired_priority;
+  
+  if (new_priority == thread->priority) {
+    return;
+  }
+  
+  int_state = DisableInterrupts();
+
+  if (thread->state == THREAD_STATE_READY || thread->state == THREAD_STATE_RUNNING) {
+    queue = &sched_queue[thread->priority];
+    CIRCLEQ_REM_ENTRY(queue, thread, sched_entry);
+
+    if (CIRCLEQ_HEAD(queue) == NULL) {
+      sched_queue_bitmap &= ~(1 << thread->priority);
+    }
+
+    thread->priority = new_priority;
+    queue = &sched_queue[thread->priority];
+    
+    // Reschedule() expects the running thread to be at the head of its queue
+    if (thread->state == THREAD_STATE_RUNNING) {
+      CIRCLEQ_ADD_HEAD(queue, thread, sched_entry);
+    } else {
+      CIRCLEQ_ADD_TAIL(queue, thread, sched_entry);
+    }
+    
+    sched_queue_bitmap |= (1 << thread->priority);
+  } else {
+    thread->priority = new_priority;
+  }
+  
+  RestoreInterrupts(int_state);
+}
+
+
 /* @brief   Helper function to initially schedule a thread
  * 
  */
@@ -293,6 +410,9 @@ int init_schedparams(struct Thread *thread, int policy, int priority)
     kernelpanic();
   }
   
+  thread->inherited_priority = -1;
+  thread->lent_priority_bitmap = 0;
+  memset(thread->lent_priority_cnt, 0, sizeof thread->lent_priority_cnt);
   return 0;
 }
 
@@ -306,6 +426,9 @@ int dup_schedparams(struct Thread *thread, struct Thread *old_thread)
   thread->sched_policy = old_thread->sched_policy;
   thread->priority = old_thread->priority;
   thread->desired_priority = old_thread->desired_priority;
+  thread->inherited_priority = -1;
+  thread->lent_priority_bitmap = 0;
+  memset(thread->lent_priority_cnt, 0, sizeof thread->lent_priority_cnt);
   return 0;
 }
 
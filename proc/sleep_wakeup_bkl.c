@@ -178,6 +178,31 @@ void TaskSleep(struct Rendez *rendez)
  * TODO: Merge TaskSleepInterruptible, allow timeout to be optional
  */
 int TaskSleepInterruptible(struct Rendez *rendez, struct timespec *ts, uint32_t intr_flags)
+{
+  return TaskSleepHandoff(rendez, NULL, ts, intr_flags);
+}
+
+
+/* @brief   Sleep on a Rendez condition variable, handing the CPU to another thread
+ *
+ * @param   rendez, condition variable to sleep on
+ * @param   target, thread to switch to directly, or NULL
+ * @param   ts, timeout to wake up after if the rendez was not signalled
+ * @param   intr_flags, sources that can interrupt the sleep
+ * @return  0 on success
+ *          -EINTR if an event or signal is pending
+ *          -ETIMEDOUT if a timeout occured
+ *          other negative errno on failure
+ *
+ * If target has been woken and is waiting for the Big Kernel Lock then the
+ * lock is passed to it ahead of any other waiting threads and the CPU is
+ * switched to it with SchedHandoff().  This is the fast path for synchronous
+ * message passing, where a client hands off to the server it has just sent
+ * a message to and the server hands back to the client it has replied to.
+ * Otherwise this behaves the same as TaskSleepInterruptible().
+ */
+int TaskSleepHandoff(struct Rendez *rendez, struct Thread *target, struct timespec *ts,
+                     uint32_t intr_flags)
 {
   struct Thread *thread;
   struct Thread *current;
@@ -198,10 +223,19 @@ int TaskSleepInterruptible(struct Rendez *rendez, struct timespec *ts, uint32_t
     return -EINTR;
   }
 
-  thread = DLIST_HEAD(&bkl_blocked_list);
+  if (target != NULL && target->state == THREAD_STATE_BKL_BLOCKED) {
+    DLIST_REM_ENTRY(&bkl_blocked_list, target, blocked_link);
+    thread = target;
+  } else {
+    target = NULL;
+    thread = DLIST_HEAD(&bkl_blocked_list);
+    
+    if (thread != NULL) {
+      DLIST_REM_HEAD(&bkl_blocked_list, blocked_link);
+    }
+  }
 
   if (thread != NULL) {
-    DLIST_REM_HEAD(&bkl_blocked_list, blocked_link);
     thread->state = THREAD_STATE_READY;
     bkl_owner = thread;
     SchedReady(thread);
@@ -228,7 +262,12 @@ int TaskSleepInterruptible(struct Rendez *rendez, struct timespec *ts, uint32_t
   current->blocking_rendez = rendez;
   SchedUnready(current);
 
-  Reschedule();     // Interrupts will be enabled then disabled again once this returns
+  // Interrupts will be enabled then disabled again once this returns
+  if (target != NULL) {
+    SchedHandoff(target);
+  } else {
+    Reschedule();
+  }
 
   current->intr_flags = 0;
 
@@ -58,7 +58,8 @@ int sys_thread_setschedparams(int policy, int priority)
     SchedUnready(current);
     current->sched_policy = policy;
     current->desired_priority = priority;
-    current->priority = priority;
+    current->priority = (current->inherited_priority > priority) ?
+                         current->inherited_priority : priority;
     SchedReady(current);
     Reschedule();
     RestoreInterrupts(int_state);
@@ -74,7 +75,8 @@ int sys_thread_setschedparams(int policy, int priority)
     SchedUnready(current);
     current->sched_policy = policy;
     current->desired_priority = priority;
-    current->priority = priority;
+    current->priority = (current->inherited_priority > priority) ?
+                         current->inherited_priority : priority;
     SchedReady(current);
     Reschedule();
     RestoreInterrupts(int_state);
@@ -104,7 +104,25 @@ int fork_address_space(struct AddressSpace *new_as, struct AddressSpace *old_as)
         goto cleanup;
       }
            
-      if ((flags & MAP_PHYS) != MAP_PHYS && (flags & PROT_WRITE)) {
+      if ((flags & MAP_PHYS) != MAP_PHYS && (pmap_pa_to_page(pa)->bflags & B_MAPPED)) {
+        // File cache block, shared or copy-on-write as set by the page fault
+        if (pmap_enter(new_as, va, pa, flags) != 0) {
+          goto cleanup;
+        }
+
+        page = pmap_pa_to_page(pa);
+        page->reference_cnt++;
+
+      } else if ((flags & MAP_PHYS) != MAP_PHYS && (pmap_pa_to_page(pa)->mflags & PGF_SHARED)) {
+        // Page shared with the kernel, such as a message port ring
+        if (pmap_enter(new_as, va, pa, flags) != 0) {
+          goto cleanup;
+        }
+
+        page = pmap_pa_to_page(pa);
+        page->reference_cnt++;
+
+      } else if ((flags & MAP_PHYS) != MAP_PHYS && (flags & PROT_WRITE)) {
         // Read-Write mapping, Mark page in both as COW and read-only;
         flags |= MAP_COW;
      
@@ -191,11 +209,7 @@ int cleanup_address_space(struct AddressSpace *as)
       }
 
       page = pmap_pa_to_page(pa);
-      page->reference_cnt--;
-
-      if (page->reference_cnt == 0) {
-        free_page(page);
-      }
+      free_page(page);
     }
   }
 
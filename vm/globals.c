@@ -34,6 +34,7 @@ struct Page *page_table;
 int free_page_cnt;
 int dirty_page_cnt;
 int busy_page_cnt;
+int anon_page_cnt;
 
 //bool dirty_queues_busy;
 //struct Rendez dirty_queues_rendez;
@@ -41,6 +42,17 @@ int busy_page_cnt;
 //struct RWLock cache_lock;
 
 page_list_t free_page_queue;        // Pages that are clean and can be reused by other vnodes
+page_list_t cache_a1in_queue;       // Clean cached blocks used once since being read
+page_list_t cache_am_queue;         // Clean cached blocks used frequently, LRU order
+page_list_t zero_page_queue;        // Free pages that have been zero filled
+
+int cache_page_cnt;
+int cache_a1in_cnt;
+int cache_am_cnt;
+int zero_page_cnt;
+
+struct Rendez zero_page_rendez;
+struct Thread *zero_page_thread;
 
 page_list_t page_lookup_hash[PAGE_LOOKUP_HASH_SZ];
 
@@ -29,6 +29,17 @@
 #include <string.h>
 #include <sys/mman.h>
 
+KLOG_REGISTER(LOG_VM_IPCOPY)
+
+
+// Static prototypes
+static int ipcopy_lend_page(struct AddressSpace *dst_as, struct AddressSpace *src_as,
+                            vm_addr dvaddr, vm_addr svaddr);
+static int ipcopy_translate(struct AddressSpace *as, uint32_t access, void *vaddr,
+                            void **rkaddr, struct IPCopyCache *cache);
+static bool ipcopy_translate_fixed(struct IPCopyFixed *fixed, struct AddressSpace *as,
+                                   void *vaddr, void **rkaddr);
+
 
 /* @brief   Interprocess memory copy
  *
@@ -37,10 +48,17 @@
  * @param   dvaddr, dsetination pointer in user-space
  * @param   svaddr, source pointer in user space
  * @param   sz, size of buffer to copy
+ * @param   cache, optional cache of page translations kept between calls, or NULL
  * @return  0 on success, negative errno on error
+ *
+ * If both buffers are page-aligned and the transfer is at least
+ * IPCOPY_LEND_THRESHOLD bytes then whole pages are lent to the destination
+ * by mapping the source pages copy-on-write into both address spaces rather
+ * than copying them. Any trailing partial page, or a page that cannot be
+ * shared, is copied as normal.
  */
 ssize_t ipcopy(struct AddressSpace *dst_as, struct AddressSpace *src_as,
-               void *dvaddr, void *svaddr, size_t sz)
+               void *dvaddr, void *svaddr, size_t sz, struct IPCopyCache *cache)
 {
   ssize_t remaining;
   int sc;
@@ -56,16 +74,29 @@ ssize_t ipcopy(struct AddressSpace *dst_as, struct AddressSpace *src_as,
       || (vm_addr)svaddr >= VM_USER_CEILING || VM_USER_CEILING - (vm_addr)svaddr < sz) {
     return -EFAULT;
   }
+
+  if (sz >= IPCOPY_LEND_THRESHOLD
+      && ((vm_addr)dvaddr % PAGE_SIZE) == 0 && ((vm_addr)svaddr % PAGE_SIZE) == 0) {
+    while (remaining >= PAGE_SIZE) {
+      if (ipcopy_lend_page(dst_as, src_as, (vm_addr)dvaddr, (vm_addr)svaddr) != 0) {
+        break;
+      }
+      
+      svaddr += PAGE_SIZE;
+      dvaddr += PAGE_SIZE;
+      remaining -= PAGE_SIZE;
+    }
+  }
   
 	while(remaining > 0) {
 	  if (src_page_remaining == 0) {
-	    if ((sc = pmap_pagetable_walk(src_as, PROT_READ, svaddr, &skaddr)) != 0) {
+	    if ((sc = ipcopy_translate(src_as, PROT_READ, svaddr, &skaddr, cache)) != 0) {
 			  return sc;
 		  }
     }
     
     if (dst_page_remaining == 0) {
-		  if ((sc = pmap_pagetable_walk(dst_as, PROT_WRITE, dvaddr, &dkaddr)) != 0) {
+		  if ((sc = ipcopy_translate(dst_as, PROT_WRITE, dvaddr, &dkaddr, cache)) != 0) {
 		    return sc;
       }
     }
@@ -102,3 +133,316 @@ ssize_t ipcopy(struct AddressSpace *dst_as, struct AddressSpace *src_as,
 }
 
 
+/* @brief   Clear a cache of ipcopy() page translations
+ *
+ * @param   cache, cache to initialize
+ */
+void init_ipcopy_cache(struct IPCopyCache *cache)
+{
+  memset(cache, 0, sizeof *cache);
+}
+
+
+/* @brief   Translate a user address to a kernel address for ipcopy()
+ *
+ * @param   as, address space of the user address
+ * @param   access, PROT_READ or PROT_WRITE
+ * @param   vaddr, user address to translate
+ * @param   rkaddr, location to store the kernel address of vaddr
+ * @param   cache, optional cache of earlier translations, or NULL
+ * @return  0 on success, negative errno on error
+ *
+ * A server reading or writing a large message in several calls usually
+ * resumes within the page the previous call finished in. Translations are
+ * remembered in the message's cache, tagged with the pmap generation, so
+ * that such pages are not walked and checked for copy-on-write again.
+ */
+static int ipcopy_translate(struct AddressSpace *as, uint32_t access, void *vaddr,
+                            void **rkaddr, struct IPCopyCache *cache)
+{
+  struct IPCopyXlat *xlat;
+  vm_addr bvaddr;
+  int sc;
+  int t;
+  
+  if (cache == NULL) {
+    return pmap_pagetable_walk(as, access, vaddr, rkaddr);
+  }
+  
+  if (cache->fixed != NULL && ipcopy_translate_fixed(cache->fixed, as, vaddr, rkaddr)) {
+    return 0;
+  }
+  
+  bvaddr = ALIGN_DOWN((vm_addr)vaddr, PAGE_SIZE);
+  
+  for (t = 0; t < IPCOPY_CACHE_ENTRIES; t++) {
+    xlat = &cache->xlat[t];
+    
+    if (xlat->as == as && xlat->vaddr == bvaddr && (xlat->access & access) == access
+        && xlat->generation == pmap_get_generation(as)) {
+      *rkaddr = xlat->kaddr + ((vm_addr)vaddr - bvaddr);
+      return 0;
+    }
+  }
+  
+  if ((sc = pmap_pagetable_walk(as, access, vaddr, rkaddr)) != 0) {
+    return sc;
+  }
+
+  // Generation is read after the walk, as a copy-on-write fault changes it
+  xlat = &cache->xlat[cache->next];
+  cache->next = (cache->next + 1) % IPCOPY_CACHE_ENTRIES;
+  
+  xlat->as = as;
+  xlat->vaddr = bvaddr;
+  xlat->access = (access & PROT_WRITE) ? (PROT_READ | PROT_WRITE) : access;
+  xlat->generation = pmap_get_generation(as);
+  xlat->kaddr = *rkaddr - ((vm_addr)vaddr - bvaddr);
+  return 0;
+}
+
+
+/* @brief   Translate an address within a server's fixed buffers
+ *
+ * @param   fixed, fixed buffers registered by the server
+ * @param   as, address space of the user address
+ * @param   vaddr, user address to translate
+ * @param   rkaddr, location to store the kernel address of vaddr
+ * @return  true if vaddr is within a fixed buffer and could be resolved
+ *
+ * Fixed buffer pages are resolved for write access, so they satisfy both
+ * read and write copies.
+ */
+static bool ipcopy_translate_fixed(struct IPCopyFixed *fixed, struct AddressSpace *as,
+                                   void *vaddr, void **rkaddr)
+{
+  struct IPCopyFixedBuf *buf;
+  vm_addr bvaddr;
+  void *kaddr;
+  int idx;
+  int t;
+  
+  if (fixed->as != as) {
+    return false;
+  }
+  
+  bvaddr = ALIGN_DOWN((vm_addr)vaddr, PAGE_SIZE);
+  
+  for (t = 0; t < fixed->buf_cnt; t++) {
+    buf = &fixed->buf[t];
+    
+    if (bvaddr >= buf->base && bvaddr < buf->ceiling) {
+      break;
+    }
+  }
+
+  if (t == fixed->buf_cnt) {
+    return false;
+  }
+
+  if (fixed->generation != pmap_get_generation(as)) {
+    memset(fixed->kaddr, 0, sizeof fixed->kaddr);
+    fixed->generation = pmap_get_generation(as);
+  }
+  
+  idx = buf->page_idx + (bvaddr - buf->base) / PAGE_SIZE;
+  
+  if (fixed->kaddr[idx] == NULL) {
+    if (pmap_pagetable_walk(as, PROT_WRITE, (void *)bvaddr, &kaddr) != 0) {
+      return false;
+    }
+    
+    // A copy-on-write fault during the walk changes the generation
+    if (fixed->generation != pmap_get_generation(as)) {
+      memset(fixed->kaddr, 0, sizeof fixed->kaddr);
+      fixed->generation = pmap_get_generation(as);
+    }
+    
+    fixed->kaddr[idx] = kaddr;
+  }
+  
+  *rkaddr = fixed->kaddr[idx] + ((vm_addr)vaddr - bvaddr);
+  return true;
+}
+
+
+/* @brief   Initialize an empty set of fixed buffers
+ *
+ * @param   fixed, fixed buffers to initialize
+ * @param   as, address space of the server the buffers belong to
+ */
+void init_ipcopy_fixed(struct IPCopyFixed *fixed, struct AddressSpace *as)
+{
+  kassert(sizeof *fixed <= PAGE_SIZE);
+  
+  memset(fixed, 0, sizeof *fixed);
+  fixed->reference_cnt = 1;
+  fixed->as = as;
+  fixed->generation = pmap_get_generation(as);
+}
+
+
+/* @brief   Register a fixed buffer and resolve its pages
+ *
+ * @param   fixed, fixed buffers to add to
+ * @param   addr, user address of the buffer
+ * @param   sz, size of the buffer
+ * @return  index of the buffer on success, negative errno on failure
+ *
+ * The pages are resolved for write access, breaking any copy-on-write
+ * sharing now rather than during a later copy.
+ */
+int ipcopy_add_fixed(struct IPCopyFixed *fixed, void *addr, size_t sz)
+{
+  struct IPCopyFixedBuf *buf;
+  vm_addr base;
+  vm_addr ceiling;
+  vm_addr va;
+  int page_cnt;
+  int idx;
+  
+  if (sz == 0 || (vm_addr)addr >= VM_USER_CEILING || VM_USER_CEILING - (vm_addr)addr < sz) {
+    return -EFAULT;
+  }
+
+  base = ALIGN_DOWN((vm_addr)addr, PAGE_SIZE);
+  ceiling = ALIGN_UP((vm_addr)addr + sz, PAGE_SIZE);
+  page_cnt = (ceiling - base) / PAGE_SIZE;
+
+  if (fixed->buf_cnt >= IPCOPY_FIXED_BUFS || fixed->page_cnt + page_cnt > IPCOPY_FIXED_PAGES) {
+    return -ENOMEM;
+  }
+
+  idx = fixed->page_cnt;
+  
+  for (va = base; va < ceiling; va += PAGE_SIZE, idx++) {
+    if (pmap_pagetable_walk(fixed->as, PROT_WRITE, (void *)va, &fixed->kaddr[idx]) != 0) {
+      memset(&fixed->kaddr[fixed->page_cnt], 0, page_cnt * sizeof (void *));
+      return -EFAULT;
+    }
+  }
+
+  // Faults while resolving may have changed the generation of earlier pages
+  if (fixed->generation != pmap_get_generation(fixed->as)) {
+    memset(fixed->kaddr, 0, fixed->page_cnt * sizeof (void *));
+    fixed->generation = pmap_get_generation(fixed->as);
+  }
+  
+  buf = &fixed->buf[fixed->buf_cnt];
+  buf->base = base;
+  buf->ceiling = ceiling;
+  buf->page_idx = fixed->page_cnt;
+
+  fixed->page_cnt += page_cnt;
+  return fixed->buf_cnt++;
+}
+
+
+/* @brief   Take a reference to a set of fixed buffers
+ *
+ * @param   fixed, fixed buffers to reference, may be NULL
+ * @return  fixed
+ */
+struct IPCopyFixed *ipcopy_fixed_get(struct IPCopyFixed *fixed)
+{
+  if (fixed != NULL) {
+    fixed->reference_cnt++;
+  }
+  
+  return fixed;
+}
+
+
+/* @brief   Release a reference to a set of fixed buffers
+ *
+ * @param   fixed, fixed buffers to release, may be NULL
+ *
+ * The buffers are freed when the last reference is released.
+ */
+void ipcopy_fixed_put(struct IPCopyFixed *fixed)
+{
+  if (fixed == NULL) {
+    return;
+  }
+  
+  kassert(fixed->reference_cnt > 0);
+  
+  if (--fixed->reference_cnt == 0) {
+    kfree_page(fixed);
+  }
+}
+
+
+/* @brief   Lend a page of the source address space to the destination
+ *
+ * @param   dst_as, destination address space of process
+ * @param   src_as, source address space of process
+ * @param   dvaddr, page-aligned destination address in user-space
+ * @param   svaddr, page-aligned source address in user-space
+ * @return  0 if the page is now shared, 1 if the page must be copied instead
+ *
+ * Only anonymous pages can be lent. The source page is referenced and marked
+ * copy-on-write in the sender before the receiver is touched. The source page
+ * then replaces the receiver's page in its existing page table, mapped
+ * copy-on-write in the same way fork_address_space() shares pages, and the
+ * receiver's old page is released. Whichever side writes first takes a
+ * private copy in page_fault().
+ */
+static int ipcopy_lend_page(struct AddressSpace *dst_as, struct AddressSpace *src_as,
+                            vm_addr dvaddr, vm_addr svaddr)
+{
+  vm_addr spaddr;
+  vm_addr dpaddr;
+  uint32_t sflags;
+  uint32_t dflags;
+  struct Page *spage;
+  struct Page *dpage;
+
+  // Pages not yet faulted in, or copy-on-write, are resolved by the copy
+  if (pmap_extract(src_as, svaddr, &spaddr, &sflags) != 0) {
+    return 1;
+  }
+
+  if (pmap_extract(dst_as, dvaddr, &dpaddr, &dflags) != 0) {
+    return 1;
+  }
+
+  if ((sflags & PROT_READ) == 0 || (dflags & PROT_WRITE) == 0) {
+    return 1;
+  }
+
+  if ((sflags & MAP_PHYS) || (dflags & MAP_PHYS)) {
+    return 1;
+  }
+
+  if (spaddr == dpaddr) {
+    return 0;
+  }
+
+  spage = pmap_pa_to_page(spaddr);
+  dpage = pmap_pa_to_page(dpaddr);
+
+  if (spage == NULL || dpage == NULL || spage->vnode != NULL || dpage->vnode != NULL
+      || ((spage->bflags | dpage->bflags) & B_MAPPED)
+      || ((spage->mflags | dpage->mflags) & PGF_SHARED)) {
+    return 1;
+  }
+
+  spage->reference_cnt++;
+
+  if ((sflags & (PROT_WRITE | MAP_COW)) == PROT_WRITE) {
+    if (pmap_protect(src_as, svaddr, sflags | MAP_COW) != 0) {
+      spage->reference_cnt--;
+      return 1;
+    }
+  }
+
+  if (pmap_replace(dst_as, dvaddr, spaddr, dflags | MAP_COW) != 0) {
+    spage->reference_cnt--;
+    return 1;
+  }
+
+  free_page(dpage);
+  return 0;
+}
+
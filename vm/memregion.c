@@ -183,6 +183,8 @@ struct MemRegion *memregion_create(struct AddressSpace *as, vm_offset addr,
   mr->as = as;
   mr->type = type;
   mr->flags = flags;
+  mr->vnode = NULL;
+  mr->file_offset = 0;
 
   klog_error("memregion_create success");
       
@@ -222,6 +224,10 @@ int memregion_free(struct AddressSpace *as, vm_offset addr, vm_size size)
     mr_next = DLIST_NEXT(mr, sorted_link);
 
     if (mr->base_addr >= addr && mr->ceiling_addr <= addr + size) {
+      if (mr->vnode != NULL) {
+        vnode_put(mr->vnode);
+        mr->vnode = NULL;
+      }
     
       if (mr_prev != NULL && mr_prev->type == MR_TYPE_FREE) {
         /* mr_prev is on AS Free list, destroy MR and extend prev_mr */
@@ -294,6 +300,12 @@ int memregion_split(struct AddressSpace *as, vm_offset addr)
   new_mr->type = mr->type;
   new_mr->flags = mr->flags;
   new_mr->as = as;
+  new_mr->vnode = mr->vnode;
+  new_mr->file_offset = mr->file_offset + (addr - mr->base_addr);
+
+  if (new_mr->vnode != NULL) {
+    vnode_ref(new_mr->vnode);
+  }
     
   if (new_mr->type == MR_TYPE_FREE) {
     DLIST_ADD_HEAD(&as->free_memregion_list, new_mr, free_link);  
@@ -332,6 +344,11 @@ void memregion_free_all(struct AddressSpace *as)
     }
 
     DLIST_REM_HEAD(&as->sorted_memregion_list, sorted_link);
+
+    if (mr->vnode != NULL) {
+      vnode_put(mr->vnode);
+      mr->vnode = NULL;
+    }
     
     mr->as = NULL;
     mr->type = MR_TYPE_UNALLOCATED;
@@ -371,6 +388,7 @@ int init_memregions(struct AddressSpace *as)
   mr->as = as;
   mr->flags = 0;
   mr->phys_base_addr = 0;
+  mr->vnode = NULL;
   return 0;
 }
 
@@ -404,6 +422,12 @@ int fork_memregions(struct AddressSpace *new_as, struct AddressSpace *old_as)
     new_mr->flags = old_mr->flags;
     new_mr->phys_base_addr = old_mr->phys_base_addr;
     new_mr->as = new_as;
+    new_mr->vnode = old_mr->vnode;
+    new_mr->file_offset = old_mr->file_offset;
+
+    if (new_mr->vnode != NULL) {
+      vnode_ref(new_mr->vnode);
+    }
         
     if (new_mr->type == MR_TYPE_FREE) {
       DLIST_ADD_TAIL(&new_as->free_memregion_list, new_mr, free_link);
@@ -20,6 +20,7 @@
 #include <kernel/arch.h>
 #include <kernel/dbg.h>
 #include <kernel/error.h>
+#include <kernel/filesystem.h>
 #include <kernel/globals.h>
 #include <sys/queue2.h>
 #include <kernel/proc.h>
@@ -33,15 +34,24 @@
 KLOG_REGISTER(LOG_VM_MMAP)
 
 
+// Static prototypes
+static void *mmap_file(struct AddressSpace *as, vm_addr addr, size_t len, uint32_t flags,
+                       bool shared, int fd, off_t offset);
+
+
 /* @brief   Allocate and map an area of memory
  *
  * @param   _addr,
  * @param   len,
  * @param   prot,
  * @param   flags,
- * @param   fd,
- * @param   offset,
+ * @param   fd, file to map, or -1 for anonymous memory
+ * @param   offset, page-aligned offset within the file, or physical address
+ *                  if MAP_PHYS is set
  * @return  Address of the mapped area or MAP_FAILED on failure
+ *
+ * Anonymous memory is allocated and mapped immediately.  Files are mapped
+ * lazily from the file cache by the page fault handler, see mmap_file().
  */
 void *sys_mmap(void *_addr, size_t len, int prot, int flags, int fd, off_t offset)
 {
@@ -54,9 +64,11 @@ void *sys_mmap(void *_addr, size_t len, int prot, int flags, int fd, off_t offse
   struct Page *page;
   struct MemRegion *mr;
   uint64_t privileges;
+  bool shared;
     
   klog_info("sys_mmap(_addr:%08x, len:%08x)", (uint32_t)_addr, (uint32_t)len);
   
+  shared = (flags & MAP_SHARED) ? true : false;
   flags &= VM_FLAGS_MASK;
   prot &= VM_PROT_MASK;
   
@@ -76,9 +88,13 @@ void *sys_mmap(void *_addr, size_t len, int prot, int flags, int fd, off_t offse
   as = &current->as;
   addr = ALIGN_DOWN((vm_addr)_addr, PAGE_SIZE);
   len = ALIGN_UP(len, PAGE_SIZE);
-  offset = ALIGN_DOWN(offset, PAGE_SIZE);
-  
   flags = (flags & ~VM_SYSTEM_MASK) | MAP_USER | prot;
+
+  if (fd != -1 && (flags & MAP_PHYS) == 0) {
+    return mmap_file(as, addr, len, flags, shared, fd, offset);
+  }
+
+  offset = ALIGN_DOWN(offset, PAGE_SIZE);
   
   mr = memregion_create(as, addr, len, flags, MR_TYPE_ALLOC);
   
@@ -143,6 +159,77 @@ cleanup:
 }
 
 
+/* @brief   Create a mapping of a file
+ *
+ * @param   as, address space to map the file into
+ * @param   addr, page-aligned address, used if MAP_FIXED is set
+ * @param   len, page-aligned length of the mapping
+ * @param   flags, protection and mapping flags of the region
+ * @param   shared, true for MAP_SHARED, false for MAP_PRIVATE
+ * @param   fd, file descriptor of a regular file
+ * @param   offset, page-aligned offset within the file
+ * @return  Address of the mapped area or MAP_FAILED on failure
+ *
+ * No pages are mapped here.  The region holds a reference to the vnode and
+ * do_page_fault() maps the file's blocks from the file cache on first access.
+ * Stores to a MAP_SHARED region modify the cached blocks and are written back
+ * to the file, stores to a MAP_PRIVATE region are made to private copies.
+ */
+static void *mmap_file(struct AddressSpace *as, vm_addr addr, size_t len, uint32_t flags,
+                       bool shared, int fd, off_t offset)
+{
+  struct Process *current;
+  struct Filp *filp;
+  struct VNode *vnode;
+  struct MemRegion *mr;
+  int access_mode;
+
+  current = get_current_process();
+  filp = filp_get(current, fd);
+  vnode = vnode_get_from_filp(filp);
+
+  if (vnode == NULL || !S_ISREG(vnode->mode)) {
+    klog_error("mmap failed, not a regular file");
+    return MAP_FAILED;
+  }
+
+  if (offset < 0 || (offset % PAGE_SIZE) != 0) {
+    klog_error("mmap failed, offset not page aligned");
+    return MAP_FAILED;
+  }
+
+  access_mode = filp->flags & O_ACCMODE;
+
+  if (access_mode == O_WRONLY) {
+    klog_error("mmap failed, file not open for reading");
+    return MAP_FAILED;
+  }
+
+  if (shared && (flags & PROT_WRITE)) {
+    if (access_mode != O_RDWR || (vnode->superblock->flags & SBF_READONLY)) {
+      klog_error("mmap failed, file not writable");
+      return MAP_FAILED;
+    }
+  }
+
+  mr = memregion_create(as, addr, len, flags,
+                        (shared) ? MR_TYPE_FILE_SHARED : MR_TYPE_FILE_PRIVATE);
+
+  if (mr == NULL) {
+    klog_error("mmap failed memregion_create");
+    return MAP_FAILED;
+  }
+
+  mr->vnode = vnode;
+  mr->file_offset = offset;
+  vnode_ref(vnode);
+
+  klog_info("%08x = mmap_file(len:%d, flags:%08x)", (uint32_t)mr->base_addr, len, flags);
+  
+  return (void *)mr->base_addr;
+}
+
+
 /* @brief   Free an area of memory belonging to a process
  *
  * @param   _addr, start address of region to free
@@ -155,6 +242,8 @@ int sys_munmap(void *_addr, size_t len)
   struct AddressSpace *as;
   vm_addr addr;
   vm_addr va;
+  vm_addr pa;
+  uint32_t flags;
 
   klog_info("sys_unmap(addr:%08x, len:%u)", (uint32_t)_addr, len);
 
@@ -165,12 +254,17 @@ int sys_munmap(void *_addr, size_t len)
   len = ALIGN_UP(len, PAGE_SIZE);
 
   for (va = addr; va < addr + len; va += PAGE_SIZE) {
-    // FIXME: Get pageframe (pmap_extract?)  decrement ref count.  Free page if ref_cnt == 0
-    // Finish FreePageframe
+    if (pmap_extract(as, va, &pa, &flags) != 0) {
+      continue;
+    }
     
-    pmap_remove(as, va);
+    if (pmap_remove(as, va) != 0) {
+      continue;
+    }
     
-    // TODO: Free page
+    if ((flags & MAP_PHYS) == 0) {
+      free_page(pmap_pa_to_page(pa));
+    }
   }
 
   pmap_flush_tlbs();  
@@ -113,8 +113,12 @@ int ref_page(struct Page *page)
 }
 
 
-/*
+/* @brief   Release a reference to a page
+ *
+ * @param   page, anonymous page or file cache block mapped with bmap()
  *
+ * When the last reference is released an anonymous page is freed and a
+ * mapped file block is returned to the file cache.
  */
 void free_page(struct Page *page)
 {
@@ -127,6 +131,11 @@ void free_page(struct Page *page)
     return;
   }
 
+  if (page->bflags & B_MAPPED) {
+    bunmap(page);
+    return;
+  }
+  
   putblk_anon(page);
 }
 
@@ -32,35 +32,67 @@
 KLOG_REGISTER(LOG_VM_PAGEFAULT)
 
 
+// Static prototypes
+static int fault_file_page(struct AddressSpace *as, struct MemRegion *mr, vm_addr addr,
+                           bits32_t access);
+static int fault_file_page_write(struct AddressSpace *as, vm_addr addr, vm_addr paddr,
+                                 uint32_t page_flags);
+
+
 /* @brief   Page fault exception handler
  */
 int page_fault(vm_addr addr, bits32_t access)
 {
   struct Process *current;
+
+  current = get_current_process();
+
+  return do_page_fault(&current->as, addr, access);
+}
+
+
+/* @brief   Resolve a page fault within a specific address space
+ *
+ * @param   as, address space in which the fault occurred
+ * @param   addr, faulting virtual address
+ * @param   access, PROT_READ, PROT_WRITE or PROT_EXEC access that faulted
+ * @return  0 on success, -1 if the fault could not be resolved
+ *
+ * Split out from page_fault() so that the kernel can resolve copy-on-write
+ * faults on behalf of another process, such as when ipcopy() writes into a
+ * page of the receiver that is shared with the sender.
+ */
+int do_page_fault(struct AddressSpace *as, vm_addr addr, bits32_t access)
+{
   uint32_t page_flags;
   vm_addr paddr;
   vm_addr src_kva;
   vm_addr dst_kva;
   struct Page *page;
+  struct MemRegion *mr;
 
   klog_info("page_fault(addr:%08x, access:%08x)", addr, access);
-  	
-  current = get_current_process();
  
   addr = ALIGN_DOWN(addr, PAGE_SIZE);
   
-  // TODO:  Add MemRegion lookup here
-  // Handle lazy mapping
-  
-  
-  if (pmap_extract(&current->as, addr, &paddr, &page_flags) != 0) {
-    // Page is not present    
-    // FIXME: For map_lazy we need to find segment, determine attributes and map page in
-    return -1;
+  if (pmap_extract(as, addr, &paddr, &page_flags) != 0) {
+    // Page is not present, only file mappings are populated lazily
+    mr = memregion_find_sorted(as, addr);
+    
+    if (mr == NULL || mr->vnode == NULL) {
+      return -1;
+    }
+    
+    return fault_file_page(as, mr, addr, access);
   }
 	
 	klog_info("extract paddr:%08x, page_flags:%08x", paddr, page_flags);
 
+  if ((page_flags & MAP_PHYS) == 0 && (access & PROT_WRITE)
+      && (pmap_pa_to_page(paddr)->bflags & B_MAPPED)) {
+    return fault_file_page_write(as, addr, paddr, page_flags);
+  }
+
   if ((page_flags & MAP_PHYS) == MAP_PHYS) {
   	klog_info("fault page flags MAP_PHYS");
     return -1;
@@ -87,7 +119,7 @@ int page_fault(vm_addr addr, bits32_t access)
   if (page->reference_cnt > 1) {
     page->reference_cnt--;
 
-    if (pmap_remove(&current->as, addr) != 0) {
+    if (pmap_remove(as, addr) != 0) {
       klog_info("pmap_remove failed");
       return -1;
     }
@@ -105,7 +137,7 @@ int page_fault(vm_addr addr, bits32_t access)
 
     page_flags = (page_flags | PROT_WRITE) & ~MAP_COW;
 
-    if (pmap_enter(&current->as, addr, page->physical_addr, page_flags) != 0) {
+    if (pmap_enter(as, addr, page->physical_addr, page_flags) != 0) {
       free_page(page);
       klog_info("pmap_enter failed");
       return -1;
@@ -116,7 +148,7 @@ int page_fault(vm_addr addr, bits32_t access)
     
     // FIXME: Add pmap_modify(as, PMAP_MOD_PADDR | PMAP_MOD_FLAGS, paddr, page_flags); 
     
-    if (pmap_remove(&current->as, addr) != 0) {
+    if (pmap_remove(as, addr) != 0) {
       klog_info("pmap_remove on  refcnt==1 failed");
 
       return -1;
@@ -124,7 +156,7 @@ int page_fault(vm_addr addr, bits32_t access)
 
     page_flags = (page_flags | PROT_WRITE) & ~MAP_COW;
 
-    if (pmap_enter(&current->as, addr, paddr, page_flags) != 0) {
+    if (pmap_enter(as, addr, paddr, page_flags) != 0) {
       page->reference_cnt--;
       
       
@@ -141,3 +173,160 @@ int page_fault(vm_addr addr, bits32_t access)
   return 0;
 }
 
+
+
+/* @brief   Map a block of a file into a file mapping on first access
+ *
+ * @param   as, address space in which the fault occurred
+ * @param   mr, file mapping containing the faulting address
+ * @param   addr, page-aligned faulting address
+ * @param   access, PROT_READ, PROT_WRITE or PROT_EXEC access that faulted
+ * @return  0 on success, -1 if the fault could not be resolved
+ *
+ * The block is mapped directly from the file cache.  A MAP_SHARED block is
+ * mapped read-only until it is first written so that writes mark it dirty,
+ * see bmap_dirty().  A MAP_PRIVATE block is mapped copy-on-write, or copied
+ * immediately if the fault was a write.
+ */
+static int fault_file_page(struct AddressSpace *as, struct MemRegion *mr, vm_addr addr,
+                           bits32_t access)
+{
+  struct Page *page;
+  struct Page *copy = NULL;
+  off64_t file_offset;
+  uint32_t flags;
+
+  if ((mr->flags & access) != access) {
+    klog_info("file page fault, access not permitted");
+    return -1;
+  }
+
+  file_offset = mr->file_offset + (addr - mr->base_addr);
+
+  if (file_offset >= mr->vnode->size) {
+    klog_info("file page fault beyond end of file");
+    return -1;
+  }
+
+  if ((page = bmap(mr->vnode, file_offset)) == NULL) {
+    return -1;
+  }
+
+  if (mr->type == MR_TYPE_FILE_PRIVATE && (access & PROT_WRITE)) {
+    if ((copy = alloc_page()) == NULL) {
+      free_page(page);
+      return -1;
+    }
+
+    copy->reference_cnt = 1;
+    memcpy(copy->vaddr, page->vaddr, PAGE_SIZE);
+  }
+
+  // Another thread may have resolved the fault while bmap() or alloc_page() slept
+  if (pmap_is_page_present(as, addr)) {
+    if (copy != NULL) {
+      free_page(copy);
+    }
+
+    free_page(page);
+    return 0;
+  }
+
+  if (copy != NULL) {
+    free_page(page);
+    page = copy;
+    flags = mr->flags;
+  } else if (mr->type == MR_TYPE_FILE_SHARED && (access & PROT_WRITE)) {
+    bmap_dirty(page);
+    flags = mr->flags;
+  } else if (mr->type == MR_TYPE_FILE_SHARED) {
+    flags = mr->flags & ~PROT_WRITE;
+  } else if (mr->flags & PROT_WRITE) {
+    flags = mr->flags | MAP_COW;
+  } else {
+    flags = mr->flags;
+  }
+
+  if (pmap_enter(as, addr, page->physical_addr, flags) != 0) {
+    klog_info("pmap_enter failed");
+    free_page(page);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/* @brief   Handle a write fault on a file cache block mapped from a file
+ *
+ * @param   as, address space in which the fault occurred
+ * @param   addr, page-aligned faulting address
+ * @param   paddr, physical address of the mapped block
+ * @param   page_flags, current flags of the mapping
+ * @return  0 on success, -1 if the fault could not be resolved
+ *
+ * A MAP_SHARED block is marked dirty and made writable, waiting first if it
+ * is being written back.  A MAP_PRIVATE block is always copied, as the
+ * mapping's reference is not the only reference to a cached block.
+ */
+static int fault_file_page_write(struct AddressSpace *as, vm_addr addr, vm_addr paddr,
+                                 uint32_t page_flags)
+{
+  struct MemRegion *mr;
+  struct Page *page;
+  struct Page *copy;
+  vm_addr current_paddr;
+
+  page = pmap_pa_to_page(paddr);
+  mr = memregion_find_sorted(as, addr);
+
+  if (mr == NULL || (mr->flags & PROT_WRITE) == 0) {
+    klog_info("file page write fault, region not writable");
+    return -1;
+  }
+
+  if (mr->type == MR_TYPE_FILE_SHARED) {
+    if (page->bflags & B_BUSY) {
+      // Retry the write once writeback of the block completes
+      TaskSleep(&page->rendez);
+      return 0;
+    }
+
+    // A block truncated from the file while mapped is no longer written back
+    if (page->vnode != NULL) {
+      bmap_dirty(page);
+    }
+
+    return pmap_protect(as, addr, page_flags | PROT_WRITE);
+  }
+
+  if ((copy = alloc_page()) == NULL) {
+    klog_info("alloc_page failed");
+    return -1;
+  }
+
+  copy->reference_cnt = 1;
+  memcpy(copy->vaddr, page->vaddr, PAGE_SIZE);
+
+  // The mapping may have changed while alloc_page() slept
+  if (pmap_extract(as, addr, &current_paddr, NULL) != 0 || current_paddr != paddr) {
+    free_page(copy);
+    return 0;
+  }
+
+  if (pmap_remove(as, addr) != 0) {
+    free_page(copy);
+    return -1;
+  }
+
+  free_page(page);
+
+  if (pmap_enter(as, addr, copy->physical_addr, (page_flags | PROT_WRITE) & ~MAP_COW) != 0) {
+    klog_info("pmap_enter failed");
+    free_page(copy);
+    return -1;
+  }
+
+  return 0;
+}
+
@@ -0,0 +1,115 @@
+/*
+ * Copyright 2014  Marven Gilhespie
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * --
+ * Pool of pre-zeroed pages.
+ *
+ * Anonymous memory and newly allocated cache blocks must be zero filled.
+ * Rather than clearing each page inside the system call that allocates it,
+ * the low priority zero-kt kernel thread clears free pages in the background
+ * and moves them to the zero page queue.  These pages are marked B_ERASED and
+ * are handed out by getblk_anon() in preference to other free pages, so
+ * they do not need to be cleared again.
+ *
+ * The kernel is not preemptive, so pages are cleared in small batches with
+ * the thread sleeping in between to let other threads run.
+ */
+
+#include <kernel/dbg.h>
+#include <kernel/filesystem.h>
+#include <kernel/globals.h>
+#include <kernel/proc.h>
+#include <kernel/timer.h>
+#include <kernel/types.h>
+#include <kernel/vm.h>
+#include <string.h>
+
+KLOG_REGISTER(LOG_VM_ZEROPAGE)
+
+
+// Static prototypes
+static int zero_free_pages(int cnt);
+
+
+/* @brief   Wake the zero page task if the pool of zeroed pages is running low
+ */
+void check_zero_page_low(void)
+{
+  if (zero_page_cnt < ZERO_POOL_LOW_PAGES) {
+    TaskWakeup(&zero_page_rendez);
+  }
+}
+
+
+/* @brief   Kernel task that keeps a pool of zero filled pages
+ *
+ * @param   arg, unused
+ */
+void zero_page_task(void *arg)
+{
+  struct timespec timeout;
+  int ticks;
+
+  while (1) {
+    if (zero_free_pages(ZERO_POOL_BATCH_PAGES) == ZERO_POOL_BATCH_PAGES) {
+      ticks = 1;
+    } else {
+      ticks = ZERO_POOL_INTERVAL_TICKS;
+    }
+
+    timeout.tv_sec = ticks / JIFFIES_PER_SECOND;
+    timeout.tv_nsec = (ticks % JIFFIES_PER_SECOND) * NANOSECONDS_PER_JIFFY;
+
+    TaskSleepInterruptible(&zero_page_rendez, &timeout, INTRF_NONE);
+  }
+}
+
+
+/* @brief   Clear free pages and move them to the zero page queue
+ *
+ * @param   cnt, maximum number of pages to clear
+ * @return  number of pages cleared
+ *
+ * Stops early once the pool holds ZERO_POOL_MAX_PAGES or there are no
+ * uncleared free pages left.
+ */
+static int zero_free_pages(int cnt)
+{
+  struct Page *page;
+  int t;
+
+  for (t = 0; t < cnt; t++) {
+    if (zero_page_cnt >= ZERO_POOL_MAX_PAGES) {
+      break;
+    }
+
+    if ((page = DLIST_HEAD(&free_page_queue)) == NULL) {
+      break;
+    }
+
+    remove_from_free_page_queue(page);
+    page->bflags |= B_BUSY;
+
+    memset(page->vaddr, 0, PAGE_SIZE);
+
+    page->bflags &= ~B_BUSY;
+    page->bflags |= B_ERASED;
+    add_to_free_page_queue(page);
+  }
+
+  klog_info("zero_free_pages, cleared:%d, pool:%d", t, zero_page_cnt);
+  return t;
+}
+